@@ -1,4 +1,23 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <libecap/common/autoconf.h>
 #include <libecap/common/registry.h>
 #include <libecap/common/errors.h>
@@ -9,16 +28,92 @@
 #include <libecap/common/named_values.h>
 #include <libecap/adapter/service.h>
 #include <libecap/adapter/xaction.h>
+#include <libecap/host/host.h>
 #include <libecap/host/xaction.h>
 #include "Debug.h"
+#include "cdebug.h"
 #include "filter.h"
 
 #define PACKAGE_VERSION "1.0.0"
+#define DEFAULT_CACHE_SIZE 16384
+#define DEFAULT_BLOOM_FPR 0.01
+#define DEFAULT_ASYNC_WORKERS 4
+#define DEFAULT_ASYNC_QUEUE_SIZE 1024
+#define DEFAULT_STATS_INTERVAL 60
+#define DEFAULT_SHARED_PATH "/dev/shm/ecap_adapter_filter.snapshot"
+// seconds between attempts to build index of background start without reload_interval
+#define START_RETRY_INTERVAL 10
+// jobs taken by worker at once
+#define LOOKUP_BATCH_SIZE 16
+#define DEFAULT_BLOCK_STATUS 403
+// block_page file is read whole into memory
+#define BLOCK_PAGE_SIZE_MAX 65536
 
 namespace Adapter { // not required, but adds clarity
 
+// Filter generation: destructed when the service and the last transaction
+// using it drop their pointers.
+typedef std::shared_ptr<filter_struct> FilterPointer;
+
+class Xaction;
+
+// Response to denied requests with block_response=page: built on configure,
+// then shared by transactions and never changed, so serving it copies nothing.
+struct BlockPage {
+	int status;
+	std::string reason;
+	std::string body;
+	std::string contentLength;
+	libecap::Name categoryHeader; // unidentified -- none
+};
+typedef std::shared_ptr<const BlockPage> BlockPagePointer;
+
+// Lookup of asynchronous transaction, made by LookupPool worker.
+struct LookupJob {
+	Xaction *xaction; // NULL if transaction ended before lookup, main thread only
+	FilterPointer filter;
+	std::string uri; // copy: host buffer is not kept while waiting
+	int uri_is_authority;
+	filter_group_type group;
+	filter_uri_result_enum result;
+};
+typedef std::shared_ptr<LookupJob> LookupJobPointer;
+
+// Worker threads making lookups of asynchronous transactions.
+// Finished jobs are collected by main thread in Service::resume().
+class LookupPool {
+	public:
+		LookupPool(unsigned int workersNumber, size_t aQueueSize);
+		~LookupPool(); // stop()
+
+		// workers finish queued jobs and exit, their results stay to be taken
+		void stop();
+		bool submit(const LookupJobPointer &job); // false if queue is full or pool is stopped
+		void takeDone(std::vector<LookupJobPointer> &jobs);
+		bool hasPending() const { return pending.load(std::memory_order_relaxed) > 0; }
+		bool hasDone() const { return doneReady.load(std::memory_order_acquire); }
+		bool isStopped() const { return workers.empty(); } // main thread only
+
+	private:
+		void work();
+
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable cond;
+		bool stopping;
+		std::deque<LookupJobPointer> queue;
+		size_t queueSize;
+		std::vector<LookupJobPointer> done;
+		std::atomic<bool> doneReady;
+		std::atomic<size_t> pending; // submitted and not taken by main thread
+};
+typedef std::shared_ptr<LookupPool> LookupPoolPointer;
+
 class Service: public libecap::adapter::Service {
 	public:
+		Service();
+		virtual ~Service();
+
 		// About
 		virtual std::string uri() const; // unique across all vendors
 		virtual std::string tag() const; // changes with version and config
@@ -34,6 +129,11 @@ class Service: public libecap::adapter::Service {
 		virtual void stop(); // no more makeXaction() calls until start()
 		virtual void retire(); // no more makeXaction() calls
 
+		// Asynchronous transactions: lookups are made by worker threads
+		virtual bool makesAsyncXactions() const;
+		virtual void suspend(timeval &timeout);
+		virtual void resume();
+
 		// Scope (XXX: this may be changed to look at the whole header)
 		virtual bool wantsUrl(const char *url) const;
 
@@ -41,10 +141,89 @@ class Service: public libecap::adapter::Service {
 		virtual MadeXactionPointer makeXaction(libecap::host::Xaction *hostx);
 
 	private:
-		filter_struct *filter;
+		filter_config_struct filterConfig() const;
+		BlockPagePointer makeBlockPage() const;
+		bool groupsAreSelectable() const;
+		filter_group_type groupOf(libecap::host::Xaction *hostx) const;
+		void startReloader(bool buildIndex);
+		void stopReloader();
+		void reloaderLoop();
+		void waitReloader(std::unique_lock<std::mutex> &lock);
+		void usePendingFilter() const;
+		void startStatsDumper();
+		void stopStatsDumper();
+		void statsDumperLoop(const std::string path, unsigned int interval);
+		void setStatsFilter(const FilterPointer &f) const;
+		void stopLookupPool();
+		void deliverLookups();
+
+		// current generation, used by main thread only;
+		// mutable: new generation is also taken in wantsUrl()
+		mutable FilterPointer filter;
 		std::string db_uri;
 		std::string default_policy;
 		bool default_policy_is_allow;
+		bool background_start; // start() returns before index is built, applied on start()
+		std::string start_policy; // sqlite, allow or deny: decides requests until index is built
+		bool start_policy_is_allow;
+		std::string index;
+		std::string shared_path; // index=shared: snapshot shared by squid workers
+		bool suffix_match;
+		unsigned int reload_interval; // seconds, 0 -- do not watch db file
+		size_t cache_size; // verdict cache entries per thread, 0 -- no cache
+		double bloom_fpr; // index=sqlite: Bloom filter false positive rate, 0 -- no filter
+		libecap::Name group_header; // meta header with group_id of client, unidentified -- none
+		bool async; // applied on start()
+		unsigned int async_workers;
+		size_t async_queue_size;
+		// NULL if not async; stopped pool is kept until its results are delivered
+		LookupPoolPointer lookupPool;
+		std::vector<LookupJobPointer> doneJobs;
+		bool stats; // count lookups and measure backend time
+		std::string stats_path; // file or unix:<socket> to dump stats to, empty -- no dump
+		unsigned int stats_interval; // seconds between dumps
+		std::string block_response; // host or page: who answers denied requests
+		int block_status; // block_response=page: 403 or 451
+		std::string block_page_path; // body of block page, empty -- built-in page
+		libecap::Name block_category_header; // response header with denied category, unidentified -- none
+		BlockPagePointer blockPage; // NULL if host blocks denied requests
+
+		// Stats dumper thread writes stats of current generation every
+		// stats_interval; counters start from zero when db is reloaded.
+		std::thread statsDumper;
+		mutable std::mutex statsMutex;
+		std::condition_variable statsCond;
+		bool statsDumperStopping;
+		mutable FilterPointer statsFilter; // current generation, under statsMutex
+
+		// Reloader thread builds new generation when db file changes or on
+		// reconfigure and leaves it in pendingFilter; main thread swaps it in
+		// on the next makeXaction(). New generation is not built until the
+		// pending one is taken, so at most one extra generation exists.
+		std::thread reloader;
+		mutable std::mutex reloaderMutex;
+		mutable std::condition_variable reloaderCond;
+		bool reloaderStopping;
+		bool rebuildRequested;
+		std::string reloaderDbUri;
+		filter_config_struct reloaderConfig; // shared_path is set from reloaderSharedPath
+		std::string reloaderSharedPath;
+		unsigned int reloaderInterval;
+		bool reloaderIndexLoading; // index of background start is not built yet
+		FilterPointer latestFilter; // the last built generation, to watch its db
+		mutable FilterPointer pendingFilter;
+		mutable std::atomic<bool> pendingFilterReady;
+
+		// URLs looked up by wantsUrl() and requests it decided without transaction
+		mutable uint64_t urlChecks;
+		mutable uint64_t xactionsAvoided;
+
+		// Background start: requests are decided by interim sqlite filter or
+		// start_policy until the first generation built by reloader is taken.
+		mutable bool indexLoading;
+		mutable uint64_t interimRequests; // requests decided while index was loading
+		std::chrono::steady_clock::time_point startTime;
+		mutable uint64_t indexLoadMs; // from start() to switch-over
 };
 
 
@@ -62,7 +241,10 @@ class Cfgtor: public libecap::NamedValueVisitor {
 
 class Xaction: public libecap::adapter::Xaction {
 	public:
-		Xaction(libecap::host::Xaction *x, const filter_struct *f, bool d);
+		Xaction(
+			libecap::host::Xaction *x, const FilterPointer &f, filter_group_type g, bool d,
+			const LookupPoolPointer &p, const BlockPagePointer &b
+		);
 		virtual ~Xaction();
 
 		// meta-information for the host transaction
@@ -73,15 +255,18 @@ class Xaction: public libecap::adapter::Xaction {
 		virtual void start();
 		virtual void stop();
 
-		// adapted body transmission control
-		virtual void abDiscard() { noBodySupport(); }
-		virtual void abMake() { noBodySupport(); }
-		virtual void abMakeMore() { noBodySupport(); }
-		virtual void abStopMaking() { noBodySupport(); }
+		// called by Service::resume() with result of asynchronous lookup
+		void lookupDone(filter_uri_result_enum result);
+
+		// adapted body transmission control: body of block page only
+		virtual void abDiscard();
+		virtual void abMake();
+		virtual void abMakeMore() {} // whole body is available at once
+		virtual void abStopMaking();
 
 		// adapted body content extraction and consumption
-		virtual libecap::Area abContent(libecap::size_type, libecap::size_type) { noBodySupport(); return libecap::Area(); }
-		virtual void abContentShift(libecap::size_type)  { noBodySupport(); }
+		virtual libecap::Area abContent(libecap::size_type offset, libecap::size_type size);
+		virtual void abContentShift(libecap::size_type size);
 
 		// virgin body state notification
 		virtual void noteVbContentDone(bool) { noBodySupport(); }
@@ -92,12 +277,23 @@ class Xaction: public libecap::adapter::Xaction {
 
 	private:
 		libecap::host::Xaction *hostx; // Host transaction rep
-		const filter_struct *filter;
+		const FilterPointer filter; // generation is kept until transaction ends
+		const filter_group_type group; // policy group of client
 		bool default_policy_is_allow;
+		const LookupPoolPointer lookupPool; // NULL if lookup is synchronous
+		LookupJobPointer job; // asynchronous lookup in progress
+		const BlockPagePointer blockPage; // NULL if host blocks denied request
+		bool sendingBlockPage; // between abMake() and the end of body
+		libecap::size_type blockPageOffset; // body bytes the host has taken
 
 		typedef const libecap::RequestLine *CLRLP;
 		CLRLP getRequestLine() const;
 		bool isAllowedUri() const;
+		bool isAllowedResult(filter_uri_result_enum result) const;
+		bool startLookup();
+		void useResult(bool allowed);
+		void useBlockPage();
+		void cancelLookup();
 };
 
 } // namespace Adapter
@@ -105,6 +301,22 @@ class Xaction: public libecap::adapter::Xaction {
 static const std::string CfgErrorPrefix =
 	"Filter Adapter: configuration error: ";
 
+Adapter::Service::Service():
+		default_policy_is_allow(false), background_start(false), start_policy("sqlite"), start_policy_is_allow(false),
+		shared_path(DEFAULT_SHARED_PATH), suffix_match(false), reload_interval(0),
+		cache_size(DEFAULT_CACHE_SIZE), bloom_fpr(DEFAULT_BLOOM_FPR), async(false),
+		async_workers(DEFAULT_ASYNC_WORKERS), async_queue_size(DEFAULT_ASYNC_QUEUE_SIZE),
+		stats(true), stats_interval(DEFAULT_STATS_INTERVAL),
+		block_response("host"), block_status(DEFAULT_BLOCK_STATUS), statsDumperStopping(false),
+		reloaderStopping(false), rebuildRequested(false), reloaderInterval(0), reloaderIndexLoading(false),
+		pendingFilterReady(false), urlChecks(0), xactionsAvoided(0),
+		indexLoading(false), interimRequests(0), indexLoadMs(0) {}
+
+Adapter::Service::~Service() {
+	stopReloader();
+	stopStatsDumper();
+}
+
 std::string Adapter::Service::uri() const {
 	return "ecap://e-cap.org/ecap/services/sample/minimal";
 }
@@ -113,8 +325,94 @@ std::string Adapter::Service::tag() const {
 	return PACKAGE_VERSION;
 }
 
+static uint64_t backendNs(const filter_stats_struct &stats, double quantile) {
+	return histogram_value_at_quantile(&stats.backend_ticks, quantile) * stats.ns_per_tick;
+}
+
+// one line JSON object
+static void writeStatsJson(std::ostream &os, const filter_stats_struct &stats) {
+	os << "{\"time\":" << time(NULL) <<
+		",\"lookups\":{\"allow\":" << stats.lookups[FILTER_URI_ALLOW] <<
+		",\"deny\":" << stats.lookups[FILTER_URI_DENY] <<
+		",\"unlisted\":" << stats.lookups[FILTER_URI_DOESNT_EXIST] <<
+		",\"error\":" << stats.lookups[FILTER_URI_ERROR] << "}" <<
+		",\"parse_failures\":" << stats.parse_failures <<
+		",\"pattern_denials\":" << stats.pattern_denials <<
+		",\"backend_ns\":{\"count\":" << histogram_count(&stats.backend_ticks) <<
+		",\"p50\":" << backendNs(stats, 0.5) <<
+		",\"p90\":" << backendNs(stats, 0.9) <<
+		",\"p99\":" << backendNs(stats, 0.99) <<
+		",\"p999\":" << backendNs(stats, 0.999) <<
+		",\"max\":" << backendNs(stats, 1) << "}" <<
+		",\"cache\":{\"hits\":" << stats.cache_hits <<
+		",\"misses\":" << stats.cache_misses <<
+		",\"evictions\":" << stats.cache_evictions << "}" <<
+		",\"bloom\":{\"checks\":" << stats.bloom_checks <<
+		",\"skips\":" << stats.bloom_skips <<
+		",\"false_positives\":" << stats.bloom_false_positives << "}}\n";
+}
+
+static bool writeStatsToSocket(const std::string &path, const std::string &line) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) return false;
+	memcpy(addr.sun_path, path.data(), path.size());
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return false;
+	bool ok = (connect(fd, (const sockaddr *)&addr, sizeof(addr)) == 0);
+	for (size_t written=0; ok && written<line.size(); ) {
+		ssize_t res = write(fd, line.data() + written, line.size() - written);
+		ok = (res > 0);
+		if (ok) written += res;
+	}
+	close(fd);
+	return ok;
+}
+
+// written into temporary file and renamed, so readers see whole line
+static bool writeStatsToFile(const std::string &path, const std::string &line) {
+	const std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream f(tmpPath.c_str(), std::ios::out | std::ios::trunc);
+		if (!(f << line)) return false;
+	}
+	return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
 void Adapter::Service::describe(std::ostream &os) const {
 	os << "Filter adapter v" << PACKAGE_VERSION;
+	if (filter) {
+		filter_stats_struct stats;
+		filter_get_stats(filter.get(), &stats);
+		if (this->stats) {
+			os << ", lookups allowed " << stats.lookups[FILTER_URI_ALLOW] <<
+				", denied " << stats.lookups[FILTER_URI_DENY] <<
+				", unlisted " << stats.lookups[FILTER_URI_DOESNT_EXIST] <<
+				", errors " << stats.lookups[FILTER_URI_ERROR] <<
+				" (parse failures " << stats.parse_failures << ")" <<
+				", denied by patterns " << stats.pattern_denials <<
+				", backend p50 " << backendNs(stats, 0.5) << "ns" <<
+				", p99 " << backendNs(stats, 0.99) << "ns";
+		}
+		os << ", cache hits " << stats.cache_hits <<
+			", misses " << stats.cache_misses <<
+			", evictions " << stats.cache_evictions;
+		if (stats.bloom_checks > 0) {
+			os << ", bloom fpr " << bloom_fpr <<
+				", queries skipped " << stats.bloom_skips << " of " << stats.bloom_checks <<
+				" (" << (100.0 * stats.bloom_skips / stats.bloom_checks) << "%)" <<
+				", false positives " << stats.bloom_false_positives;
+		}
+	}
+	os << ", urls checked " << urlChecks << ", transactions avoided " << xactionsAvoided;
+	if (background_start) {
+		if (indexLoading)
+			os << ", index loading";
+		else
+			os << ", index loaded in " << indexLoadMs << "ms";
+		os << ", requests decided by start_policy " << interimRequests;
+	}
 }
 
 void Adapter::Service::configure(const libecap::Options &cfg) {
@@ -126,12 +424,48 @@ void Adapter::Service::configure(const libecap::Options &cfg) {
 	// check for post-configuration errors and inconsistencies
 	if (db_uri.empty()) throw libecap::TextException(CfgErrorPrefix + "db_uri value is not set");
 	if (default_policy.empty()) throw libecap::TextException(CfgErrorPrefix + "db_uri value is not set");
+	if (background_start && start_policy == "sqlite" && index == "snapshot")
+		throw libecap::TextException(CfgErrorPrefix + "start_policy=sqlite needs database db_uri, not snapshot");
+	blockPage = (block_response == "page" ? makeBlockPage() : BlockPagePointer());
 }
 
 void Adapter::Service::reconfigure(const libecap::Options &cfg) {
 	db_uri.clear();
 	default_policy.clear();
+	background_start = false;
+	start_policy = "sqlite";
+	index.clear();
+	shared_path = DEFAULT_SHARED_PATH;
+	suffix_match = false;
+	reload_interval = 0;
+	cache_size = DEFAULT_CACHE_SIZE;
+	bloom_fpr = DEFAULT_BLOOM_FPR;
+	group_header = libecap::Name();
+	async = false;
+	async_workers = DEFAULT_ASYNC_WORKERS;
+	async_queue_size = DEFAULT_ASYNC_QUEUE_SIZE;
+	stats = true;
+	stats_path.clear();
+	stats_interval = DEFAULT_STATS_INTERVAL;
+	block_response = "host";
+	block_status = DEFAULT_BLOCK_STATUS;
+	block_page_path.clear();
+	block_category_header = libecap::Name();
 	configure(cfg);
+	default_policy_is_allow = (default_policy == "allow");
+
+	// running service keeps current generation until the new one is built
+	if (reloader.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(reloaderMutex);
+			reloaderDbUri = db_uri;
+			reloaderConfig = filterConfig();
+			reloaderSharedPath = shared_path;
+			reloaderInterval = reload_interval;
+			rebuildRequested = true;
+		}
+		reloaderCond.notify_all();
+	}
 }
 
 void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &valArea) {
@@ -147,6 +481,94 @@ void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &va
 		if (!(value == "allow" || value == "deny"))
 			throw libecap::TextException(CfgErrorPrefix + "unsupported default_policy value");
 		default_policy = value;
+	} else if (name == "start") {
+		if (!(value == "wait" || value == "background"))
+			throw libecap::TextException(CfgErrorPrefix + "unsupported start value");
+		background_start = (value == "background");
+	} else if (name == "start_policy") {
+		if (!(value == "sqlite" || value == "allow" || value == "deny"))
+			throw libecap::TextException(CfgErrorPrefix + "unsupported start_policy value");
+		start_policy = value;
+	} else if (name == "index") {
+		if (!(value == "sqlite" || value == "hash" || value == "compact" || value == "snapshot" || value == "shared"))
+			throw libecap::TextException(CfgErrorPrefix + "unsupported index value");
+		index = value;
+	} else if (name == "shared_path") {
+		if (value.empty())
+			throw libecap::TextException(CfgErrorPrefix + "empty shared_path value is not allowed");
+		shared_path = value;
+	} else if (name == "suffix_match") {
+		if (!(value == "on" || value == "off"))
+			throw libecap::TextException(CfgErrorPrefix + "unsupported suffix_match value");
+		suffix_match = (value == "on");
+	} else if (name == "reload_interval") {
+		char *end;
+		unsigned long interval = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || interval > 86400)
+			throw libecap::TextException(CfgErrorPrefix + "unsupported reload_interval value");
+		reload_interval = interval;
+	} else if (name == "cache_size") {
+		char *end;
+		unsigned long size = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || size > 16777216)
+			throw libecap::TextException(CfgErrorPrefix + "unsupported cache_size value");
+		cache_size = size;
+	} else if (name == "bloom_fpr") {
+		char *end;
+		double fpr = strtod(value.c_str(), &end);
+		if (value.empty() || *end != '\0' || !(fpr >= 0 && fpr < 1))
+			throw libecap::TextException(CfgErrorPrefix + "unsupported bloom_fpr value");
+		bloom_fpr = fpr;
+	} else if (name == "group_header") {
+		if (value.empty())
+			throw libecap::TextException(CfgErrorPrefix + "empty group_header value is not allowed");
+		group_header = libecap::Name(value);
+	} else if (name == "async") {
+		if (!(value == "on" || value == "off"))
+			throw libecap::TextException(CfgErrorPrefix + "unsupported async value");
+		async = (value == "on");
+	} else if (name == "async_workers") {
+		char *end;
+		unsigned long workers = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || workers < 1 || workers > 64)
+			throw libecap::TextException(CfgErrorPrefix + "unsupported async_workers value");
+		async_workers = workers;
+	} else if (name == "async_queue_size") {
+		char *end;
+		unsigned long size = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || size < 1 || size > 1048576)
+			throw libecap::TextException(CfgErrorPrefix + "unsupported async_queue_size value");
+		async_queue_size = size;
+	} else if (name == "stats") {
+		if (!(value == "on" || value == "off"))
+			throw libecap::TextException(CfgErrorPrefix + "unsupported stats value");
+		stats = (value == "on");
+	} else if (name == "stats_path") {
+		if (value == "unix:")
+			throw libecap::TextException(CfgErrorPrefix + "unsupported stats_path value");
+		stats_path = value;
+	} else if (name == "stats_interval") {
+		char *end;
+		unsigned long interval = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end != '\0' || interval < 1 || interval > 86400)
+			throw libecap::TextException(CfgErrorPrefix + "unsupported stats_interval value");
+		stats_interval = interval;
+	} else if (name == "block_response") {
+		if (!(value == "host" || value == "page"))
+			throw libecap::TextException(CfgErrorPrefix + "unsupported block_response value");
+		block_response = value;
+	} else if (name == "block_status") {
+		if (!(value == "403" || value == "451"))
+			throw libecap::TextException(CfgErrorPrefix + "unsupported block_status value");
+		block_status = atoi(value.c_str());
+	} else if (name == "block_page") {
+		if (value.empty())
+			throw libecap::TextException(CfgErrorPrefix + "empty block_page value is not allowed");
+		block_page_path = value;
+	} else if (name == "block_category_header") {
+		if (value.empty())
+			throw libecap::TextException(CfgErrorPrefix + "empty block_category_header value is not allowed");
+		block_category_header = libecap::Name(value);
 	} else if (name.assignedHostId()) {
 		// skip host-standard options we do not know or care about
 	} else {
@@ -155,39 +577,470 @@ void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &va
 	}
 }
 
+filter_config_struct Adapter::Service::filterConfig() const {
+	filter_config_struct filter_config;
+	if (index == "hash")
+		filter_config.index = FILTER_INDEX_HASH;
+	else if (index == "compact")
+		filter_config.index = FILTER_INDEX_COMPACT;
+	else if (index == "snapshot")
+		filter_config.index = FILTER_INDEX_SNAPSHOT;
+	else if (index == "shared")
+		filter_config.index = FILTER_INDEX_SHARED;
+	else
+		filter_config.index = FILTER_INDEX_SQLITE;
+	filter_config.suffix_match = suffix_match;
+	filter_config.cache_size = cache_size;
+	filter_config.bloom_fpr = bloom_fpr;
+	filter_config.stats = stats;
+	filter_config.shared_path = shared_path.c_str();
+	return filter_config;
+}
+
+Adapter::BlockPagePointer Adapter::Service::makeBlockPage() const {
+	BlockPage *page = new BlockPage;
+	BlockPagePointer pagePointer(page);
+	page->status = block_status;
+	page->reason = (block_status == 451 ? "Unavailable For Legal Reasons" : "Forbidden");
+	if (block_page_path.empty()) {
+		std::ostringstream body;
+		body << "<!DOCTYPE html>\n<html><head><title>" << page->status << " " << page->reason <<
+			"</title></head>\n<body><h1>" << page->reason <<
+			"</h1><p>Access to this site is blocked by policy.</p></body></html>\n";
+		page->body = body.str();
+	} else {
+		std::ifstream f(block_page_path.c_str(), std::ios::in | std::ios::binary);
+		std::ostringstream body;
+		if (!(f && body << f.rdbuf()))
+			throw libecap::TextException(CfgErrorPrefix + "cannot read block_page " + block_page_path);
+		page->body = body.str();
+		if (page->body.size() > BLOCK_PAGE_SIZE_MAX)
+			throw libecap::TextException(CfgErrorPrefix + "block_page is larger than 65536 bytes");
+	}
+	std::ostringstream contentLength;
+	contentLength << page->body.size();
+	page->contentLength = contentLength.str();
+	page->categoryHeader = block_category_header;
+	return pagePointer;
+}
+
+// false if every client is in FILTER_GROUP_DEFAULT
+bool Adapter::Service::groupsAreSelectable() const {
+	return filter_groups_number(filter.get()) > 1 &&
+		(group_header.identified() || filter_group_networks_number(filter.get()) > 0);
+}
+
+// Group named by group_header meta header, or else group of client address
+// (sent by host as metaClientIp) in group_networks of db.
+filter_group_type Adapter::Service::groupOf(libecap::host::Xaction *hostx) const {
+	if (!filter || !groupsAreSelectable()) return FILTER_GROUP_DEFAULT;
+	if (group_header.identified()) {
+		const libecap::Area value = hostx->option(group_header);
+		if (value.size > 0) {
+			const std::string id = value.toString();
+			char *end;
+			const long long groupId = strtoll(id.c_str(), &end, 10);
+			if (*end != '\0') return FILTER_GROUP_DEFAULT;
+			return filter_group_of_id(filter.get(), groupId);
+		}
+	}
+	const libecap::Area ip = hostx->option(libecap::metaClientIp);
+	return filter_group_of_ip(filter.get(), ip.start, ip.size);
+}
+
 void Adapter::Service::start() {
 	libecap::adapter::Service::start();
-	filter = filter_construct(db_uri.c_str());
-	if (filter == NULL) throw libecap::TextException("db init error");
+	startTime = std::chrono::steady_clock::now();
+	const filter_config_struct filter_config = filterConfig();
+	filter_config_struct start_config = filter_config;
+	if (background_start && start_policy == "sqlite") {
+		// interim filter only opens db: Bloom filter would read all sites
+		start_config.index = FILTER_INDEX_SQLITE;
+		start_config.bloom_fpr = 0;
+	}
+	// index=sqlite without Bloom filter is as fast to build as interim one
+	indexLoading = background_start && (
+		start_policy != "sqlite" ||
+		filter_config.index != FILTER_INDEX_SQLITE || filter_config.bloom_fpr > 0
+	);
+	interimRequests = 0;
+	indexLoadMs = 0;
+	filter.reset();
+	if (!indexLoading || start_policy == "sqlite") {
+		filter_struct *f = filter_construct(db_uri.c_str(), &start_config);
+		if (f == NULL) throw libecap::TextException("db init error");
+		filter = FilterPointer(f, filter_destruct);
+	}
 	default_policy_is_allow = (default_policy == "allow");
+	start_policy_is_allow = (start_policy == "allow");
+	if (indexLoading)
+		Debug(ilNormal|flApplication) << "index is loading in background, start_policy " << start_policy;
+	latestFilter = filter;
+	startReloader(indexLoading);
+	setStatsFilter(filter);
+	startStatsDumper();
+	// results of pool stopped before are delivered before it is replaced
+	stopLookupPool();
+	if (lookupPool) deliverLookups();
+	lookupPool.reset();
+	if (async) lookupPool = LookupPoolPointer(new LookupPool(async_workers, async_queue_size));
 }
 
 void Adapter::Service::stop() {
-	filter_destruct(filter);
-	filter = NULL;
+	stopReloader();
+	stopStatsDumper();
+	setStatsFilter(FilterPointer());
+	stopLookupPool();
+	filter.reset();
+	latestFilter.reset();
+	pendingFilter.reset();
+	pendingFilterReady = false;
 	libecap::adapter::Service::stop();
 }
 
 void Adapter::Service::retire() {
-	// custom code would go here, but this service does not have one
+	stopReloader();
+	stopStatsDumper();
+	setStatsFilter(FilterPointer());
+	stopLookupPool();
 	libecap::adapter::Service::stop();
 }
 
+// Transactions of lookups queued or made by now are finished by resume(),
+// new transactions look up synchronously.
+void Adapter::Service::stopLookupPool() {
+	if (!lookupPool) return;
+	lookupPool->stop();
+	if (!lookupPool->hasPending()) lookupPool.reset();
+}
+
+// buildIndex -- reloader builds the first generation of background start
+void Adapter::Service::startReloader(bool buildIndex) {
+	std::lock_guard<std::mutex> lock(reloaderMutex);
+	reloaderDbUri = db_uri;
+	reloaderConfig = filterConfig();
+	reloaderSharedPath = shared_path;
+	reloaderInterval = reload_interval;
+	reloaderStopping = false;
+	reloaderIndexLoading = buildIndex;
+	rebuildRequested = buildIndex;
+	reloader = std::thread(&Adapter::Service::reloaderLoop, this);
+}
+
+void Adapter::Service::stopReloader() {
+	if (!reloader.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(reloaderMutex);
+		reloaderStopping = true;
+	}
+	reloaderCond.notify_all();
+	reloader.join();
+}
+
+// Next generation made from latest without reading whole db: new 'sites_delta'
+// rows are applied to its delta overlay, large overlay of hash index is merged.
+// Sets construct if db has to be loaded anew instead.
+static filter_struct *updateFilter(const filter_struct *latest, filter_index_enum index, bool dbChanged, bool &construct) {
+	construct = false;
+	if (dbChanged) {
+		filter_struct *updated = NULL;
+		switch (filter_apply_delta(latest, &updated)) {
+			case FILTER_DELTA_APPLIED:
+				return updated;
+			case FILTER_DELTA_RELOAD:
+				construct = true;
+				return NULL;
+			case FILTER_DELTA_NONE:
+				return NULL;
+			case FILTER_DELTA_ERROR:
+				cdebug_printf(CDEBUG_IL_CRITICAL, "db delta error, keeping previous db");
+				return NULL;
+		}
+	}
+	// compact index and shared snapshot are merged by building them anew
+	if (index != FILTER_INDEX_HASH) {
+		construct = true;
+		return NULL;
+	}
+	filter_struct *merged = filter_merge_delta(latest);
+	if (merged == NULL) cdebug_printf(CDEBUG_IL_CRITICAL, "db delta merge error, keeping previous db");
+	return merged;
+}
+
+void Adapter::Service::reloaderLoop() {
+	std::unique_lock<std::mutex> lock(reloaderMutex);
+	while (!reloaderStopping) {
+		// new generation is not built until main thread takes the pending one;
+		// db changes are applied before overlay is merged
+		const FilterPointer latest = latestFilter;
+		const bool dbChanged = !pendingFilter &&
+			reloaderInterval > 0 && latest && filter_db_is_changed(latest.get());
+		const bool mergeNeeded = !pendingFilter && latest && filter_delta_needs_merge(latest.get());
+		if (pendingFilter || !(rebuildRequested || dbChanged || mergeNeeded)) {
+			waitReloader(lock);
+			continue;
+		}
+		bool construct = rebuildRequested;
+		rebuildRequested = false;
+
+		const std::string dbUri = reloaderDbUri;
+		const std::string sharedPath = reloaderSharedPath;
+		filter_config_struct config = reloaderConfig;
+		config.shared_path = sharedPath.c_str();
+		lock.unlock();
+		filter_struct *f = NULL;
+		if (!construct)
+			f = updateFilter(latest.get(), config.index, dbChanged, construct);
+		if (construct) {
+			f = filter_construct(dbUri.c_str(), &config);
+			if (f == NULL)
+				cdebug_printf(CDEBUG_IL_CRITICAL, "db reload error, keeping previous db");
+		}
+		lock.lock();
+		if (f == NULL) {
+			// keep serving current generation, retry after interval;
+			// index of background start is built again until it succeeds
+			if (construct && reloaderIndexLoading) rebuildRequested = true;
+			waitReloader(lock);
+			continue;
+		}
+		reloaderIndexLoading = false;
+		latestFilter = FilterPointer(f, filter_destruct);
+		pendingFilter = latestFilter;
+		pendingFilterReady.store(true, std::memory_order_release);
+	}
+}
+
+void Adapter::Service::waitReloader(std::unique_lock<std::mutex> &lock) {
+	if (reloaderInterval > 0)
+		reloaderCond.wait_for(lock, std::chrono::seconds(reloaderInterval));
+	else if (reloaderIndexLoading)
+		reloaderCond.wait_for(lock, std::chrono::seconds(START_RETRY_INTERVAL));
+	else
+		reloaderCond.wait(lock);
+}
+
+void Adapter::Service::usePendingFilter() const {
+	{
+		std::lock_guard<std::mutex> lock(reloaderMutex);
+		if (pendingFilter) filter.swap(pendingFilter);
+		pendingFilter.reset(); // drop service reference to the old generation
+		pendingFilterReady.store(false, std::memory_order_relaxed);
+	}
+	reloaderCond.notify_all();
+	setStatsFilter(filter);
+	if (!indexLoading) {
+		Debug(ilNormal|flApplication) << "db reloaded";
+		return;
+	}
+	indexLoading = false;
+	indexLoadMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - startTime
+	).count();
+	Debug(ilNormal|flApplication) << "index loaded in " << indexLoadMs << "ms, " <<
+		interimRequests << " requests were decided by start_policy " << start_policy;
+}
+
+void Adapter::Service::setStatsFilter(const FilterPointer &f) const {
+	std::lock_guard<std::mutex> lock(statsMutex);
+	statsFilter = f;
+}
+
+void Adapter::Service::startStatsDumper() {
+	if (!stats || stats_path.empty()) return;
+	std::lock_guard<std::mutex> lock(statsMutex);
+	statsDumperStopping = false;
+	statsDumper = std::thread(&Adapter::Service::statsDumperLoop, this, stats_path, stats_interval);
+}
+
+void Adapter::Service::stopStatsDumper() {
+	if (!statsDumper.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(statsMutex);
+		statsDumperStopping = true;
+	}
+	statsCond.notify_all();
+	statsDumper.join();
+}
+
+// path and interval are copied: reconfigured values are used after restart
+void Adapter::Service::statsDumperLoop(const std::string path, unsigned int interval) {
+	std::unique_lock<std::mutex> lock(statsMutex);
+	const bool toSocket = (path.compare(0, 5, "unix:") == 0);
+	while (!statsDumperStopping) {
+		statsCond.wait_for(lock, std::chrono::seconds(interval));
+		if (statsDumperStopping || !statsFilter) continue;
+		const FilterPointer f = statsFilter;
+		lock.unlock();
+		filter_stats_struct stats;
+		filter_get_stats(f.get(), &stats);
+		std::ostringstream line;
+		writeStatsJson(line, stats);
+		const bool ok = toSocket ?
+			writeStatsToSocket(path.substr(5), line.str()) :
+			writeStatsToFile(path, line.str());
+		if (!ok) cdebug_printf(CDEBUG_IL_CRITICAL, "stats dump to '%s' failed", path.c_str());
+		lock.lock();
+	}
+}
+
+bool Adapter::Service::makesAsyncXactions() const {
+	return async;
+}
+
+void Adapter::Service::suspend(timeval &timeout) {
+	if (!lookupPool || !lookupPool->hasPending()) return;
+	// host calls resume() after waiting at most timeout
+	if (lookupPool->hasDone()) {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 0;
+	} else if (timeout.tv_sec > 0 || timeout.tv_usec > 1000) {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 1000;
+	}
+}
+
+void Adapter::Service::resume() {
+	cdebug_flush();
+	if (!lookupPool) return;
+	deliverLookups();
+}
+
+void Adapter::Service::deliverLookups() {
+	// transaction may start a lookup in lookupDone(), pointer is kept meanwhile
+	const LookupPoolPointer pool = lookupPool;
+	pool->takeDone(doneJobs);
+	for (size_t i=0; i<doneJobs.size(); ++i) {
+		// transaction may be stopped by host while its lookup was made
+		if (Adapter::Xaction *x = doneJobs[i]->xaction) x->lookupDone(doneJobs[i]->result);
+	}
+	doneJobs.clear();
+	if (pool->isStopped() && !pool->hasPending() && lookupPool == pool) lookupPool.reset();
+}
+
+// Allowed URL is let through without transaction. Denied URL, URL not starting
+// with "scheme://" (CONNECT authority, host passing path only) and lookup errors
+// go to transaction, which blocks or decides with request method.
+// Squid passes path only (url.path() of its request), so there this is never
+// a lookup: a URL in the query of a path must not be taken for the request one.
 bool Adapter::Service::wantsUrl(const char *url) const {
-	(void)url;
-	return true; // no-op is applied to all messages
+	if (pendingFilterReady.load(std::memory_order_acquire)) usePendingFilter();
+	// index of background start is loading without interim filter
+	if (!filter) {
+		if (!start_policy_is_allow) return true;
+		++interimRequests;
+		++xactionsAvoided;
+		return false;
+	}
+	// asynchronous mode: lookup may wait for database, leave it to workers
+	if (lookupPool) return true;
+	// group of client is known to transaction only
+	if (groupsAreSelectable()) return true;
+	const size_t urlSize = strlen(url);
+	if (!filter_uri_is_absolute_n(url, urlSize)) return true;
+	++urlChecks;
+	filter_uri_result_enum filter_uri_result = filter_uri_is_allowed_n(filter.get(), url, urlSize, 0);
+	const bool allowed = (
+		(filter_uri_result == FILTER_URI_ALLOW) ||
+		(filter_uri_result == FILTER_URI_DOESNT_EXIST && default_policy_is_allow)
+	);
+	if (!allowed) return true;
+	++xactionsAvoided;
+	if (indexLoading) ++interimRequests;
+	return false;
 }
 
 Adapter::Service::MadeXactionPointer
 Adapter::Service::makeXaction(libecap::host::Xaction *hostx) {
-	return Adapter::Service::MadeXactionPointer(new Adapter::Xaction(hostx, filter, default_policy_is_allow));
+	if (pendingFilterReady.load(std::memory_order_acquire)) usePendingFilter();
+	cdebug_flush();
+	if (indexLoading) ++interimRequests;
+	// without filter transaction decides every request as unlisted, by start_policy
+	const bool allowUnlisted = (filter ? default_policy_is_allow : start_policy_is_allow);
+	return Adapter::Service::MadeXactionPointer(
+		new Adapter::Xaction(hostx, filter, groupOf(hostx), allowUnlisted, lookupPool, blockPage)
+	);
+}
+
+
+Adapter::LookupPool::LookupPool(unsigned int workersNumber, size_t aQueueSize):
+		stopping(false), queueSize(aQueueSize), doneReady(false), pending(0) {
+	for (unsigned int i=0; i<workersNumber; ++i)
+		workers.push_back(std::thread(&Adapter::LookupPool::work, this));
+}
+
+Adapter::LookupPool::~LookupPool() {
+	stop();
+}
+
+void Adapter::LookupPool::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	cond.notify_all();
+	for (size_t i=0; i<workers.size(); ++i) workers[i].join();
+	workers.clear();
+}
+
+bool Adapter::LookupPool::submit(const LookupJobPointer &job) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping || queue.size() >= queueSize) return false;
+		queue.push_back(job);
+	}
+	pending.fetch_add(1, std::memory_order_relaxed);
+	cond.notify_one();
+	return true;
+}
+
+void Adapter::LookupPool::takeDone(std::vector<LookupJobPointer> &jobs) {
+	if (!hasDone()) return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.swap(done);
+		doneReady.store(false, std::memory_order_relaxed);
+	}
+	pending.fetch_sub(jobs.size(), std::memory_order_relaxed);
+}
+
+void Adapter::LookupPool::work() {
+	std::vector<LookupJobPointer> batch;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		while (!stopping && queue.empty()) cond.wait(lock);
+		// stopping pool finishes queued jobs first
+		if (queue.empty()) return;
+		while (!queue.empty() && batch.size() < LOOKUP_BATCH_SIZE) {
+			batch.push_back(queue.front());
+			queue.pop_front();
+		}
+		lock.unlock();
+		// LookupJob::xaction is not touched here: main thread may clear it meanwhile
+		for (size_t i=0; i<batch.size(); ++i) {
+			LookupJob &job = *batch[i];
+			job.result = filter_uri_is_allowed_in_group_n(
+				job.filter.get(), job.group,
+				job.uri.data(), job.uri.size(), job.uri_is_authority
+			);
+		}
+		lock.lock();
+		done.insert(done.end(), batch.begin(), batch.end());
+		doneReady.store(true, std::memory_order_release);
+		batch.clear();
+	}
 }
 
 
-Adapter::Xaction::Xaction(libecap::host::Xaction *x, const filter_struct *f, bool d):
-		hostx(x), filter(f), default_policy_is_allow(d) {}
+Adapter::Xaction::Xaction(
+		libecap::host::Xaction *x, const FilterPointer &f, filter_group_type g, bool d,
+		const LookupPoolPointer &p, const BlockPagePointer &b
+):
+		hostx(x), filter(f), group(g), default_policy_is_allow(d), lookupPool(p),
+		blockPage(b), sendingBlockPage(false), blockPageOffset(0) {}
 
 Adapter::Xaction::~Xaction() {
+	cancelLookup();
 	if (libecap::host::Xaction *x = hostx) {
 		hostx = 0;
 		x->adaptationAborted();
@@ -220,10 +1073,18 @@ bool Adapter::Xaction::isAllowedUri() const {
 		Debug(ilCritical) << "No request line";
 		return false;
 	}
-	std::string uri = requestLine->uri().toString();
+	// uri bytes are passed as is, without copying into null-terminated string
+	const libecap::Area uri = requestLine->uri();
 	const libecap::Name &method = requestLine->method();
 	int uri_is_authority = (method == libecap::methodConnect);
-	filter_uri_result_enum filter_uri_result = filter_uri_is_allowed(filter, uri.c_str(), uri_is_authority);
+	filter_uri_result_enum filter_uri_result = filter_uri_is_allowed_in_group_n(
+		filter.get(), group,
+		uri.start, uri.size, uri_is_authority
+	);
+	return isAllowedResult(filter_uri_result);
+}
+
+bool Adapter::Xaction::isAllowedResult(filter_uri_result_enum filter_uri_result) const {
 	if (filter_uri_result == FILTER_URI_ERROR) {
 		//Debug(ilCritical) << "Filter error";
 		return false;
@@ -234,10 +1095,53 @@ bool Adapter::Xaction::isAllowedUri() const {
 	);
 }
 
+// Queues lookup to worker pool, false if it has to be made synchronously.
+bool Adapter::Xaction::startLookup() {
+	CLRLP requestLine = getRequestLine();
+	if (requestLine == NULL) return false;
+	const libecap::Area uri = requestLine->uri();
+	job = LookupJobPointer(new LookupJob);
+	job->xaction = this;
+	job->filter = filter;
+	job->uri.assign(uri.start, uri.size);
+	job->uri_is_authority = (requestLine->method() == libecap::methodConnect);
+	job->group = group;
+	job->result = FILTER_URI_ERROR;
+	if (lookupPool->submit(job)) return true;
+	// queue is full: lookup on main thread rather than queue without bound
+	job.reset();
+	return false;
+}
+
+void Adapter::Xaction::cancelLookup() {
+	if (!job) return;
+	job->xaction = NULL;
+	job.reset();
+}
+
 void Adapter::Xaction::start() {
 	Must(hostx);
-	if (! isAllowedUri()) {
-		hostx->blockVirgin();
+	// index of background start is loading, service passed start_policy
+	if (!filter) {
+		useResult(default_policy_is_allow);
+		return;
+	}
+	if (lookupPool && startLookup()) return; // continued in lookupDone()
+	useResult(isAllowedUri());
+}
+
+void Adapter::Xaction::lookupDone(filter_uri_result_enum result) {
+	job.reset();
+	if (!hostx) return;
+	useResult(isAllowedResult(result));
+}
+
+void Adapter::Xaction::useResult(bool allowed) {
+	if (! allowed) {
+		if (blockPage)
+			useBlockPage();
+		else
+			hostx->blockVirgin();
 		return;
 	}
 	// Make this adapter non-callable
@@ -247,13 +1151,79 @@ void Adapter::Xaction::start() {
 	x->useVirgin();
 }
 
+static const libecap::Name headerContentType("Content-Type");
+static const libecap::Area contentTypeHtml("text/html; charset=utf-8", strlen("text/html; charset=utf-8"));
+
+// Answers request with block page instead of squid error page: header values and
+// body point into shared page, host copies them.
+void Adapter::Xaction::useBlockPage() {
+	const BlockPage &page = *blockPage;
+	libecap::shared_ptr<libecap::Message> adapted = libecap::MyHost().newResponse();
+	libecap::StatusLine *statusLine = dynamic_cast<libecap::StatusLine *>(&adapted->firstLine());
+	Must(statusLine);
+	statusLine->statusCode(page.status);
+	statusLine->reasonPhrase(libecap::Area(page.reason.data(), page.reason.size()));
+	libecap::Header &header = adapted->header();
+	header.add(headerContentType, contentTypeHtml);
+	header.add(libecap::headerContentLength, libecap::Area(page.contentLength.data(), page.contentLength.size()));
+	unsigned int category;
+	CLRLP requestLine;
+	if (
+		page.categoryHeader.identified() && filter && (requestLine = getRequestLine()) != NULL &&
+		filter_uri_denied_category_in_group_n(
+			filter.get(), group, requestLine->uri().start, requestLine->uri().size,
+			(requestLine->method() == libecap::methodConnect), &category
+		)
+	) {
+		char value[16];
+		int size = snprintf(value, sizeof(value), "%u", category);
+		header.add(page.categoryHeader, libecap::Area(value, size));
+	}
+	adapted->addBody();
+	// request body is not forwarded anywhere
+	if (hostx->virgin().body()) hostx->vbDiscard();
+	hostx->useAdapted(adapted);
+}
+
+void Adapter::Xaction::abMake() {
+	Must(blockPage && !sendingBlockPage);
+	sendingBlockPage = true;
+	// host takes what fits now and the rest in abContent() calls after done
+	hostx->noteAbContentAvailable();
+	hostx->noteAbContentDone(true);
+}
+
+void Adapter::Xaction::abDiscard() {
+	Must(blockPage);
+	sendingBlockPage = false;
+}
+
+void Adapter::Xaction::abStopMaking() {
+	Must(blockPage);
+	sendingBlockPage = false;
+}
+
+libecap::Area Adapter::Xaction::abContent(libecap::size_type offset, libecap::size_type size) {
+	Must(sendingBlockPage);
+	const std::string &body = blockPage->body;
+	const libecap::size_type start = blockPageOffset + offset;
+	if (start >= body.size()) return libecap::Area();
+	return libecap::Area(body.data() + start, std::min<libecap::size_type>(size, body.size() - start));
+}
+
+void Adapter::Xaction::abContentShift(libecap::size_type size) {
+	Must(sendingBlockPage);
+	blockPageOffset += size;
+}
+
 void Adapter::Xaction::stop() {
+	cancelLookup();
 	hostx = 0;
 	// the caller will delete
 }
 
 void Adapter::Xaction::noBodySupport() const {
-	Must(!"must not be called: filter adapter offers no body support");
+	Must(!"must not be called: filter adapter does not read virgin body");
 	// not reached
 }
 
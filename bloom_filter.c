@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include "bloom_filter.h"
+
+#define BLOCK_WORDS 8
+#define BLOCK_BITS (BLOCK_WORDS * 64)
+#define HASHES_MAX 16
+
+typedef uint64_t word_type;
+
+struct bloom_filter_struct_ {
+	word_type *words;
+	size_t blocks_number;
+	unsigned int hashes_number;
+};
+
+// Optimal Bloom filter with b bits per key has false positive rate 0.6185^b,
+// blocking costs about one more bit per key.
+static void bloom_parameters(double fpr, size_t *bits_per_key_out, unsigned int *hashes_number_out) {
+	size_t bits_per_key = 1;
+	for (double rate = 0.6185; rate > fpr && bits_per_key < 64; rate *= 0.6185) ++bits_per_key;
+	bits_per_key += 1;
+	// optimal number of hashes is bits_per_key * ln 2
+	unsigned int hashes_number = (bits_per_key * 693 + 500) / 1000;
+	if (hashes_number < 1) hashes_number = 1;
+	if (hashes_number > HASHES_MAX) hashes_number = HASHES_MAX;
+	*bits_per_key_out = bits_per_key;
+	*hashes_number_out = hashes_number;
+}
+
+bloom_filter_struct *bloom_filter_construct(size_t expected_count, double fpr) {
+	if (!(fpr > 0 && fpr < 1)) return NULL;
+	bloom_filter_struct *bloom = malloc(sizeof(bloom_filter_struct));
+	if (bloom == NULL) return NULL;
+	size_t bits_per_key;
+	bloom_parameters(fpr, &bits_per_key, &bloom->hashes_number);
+	bloom->blocks_number = (expected_count * bits_per_key + BLOCK_BITS - 1) / BLOCK_BITS;
+	if (bloom->blocks_number == 0) bloom->blocks_number = 1;
+	size_t size = bloom->blocks_number * BLOCK_WORDS * sizeof(word_type);
+	bloom->words = aligned_alloc(BLOCK_WORDS * sizeof(word_type), size);
+	if (bloom->words == NULL) {free(bloom); return NULL;}
+	for (size_t i=0; i<bloom->blocks_number * BLOCK_WORDS; ++i) bloom->words[i] = 0;
+	return bloom;
+}
+
+void bloom_filter_destruct(bloom_filter_struct *bloom) {
+	free(bloom->words);
+	free(bloom);
+}
+
+// Upper half of hash selects block, bit positions in block are taken
+// from top bits of multiplicative sequence seeded by the lower half.
+#define POSITION_MULTIPLIER 0x9e3779b97f4a7c15ULL
+#define POSITION_SHIFT (64 - 9)
+
+static const word_type *hash_block(const bloom_filter_struct *bloom, uint64_t hash) {
+	size_t block = (size_t)(((hash >> 32) * bloom->blocks_number) >> 32);
+	return bloom->words + block * BLOCK_WORDS;
+}
+
+void bloom_filter_add(bloom_filter_struct *bloom, uint64_t hash) {
+	word_type *block = (word_type *)hash_block(bloom, hash);
+	uint64_t g = (uint32_t)hash;
+	for (unsigned int i=0; i<bloom->hashes_number; ++i) {
+		g = (g + 1) * POSITION_MULTIPLIER;
+		unsigned int bit = g >> POSITION_SHIFT;
+		block[bit / 64] |= (word_type)1 << (bit % 64);
+	}
+}
+
+bool bloom_filter_may_contain(const bloom_filter_struct *bloom, uint64_t hash) {
+	const word_type *block = hash_block(bloom, hash);
+	uint64_t g = (uint32_t)hash;
+	for (unsigned int i=0; i<bloom->hashes_number; ++i) {
+		g = (g + 1) * POSITION_MULTIPLIER;
+		unsigned int bit = g >> POSITION_SHIFT;
+		if (!(block[bit / 64] & ((word_type)1 << (bit % 64)))) return false;
+	}
+	return true;
+}
+
+size_t bloom_filter_memory_size(const bloom_filter_struct *bloom) {
+	return bloom->blocks_number * BLOCK_WORDS * sizeof(word_type);
+}
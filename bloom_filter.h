@@ -0,0 +1,31 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Blocked Bloom filter: all bits of a key are in one cache line.
+// Keys are added and checked by 64-bit hash, so callers hashing keys
+// anyway (hash_index_hash_finish()) do not hash them twice.
+
+struct bloom_filter_struct_;
+typedef struct bloom_filter_struct_ bloom_filter_struct;
+
+// fpr -- wanted false positive rate, 0 < fpr < 1
+bloom_filter_struct *bloom_filter_construct(size_t expected_count, double fpr);
+void bloom_filter_destruct(bloom_filter_struct *bloom);
+void bloom_filter_add(bloom_filter_struct *bloom, uint64_t hash);
+// false -- key was never added
+bool bloom_filter_may_contain(const bloom_filter_struct *bloom, uint64_t hash);
+size_t bloom_filter_memory_size(const bloom_filter_struct *bloom);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*BLOOM_FILTER_H*/
@@ -0,0 +1,16 @@
+#include "category_blob.h"
+
+size_t category_blob_encode(const uint32_t *ids, size_t ids_number, uint8_t *out) {
+	uint8_t *cur = out;
+	uint32_t prev = 0;
+	for (size_t i=0; i<ids_number; ++i) {
+		uint32_t value = ids[i] - prev;
+		prev = ids[i];
+		while (value >= 0x80) {
+			*cur++ = (value & 0x7f) | 0x80;
+			value >>= 7;
+		}
+		*cur++ = value;
+	}
+	return cur - out;
+}
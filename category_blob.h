@@ -0,0 +1,54 @@
+#ifndef CATEGORY_BLOB_H
+#define CATEGORY_BLOB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Binary category list of sites row: ascending category ids, the first one
+// as is and the others as difference with the previous one, each as LEB128
+// varint (7 bits per byte, low bits first, high bit set on all bytes but last).
+// Typical list of a few ids below 128 takes one byte per id.
+
+#define CATEGORY_BLOB_ID_SIZE_MAX 5
+
+// ids -- ascending without repeats, out -- at least ids_number * CATEGORY_BLOB_ID_SIZE_MAX bytes
+size_t category_blob_encode(const uint32_t *ids, size_t ids_number, uint8_t *out);
+
+typedef enum {
+	CATEGORY_BLOB_NEXT_ID,
+	CATEGORY_BLOB_NEXT_END,
+	CATEGORY_BLOB_NEXT_INVALID
+} category_blob_next_enum;
+
+// Reads id following *id_inout (0 before the first one) and advances *cur_inout.
+// Empty blob, zero difference and id over UINT32_MAX are invalid.
+static inline category_blob_next_enum category_blob_next(
+		const uint8_t **cur_inout, const uint8_t *begin, const uint8_t *end, uint32_t *id_inout
+) {
+	const uint8_t *cur = *cur_inout;
+	if (cur == end) return (begin == end ? CATEGORY_BLOB_NEXT_INVALID : CATEGORY_BLOB_NEXT_END);
+	uint64_t value = 0;
+	for (unsigned int shift=0; ; shift+=7) {
+		if (cur == end || shift == 7 * CATEGORY_BLOB_ID_SIZE_MAX) return CATEGORY_BLOB_NEXT_INVALID;
+		uint8_t byte = *cur++;
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) break;
+	}
+	if (*cur_inout != begin && value == 0) return CATEGORY_BLOB_NEXT_INVALID;
+	value += *id_inout;
+	if (value > UINT32_MAX) return CATEGORY_BLOB_NEXT_INVALID;
+	*id_inout = value;
+	*cur_inout = cur;
+	return CATEGORY_BLOB_NEXT_ID;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*CATEGORY_BLOB_H*/
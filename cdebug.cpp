@@ -2,6 +2,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <ostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <atomic>
 #include <libecap/common/autoconf.h>
 #include <libecap/common/registry.h>
 #include <libecap/common/log.h>
@@ -9,6 +15,40 @@
 #include "cdebug.h"
 #include "Debug.h"
 
+// Host debug stream may be used from the main thread only, so messages of
+// other threads (e.g. background db reload) wait for cdebug_flush().
+// Adapter library is loaded by the main thread.
+static const std::thread::id MainThreadId = std::this_thread::get_id();
+static const size_t DeferredMax = 1024;
+static std::mutex DeferredMutex;
+static std::vector<std::pair<cdebug_lvmask_type, std::string> > Deferred;
+static size_t DeferredDropped = 0;
+static std::atomic<bool> HasDeferred(false);
+
+static void defer(cdebug_lvmask_type lvmask, const char *str) {
+	std::lock_guard<std::mutex> lock(DeferredMutex);
+	if (Deferred.size() < DeferredMax)
+		Deferred.push_back(std::make_pair(lvmask, std::string(str)));
+	else
+		++DeferredDropped;
+	HasDeferred.store(true, std::memory_order_release);
+}
+
+void cdebug_flush(void) {
+	if (!HasDeferred.load(std::memory_order_acquire)) return;
+	std::vector<std::pair<cdebug_lvmask_type, std::string> > messages;
+	size_t dropped;
+	{
+		std::lock_guard<std::mutex> lock(DeferredMutex);
+		messages.swap(Deferred);
+		dropped = DeferredDropped;
+		DeferredDropped = 0;
+		HasDeferred.store(false, std::memory_order_release);
+	}
+	for (size_t i=0; i<messages.size(); ++i) Debug(messages[i].first) << messages[i].second;
+	if (dropped > 0) Debug(CDEBUG_IL_CRITICAL) << dropped << " messages of background threads dropped";
+}
+
 int cdebug_printf(cdebug_lvmask_type lvmask, const char *format, ...) {
 	va_list args;
 
@@ -28,7 +68,10 @@ int cdebug_printf(cdebug_lvmask_type lvmask, const char *format, ...) {
 		free(str);
 		return (vsnprintf_res < 0 ? vsnprintf_res : -1);
 	}
-	Debug(lvmask) << str;
+	if (std::this_thread::get_id() == MainThreadId)
+		Debug(lvmask) << str;
+	else
+		defer(lvmask, str);
 	free(str);
 	return vsnprintf_res;
 }
@@ -23,6 +23,8 @@ enum cdebug_message_size_level {
 typedef unsigned int cdebug_lvmask_type;
 
 int cdebug_printf(cdebug_lvmask_type lvmask, const char *format, ...);
+// writes messages printed by threads other than main one, call from main thread
+void cdebug_flush(void);
 
 #ifdef __cplusplus
 }
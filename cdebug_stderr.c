@@ -0,0 +1,19 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include "cdebug.h"
+
+// cdebug implementation for standalone tools: messages go to stderr
+
+int cdebug_printf(cdebug_lvmask_type lvmask, const char *format, ...) {
+	(void)lvmask;
+	va_list args;
+	va_start(args, format);
+	int res = vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+	return res;
+}
+
+void cdebug_flush(void) {
+	// stderr may be written from any thread
+}
@@ -0,0 +1,241 @@
+#include <stdlib.h>
+#include <string.h>
+#include "domain_dict.h"
+
+// Block entry: byte of prefix size shared with the previous key, byte of the rest size,
+// the rest, value as LEB128 varint (7 bits per byte, low bits first).
+#define VALUE_SIZE_MAX 5
+
+struct domain_dict_struct_ {
+	uint8_t *data;
+	size_t data_size;
+	// offset of each block in data
+	uint64_t *blocks;
+	size_t blocks_number;
+	size_t count;
+};
+
+typedef struct {
+	// offset in builder keys until build, then pointer: keys move while they are added
+	union {
+		size_t offset;
+		const uint8_t *pointer;
+	} key;
+	uint32_t key_size;
+	uint32_t value;
+} record_struct;
+
+struct domain_dict_builder_struct_ {
+	// reversed domains one after another
+	uint8_t *keys;
+	size_t keys_size;
+	size_t keys_capacity;
+	record_struct *records;
+	size_t records_number;
+	size_t records_capacity;
+};
+
+domain_dict_builder_struct *domain_dict_builder_construct(size_t expected_count) {
+	domain_dict_builder_struct *builder = calloc(1, sizeof(domain_dict_builder_struct));
+	if (builder == NULL) return NULL;
+	builder->records_capacity = (expected_count > 0 ? expected_count : 1024);
+	builder->keys_capacity = builder->records_capacity * 16;
+	builder->records = malloc(builder->records_capacity * sizeof(builder->records[0]));
+	builder->keys = malloc(builder->keys_capacity);
+	if (builder->records == NULL || builder->keys == NULL) {
+		domain_dict_builder_destruct(builder);
+		return NULL;
+	}
+	return builder;
+}
+
+void domain_dict_builder_destruct(domain_dict_builder_struct *builder) {
+	free(builder->keys);
+	free(builder->records);
+	free(builder);
+}
+
+int domain_dict_builder_add(domain_dict_builder_struct *builder, const char *domain, size_t domain_size, uint32_t value) {
+	if (domain_size == 0 || domain_size > DOMAIN_DICT_KEY_SIZE_MAX) return 1;
+	if (builder->records_number == builder->records_capacity) {
+		size_t capacity = builder->records_capacity * 2;
+		record_struct *records = realloc(builder->records, capacity * sizeof(records[0]));
+		if (records == NULL) return 1;
+		builder->records = records;
+		builder->records_capacity = capacity;
+	}
+	if (builder->keys_capacity - builder->keys_size < domain_size) {
+		size_t capacity = builder->keys_capacity * 2 + domain_size;
+		uint8_t *keys = realloc(builder->keys, capacity);
+		if (keys == NULL) return 1;
+		builder->keys = keys;
+		builder->keys_capacity = capacity;
+	}
+	uint8_t *key = builder->keys + builder->keys_size;
+	for (size_t i=0; i<domain_size; ++i) key[i] = domain[domain_size - 1 - i];
+	record_struct *record = &builder->records[builder->records_number++];
+	record->key.offset = builder->keys_size;
+	record->key_size = domain_size;
+	record->value = value;
+	builder->keys_size += domain_size;
+	return 0;
+}
+
+static int compare_keys(const uint8_t *a, size_t a_size, const uint8_t *b, size_t b_size) {
+	int cmp = memcmp(a, b, (a_size < b_size ? a_size : b_size));
+	if (cmp != 0) return cmp;
+	return (a_size > b_size) - (a_size < b_size);
+}
+
+// equal keys are in the order they were added
+static int record_compare(const void *a, const void *b) {
+	const record_struct *ra = a, *rb = b;
+	int cmp = compare_keys(ra->key.pointer, ra->key_size, rb->key.pointer, rb->key_size);
+	if (cmp != 0) return cmp;
+	return (ra->key.pointer > rb->key.pointer) - (ra->key.pointer < rb->key.pointer);
+}
+
+static size_t value_size(uint32_t value) {
+	size_t size = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		++size;
+	}
+	return size;
+}
+
+static uint8_t *write_value(uint8_t *cur, uint32_t value) {
+	while (value >= 0x80) {
+		*cur++ = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	*cur++ = (uint8_t)value;
+	return cur;
+}
+
+static const uint8_t *read_value(const uint8_t *cur, uint32_t *value_out) {
+	uint32_t value = 0;
+	for (unsigned int shift=0; ; shift+=7) {
+		uint8_t byte = *cur++;
+		value |= (uint32_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) break;
+	}
+	*value_out = value;
+	return cur;
+}
+
+static size_t shared_prefix_size(const record_struct *a, const record_struct *b) {
+	size_t size = (a->key_size < b->key_size ? a->key_size : b->key_size);
+	size_t i = 0;
+	while (i < size && a->key.pointer[i] == b->key.pointer[i]) ++i;
+	return i;
+}
+
+domain_dict_struct *domain_dict_build(domain_dict_builder_struct *builder) {
+	record_struct *records = builder->records;
+	for (size_t i=0; i<builder->records_number; ++i) records[i].key.pointer = builder->keys + records[i].key.offset;
+	qsort(records, builder->records_number, sizeof(records[0]), record_compare);
+	// of equal keys the last added one is kept
+	size_t count = 0;
+	for (size_t i=0; i<builder->records_number; ++i) {
+		if (
+			i + 1 < builder->records_number &&
+			compare_keys(records[i].key.pointer, records[i].key_size, records[i+1].key.pointer, records[i+1].key_size) == 0
+		) {
+			continue;
+		}
+		records[count++] = records[i];
+	}
+
+	domain_dict_struct *dict = calloc(1, sizeof(domain_dict_struct));
+	if (dict == NULL) goto err_builder_destruct;
+	dict->count = count;
+	dict->blocks_number = (count + DOMAIN_DICT_BLOCK_SIZE - 1) / DOMAIN_DICT_BLOCK_SIZE;
+	// sizes are summed first, so that data is allocated once
+	size_t data_size = 0;
+	for (size_t i=0; i<count; ++i) {
+		size_t shared = (i % DOMAIN_DICT_BLOCK_SIZE != 0 ? shared_prefix_size(&records[i-1], &records[i]) : 0);
+		data_size += 2 + (records[i].key_size - shared) + value_size(records[i].value);
+	}
+	dict->data_size = data_size;
+	dict->data = malloc(data_size + 1);
+	dict->blocks = malloc((dict->blocks_number + 1) * sizeof(dict->blocks[0]));
+	if (dict->data == NULL || dict->blocks == NULL) goto err_dict_destruct;
+
+	uint8_t *cur = dict->data;
+	for (size_t i=0; i<count; ++i) {
+		size_t shared = 0;
+		if (i % DOMAIN_DICT_BLOCK_SIZE == 0) {
+			dict->blocks[i / DOMAIN_DICT_BLOCK_SIZE] = cur - dict->data;
+		} else {
+			shared = shared_prefix_size(&records[i-1], &records[i]);
+		}
+		size_t rest = records[i].key_size - shared;
+		*cur++ = (uint8_t)shared;
+		*cur++ = (uint8_t)rest;
+		memcpy(cur, records[i].key.pointer + shared, rest);
+		cur += rest;
+		cur = write_value(cur, records[i].value);
+	}
+	domain_dict_builder_destruct(builder);
+	return dict;
+
+err_dict_destruct:
+	domain_dict_destruct(dict);
+err_builder_destruct:
+	domain_dict_builder_destruct(builder);
+	return NULL;
+}
+
+void domain_dict_destruct(domain_dict_struct *dict) {
+	free(dict->data);
+	free(dict->blocks);
+	free(dict);
+}
+
+bool domain_dict_get(const domain_dict_struct *dict, const char *domain, size_t domain_size, uint32_t *value_out) {
+	if (domain_size == 0 || domain_size > DOMAIN_DICT_KEY_SIZE_MAX || dict->count == 0) return false;
+	uint8_t key[DOMAIN_DICT_KEY_SIZE_MAX];
+	for (size_t i=0; i<domain_size; ++i) key[i] = domain[domain_size - 1 - i];
+
+	// the last block whose first key is not greater than key
+	size_t low = 0, high = dict->blocks_number;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		const uint8_t *first = dict->data + dict->blocks[middle];
+		if (compare_keys(first + 2, first[1], key, domain_size) <= 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	if (low == 0) return false;
+	size_t block = low - 1;
+
+	uint8_t current[DOMAIN_DICT_KEY_SIZE_MAX];
+	const uint8_t *cur = dict->data + dict->blocks[block];
+	size_t entries = dict->count - block * DOMAIN_DICT_BLOCK_SIZE;
+	if (entries > DOMAIN_DICT_BLOCK_SIZE) entries = DOMAIN_DICT_BLOCK_SIZE;
+	for (size_t i=0; i<entries; ++i) {
+		size_t shared = cur[0], rest = cur[1];
+		memcpy(current + shared, cur + 2, rest);
+		uint32_t value;
+		cur = read_value(cur + 2 + rest, &value);
+		int cmp = compare_keys(current, shared + rest, key, domain_size);
+		if (cmp == 0) {
+			*value_out = value;
+			return true;
+		}
+		// keys are sorted
+		if (cmp > 0) return false;
+	}
+	return false;
+}
+
+size_t domain_dict_count(const domain_dict_struct *dict) {
+	return dict->count;
+}
+
+size_t domain_dict_memory_size(const domain_dict_struct *dict) {
+	return dict->data_size + dict->blocks_number * sizeof(dict->blocks[0]);
+}
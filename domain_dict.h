@@ -0,0 +1,47 @@
+#ifndef DOMAIN_DICT_H
+#define DOMAIN_DICT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Read-only dictionary of domains with 32-bit values in a few bytes per domain.
+// Domains are stored reversed ("img.example.com" as "moc.elpmaxe.gmi") and sorted,
+// so that domains of one zone are neighbours and share prefixes. Sorted keys are
+// front-coded in blocks of DOMAIN_DICT_BLOCK_SIZE: each key is the length of prefix
+// shared with the previous key and the rest of it, the first key of a block shares
+// nothing. Sparse directory holds offset of each block: lookup is binary search
+// over first keys of blocks and scan of one block.
+
+#define DOMAIN_DICT_KEY_SIZE_MAX 255
+#define DOMAIN_DICT_BLOCK_SIZE 16
+
+struct domain_dict_struct_;
+typedef struct domain_dict_struct_ domain_dict_struct;
+
+struct domain_dict_builder_struct_;
+typedef struct domain_dict_builder_struct_ domain_dict_builder_struct;
+
+domain_dict_builder_struct *domain_dict_builder_construct(size_t expected_count);
+void domain_dict_builder_destruct(domain_dict_builder_struct *builder);
+// domains of 1..DOMAIN_DICT_KEY_SIZE_MAX bytes in any order,
+// the last value of domain added several times is kept; returns 0 on success
+int domain_dict_builder_add(domain_dict_builder_struct *builder, const char *domain, size_t domain_size, uint32_t value);
+// Sorts and encodes domains added, builder is destructed in any case. NULL on error.
+domain_dict_struct *domain_dict_build(domain_dict_builder_struct *builder);
+
+void domain_dict_destruct(domain_dict_struct *dict);
+bool domain_dict_get(const domain_dict_struct *dict, const char *domain, size_t domain_size, uint32_t *value_out);
+size_t domain_dict_count(const domain_dict_struct *dict);
+// bytes of encoded keys, values and directory
+size_t domain_dict_memory_size(const domain_dict_struct *dict);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*DOMAIN_DICT_H*/
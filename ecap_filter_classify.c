@@ -0,0 +1,537 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "filter.h"
+#include "cdebug.h"
+
+// Classifies URLs of squid access.log lines with the adapter filter, outside of squid.
+// Log is mapped (or read from stdin or from a decompressor pipe) and cut on line
+// boundaries into chunks, which worker threads classify in batches.
+// Chunks go through a ring of slots and are retired in order by main thread,
+// so per-line verdicts come out in the order of log lines.
+
+#define CHUNK_SIZE (4 << 20)
+#define BATCH_SIZE 64
+// squid native format: time elapsed client code/status bytes method URL ...
+#define URL_FIELD_DEFAULT 7
+
+// counts of lines by filter_uri_result_enum
+#define RESULTS_NUMBER 4
+static const char *result_names[RESULTS_NUMBER] = {"allow", "deny", "unknown", "error"};
+
+typedef enum {
+	SLOT_FREE,
+	SLOT_FILLED,                  // waits for worker
+	SLOT_DONE                     // waits for main thread to retire it
+} slot_state_enum;
+
+typedef struct {
+	slot_state_enum state;
+	const char *data;             // chunk of whole lines, last one may lack '\n'
+	size_t size;
+	char *buf;                    // stream input: chunk is read here
+	size_t buf_size;
+	char *out;                    // verdict lines
+	size_t out_size;
+	size_t out_used;
+	uint64_t results[RESULTS_NUMBER];
+} slot_type;
+
+typedef struct {
+	const filter_struct *filter;
+	unsigned int url_field;
+	unsigned int client_field;    // 0 -- all lines in FILTER_GROUP_DEFAULT
+	int verdicts;
+	slot_type *slots;
+	size_t slots_number;
+	size_t taken_number;          // chunks taken by workers
+	size_t filled_number;         // chunks filled by main thread
+	int eof;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} classifier_type;
+
+typedef struct {
+	int fd;
+	pid_t decompressor;           // 0 -- none
+	const char *map;              // NULL -- stream from fd
+	size_t map_size;
+	size_t map_offset;
+	int eof;
+	char *carry;                  // stream: partial line left after previous chunk
+	size_t carry_size;
+	size_t carry_used;
+	uint64_t bytes;
+} input_type;
+
+static const struct {
+	const char *suffix;
+	const char *program;
+} decompressors[] = {
+	{".gz", "gzip"},
+	{".bz2", "bzip2"},
+	{".xz", "xz"},
+	{".zst", "zstd"}
+};
+#define DECOMPRESSORS_NUMBER (sizeof(decompressors)/sizeof(decompressors[0]))
+
+// lookups of malformed urls log errors: messages are dropped after filter
+// is loaded unless -v is given, such lines are counted as errors anyway
+static int cdebug_quiet;
+
+int cdebug_printf(cdebug_lvmask_type lvmask, const char *format, ...) {
+	(void)lvmask;
+	if (__atomic_load_n(&cdebug_quiet, __ATOMIC_RELAXED)) return 0;
+	va_list args;
+	va_start(args, format);
+	int res = vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+	return res;
+}
+
+void cdebug_flush(void) {
+}
+
+void print_err_and_exit(const char *msg) {
+	fprintf(stderr, "error: %s\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) print_err_and_exit("realloc");
+	return ptr;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int is_space(char c) {
+	return (c == ' ' || c == '\t' || c == '\r');
+}
+
+// Finds field number field_number (from 1) of line, fields are separated by runs of blanks
+// (squid pads them for alignment). Returns 0 if line is shorter; *is_authority_out
+// is set if previous field is CONNECT method.
+static int line_find_field(
+		const char *line, const char *end, unsigned int field_number,
+		const char **field_out, size_t *field_size_out, int *is_authority_out
+) {
+	const char *prev = NULL;
+	size_t prev_size = 0;
+	const char *p = line;
+	for (unsigned int i=1; ; ++i) {
+		while (p < end && is_space(*p)) ++p;
+		if (p == end) return 0;
+		const char *field = p;
+		while (p < end && !is_space(*p)) ++p;
+		if (i == field_number) {
+			*field_out = field;
+			*field_size_out = p - field;
+			*is_authority_out = (prev_size == 7 && memcmp(prev, "CONNECT", 7) == 0);
+			return 1;
+		}
+		prev = field;
+		prev_size = p - field;
+	}
+}
+
+static void slot_append_verdict(slot_type *slot, filter_uri_result_enum result, const char *uri, size_t uri_size) {
+	const char *name = result_names[result];
+	size_t name_size = strlen(name);
+	size_t size = name_size + 1 + uri_size + 1;
+	if (slot->out_used + size > slot->out_size) {
+		while (slot->out_used + size > slot->out_size) slot->out_size = (slot->out_size > 0 ? slot->out_size * 2 : CHUNK_SIZE);
+		slot->out = xrealloc(slot->out, slot->out_size);
+	}
+	char *out = slot->out + slot->out_used;
+	memcpy(out, name, name_size);
+	out[name_size] = '\t';
+	memcpy(out + name_size + 1, uri, uri_size);
+	out[size - 1] = '\n';
+	slot->out_used += size;
+}
+
+static void classify_batch(
+		const classifier_type *classifier, slot_type *slot,
+		const filter_uri_struct *uris, size_t uris_number
+) {
+	filter_uri_result_enum results[BATCH_SIZE];
+	filter_uris_are_allowed(classifier->filter, uris, uris_number, results);
+	for (size_t i=0; i<uris_number; ++i) {
+		++slot->results[results[i]];
+		if (classifier->verdicts) slot_append_verdict(slot, results[i], uris[i].uri, uris[i].uri_size);
+	}
+}
+
+// blank lines are skipped, lines without url field are looked up as empty url, i.e. error
+static void classify_chunk(const classifier_type *classifier, slot_type *slot) {
+	memset(slot->results, 0, sizeof(slot->results));
+	slot->out_used = 0;
+	filter_uri_struct uris[BATCH_SIZE];
+	size_t uris_number = 0;
+	const char *end = slot->data + slot->size;
+	for (const char *line=slot->data; line<end; ) {
+		const char *line_end = memchr(line, '\n', end - line);
+		if (line_end == NULL) line_end = end;
+		const char *uri;
+		size_t uri_size;
+		int uri_is_authority;
+		if (!line_find_field(line, line_end, classifier->url_field, &uri, &uri_size, &uri_is_authority)) {
+			uri = line;
+			uri_size = 0;
+			uri_is_authority = 0;
+			for (const char *p=line; p<line_end; ++p) if (!is_space(*p)) goto line_add;
+			goto line_next;
+		}
+line_add:
+		uris[uris_number].uri = uri;
+		uris[uris_number].uri_size = uri_size;
+		uris[uris_number].uri_is_authority = uri_is_authority;
+		uris[uris_number].group = FILTER_GROUP_DEFAULT;
+		if (classifier->client_field != 0) {
+			const char *client;
+			size_t client_size;
+			int client_is_authority;
+			if (line_find_field(line, line_end, classifier->client_field, &client, &client_size, &client_is_authority)) {
+				uris[uris_number].group = filter_group_of_ip(classifier->filter, client, client_size);
+			}
+		}
+		if (++uris_number == BATCH_SIZE) {
+			classify_batch(classifier, slot, uris, uris_number);
+			uris_number = 0;
+		}
+line_next:
+		line = line_end + 1;
+	}
+	if (uris_number > 0) classify_batch(classifier, slot, uris, uris_number);
+}
+
+static void *worker_run(void *ptr) {
+	classifier_type *classifier = ptr;
+	pthread_mutex_lock(&classifier->mutex);
+	while (1) {
+		while (classifier->taken_number == classifier->filled_number && !classifier->eof) {
+			pthread_cond_wait(&classifier->cond, &classifier->mutex);
+		}
+		if (classifier->taken_number == classifier->filled_number) break;
+		slot_type *slot = &classifier->slots[classifier->taken_number++ % classifier->slots_number];
+		pthread_mutex_unlock(&classifier->mutex);
+		classify_chunk(classifier, slot);
+		pthread_mutex_lock(&classifier->mutex);
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&classifier->cond);
+	}
+	pthread_mutex_unlock(&classifier->mutex);
+	return NULL;
+}
+
+static int input_open(input_type *input, const char *path) {
+	memset(input, 0, sizeof(*input));
+	if (path == NULL || strcmp(path, "-") == 0) {
+		input->fd = STDIN_FILENO;
+		return 0;
+	}
+	size_t path_size = strlen(path);
+	for (size_t i=0; i<DECOMPRESSORS_NUMBER; ++i) {
+		size_t suffix_size = strlen(decompressors[i].suffix);
+		if (path_size <= suffix_size || strcmp(path + path_size - suffix_size, decompressors[i].suffix) != 0) continue;
+		int pipe_fds[2];
+		if (pipe(pipe_fds) != 0) {perror("pipe"); return 1;}
+		pid_t pid = fork();
+		if (pid < 0) {perror("fork"); return 1;}
+		if (pid == 0) {
+			dup2(pipe_fds[1], STDOUT_FILENO);
+			close(pipe_fds[0]);
+			close(pipe_fds[1]);
+			execlp(decompressors[i].program, decompressors[i].program, "-dc", "--", path, (char *)NULL);
+			perror(decompressors[i].program);
+			_exit(127);
+		}
+		close(pipe_fds[1]);
+		input->fd = pipe_fds[0];
+		input->decompressor = pid;
+		return 0;
+	}
+
+	input->fd = open(path, O_RDONLY);
+	if (input->fd < 0) {perror(path); return 1;}
+	struct stat st;
+	if (fstat(input->fd, &st) != 0) {perror(path); return 1;}
+	// pipes and empty files are read as stream
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) return 0;
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, input->fd, 0);
+	if (map == MAP_FAILED) {perror(path); return 1;}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	input->map = map;
+	input->map_size = st.st_size;
+	return 0;
+}
+
+// returns 0 if input or decompressor failed
+static int input_close(input_type *input) {
+	int ok = 1;
+	if (input->map != NULL) munmap((void *)input->map, input->map_size);
+	if (input->fd != STDIN_FILENO) close(input->fd);
+	if (input->decompressor != 0) {
+		int status;
+		if (waitpid(input->decompressor, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "error: decompressor failed\n");
+			ok = 0;
+		}
+	}
+	free(input->carry);
+	return ok;
+}
+
+static void input_read_mapped(input_type *input, slot_type *slot) {
+	size_t begin = input->map_offset;
+	size_t end = begin + CHUNK_SIZE;
+	if (end >= input->map_size) {
+		end = input->map_size;
+	} else {
+		const char *nl = memchr(input->map + end, '\n', input->map_size - end);
+		end = (nl != NULL ? (size_t)(nl - input->map) + 1 : input->map_size);
+	}
+	slot->data = input->map + begin;
+	slot->size = end - begin;
+	input->map_offset = end;
+}
+
+// chunk is read until buffer is full, then cut after its last '\n';
+// buffer grows while it holds less than one line
+static void input_read_stream(input_type *input, slot_type *slot) {
+	size_t need = (input->carry_used > CHUNK_SIZE ? input->carry_used * 2 : CHUNK_SIZE);
+	if (slot->buf_size < need) {
+		slot->buf = xrealloc(slot->buf, need);
+		slot->buf_size = need;
+	}
+	memcpy(slot->buf, input->carry, input->carry_used);
+	size_t used = input->carry_used;
+	input->carry_used = 0;
+	size_t size;
+	while (1) {
+		while (used < slot->buf_size && !input->eof) {
+			ssize_t res = read(input->fd, slot->buf + used, slot->buf_size - used);
+			if (res < 0 && errno == EINTR) continue;
+			if (res < 0) {perror("read"); exit(EXIT_FAILURE);}
+			if (res == 0) input->eof = 1;
+			used += res;
+			input->bytes += res;
+		}
+		if (input->eof) {
+			size = used;
+			break;
+		}
+		const char *nl = memrchr(slot->buf, '\n', used);
+		if (nl != NULL) {
+			size = nl - slot->buf + 1;
+			break;
+		}
+		slot->buf_size *= 2;
+		slot->buf = xrealloc(slot->buf, slot->buf_size);
+	}
+	if (used > size) {
+		if (input->carry_size < used - size) {
+			input->carry_size = used - size;
+			input->carry = xrealloc(input->carry, input->carry_size);
+		}
+		memcpy(input->carry, slot->buf + size, used - size);
+		input->carry_used = used - size;
+	}
+	slot->data = slot->buf;
+	slot->size = size;
+}
+
+// returns 0 at end of input
+static int input_read(input_type *input, slot_type *slot) {
+	if (input->map != NULL) input_read_mapped(input, slot);
+	else input_read_stream(input, slot);
+	return (slot->size > 0);
+}
+
+static void slot_retire(classifier_type *classifier, slot_type *slot, FILE *verdicts_file, uint64_t *results) {
+	pthread_mutex_lock(&classifier->mutex);
+	while (slot->state != SLOT_DONE) pthread_cond_wait(&classifier->cond, &classifier->mutex);
+	pthread_mutex_unlock(&classifier->mutex);
+	for (int r=0; r<RESULTS_NUMBER; ++r) results[r] += slot->results[r];
+	if (verdicts_file != NULL && slot->out_used > 0) {
+		if (fwrite(slot->out, 1, slot->out_used, verdicts_file) != slot->out_used) {
+			perror("write verdicts");
+			exit(EXIT_FAILURE);
+		}
+	}
+	slot->state = SLOT_FREE;
+}
+
+static void print_usage_and_exit(void) {
+	print_err_and_exit(
+		"wrong arguments\n"
+		"usage: ecap_filter_classify [options] <db_uri> [<log_path>]\n"
+		"  -i <index>               sqlite, hash, compact or snapshot (default hash)\n"
+		"  -s <snapshot_path>       snapshot for -i snapshot, made from db by ecap_filter_compile\n"
+		"  -m                       suffix match\n"
+		"  -c <entries>             verdict cache size of each thread (default 0)\n"
+		"  -F <field>               number of url field in log lines, from 1 (default 7)\n"
+		"  -C <field>               number of client address field, to check lines in groups of\n"
+		"                           group_networks (squid native format: 3), default none\n"
+		"  -t <threads>             worker threads (default number of CPUs)\n"
+		"  -o <path>                write verdict and url of each line to path, - for stdout\n"
+		"  -j                       print counts as JSON\n"
+		"  -v                       print errors of malformed urls\n"
+		"log_path may end with .gz, .bz2, .xz or .zst to be decompressed, default - (stdin)"
+	);
+}
+
+int main(int argc, char *argv[]) {
+	filter_config_struct filter_config;
+	memset(&filter_config, 0, sizeof(filter_config));
+	filter_config.index = FILTER_INDEX_HASH;
+	const char *snapshot_path = NULL;
+	long threads_number = sysconf(_SC_NPROCESSORS_ONLN);
+	long url_field = URL_FIELD_DEFAULT;
+	long client_field = 0;
+	const char *verdicts_path = NULL;
+	int json = 0;
+	int verbose = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:s:mc:F:C:t:o:jv")) != -1) {
+		switch (opt) {
+		case 'i':
+			if (strcmp(optarg, "sqlite") == 0) filter_config.index = FILTER_INDEX_SQLITE;
+			else if (strcmp(optarg, "hash") == 0) filter_config.index = FILTER_INDEX_HASH;
+			else if (strcmp(optarg, "compact") == 0) filter_config.index = FILTER_INDEX_COMPACT;
+			else if (strcmp(optarg, "snapshot") == 0) filter_config.index = FILTER_INDEX_SNAPSHOT;
+			else print_usage_and_exit();
+			break;
+		case 's': snapshot_path = optarg; break;
+		case 'm': filter_config.suffix_match = 1; break;
+		case 'c': filter_config.cache_size = strtoul(optarg, NULL, 10); break;
+		case 'F': url_field = strtol(optarg, NULL, 10); break;
+		case 'C': client_field = strtol(optarg, NULL, 10); break;
+		case 't': threads_number = strtol(optarg, NULL, 10); break;
+		case 'o': verdicts_path = optarg; break;
+		case 'j': json = 1; break;
+		case 'v': verbose = 1; break;
+		default: print_usage_and_exit();
+		}
+	}
+	if (optind + 1 != argc && optind + 2 != argc) print_usage_and_exit();
+	if (threads_number < 1 || url_field < 1 || client_field < 0) print_usage_and_exit();
+	if ((filter_config.index == FILTER_INDEX_SNAPSHOT) != (snapshot_path != NULL)) print_usage_and_exit();
+	const char *db_uri = argv[optind];
+	const char *log_path = (optind + 2 == argc ? argv[optind + 1] : NULL);
+
+	FILE *verdicts_file = NULL;
+	if (verdicts_path != NULL) {
+		verdicts_file = (strcmp(verdicts_path, "-") == 0 ? stdout : fopen(verdicts_path, "w"));
+		if (verdicts_file == NULL) {perror(verdicts_path); return EXIT_FAILURE;}
+	}
+	// counts go to stderr when verdicts take stdout
+	FILE *counts_file = (verdicts_file == stdout ? stderr : stdout);
+
+	filter_struct *filter = filter_construct(snapshot_path != NULL ? snapshot_path : db_uri, &filter_config);
+	if (filter == NULL) print_err_and_exit("filter_construct");
+	if (!verbose) __atomic_store_n(&cdebug_quiet, 1, __ATOMIC_RELAXED);
+	input_type input;
+	if (input_open(&input, log_path) != 0) return EXIT_FAILURE;
+
+	classifier_type classifier;
+	memset(&classifier, 0, sizeof(classifier));
+	classifier.filter = filter;
+	classifier.url_field = url_field;
+	classifier.client_field = client_field;
+	classifier.verdicts = (verdicts_file != NULL);
+	// two chunks per worker: one being classified, one ready for it
+	classifier.slots_number = threads_number * 2;
+	classifier.slots = calloc(classifier.slots_number, sizeof(slot_type));
+	pthread_t *threads = calloc(threads_number, sizeof(pthread_t));
+	if (classifier.slots == NULL || threads == NULL) print_err_and_exit("calloc");
+	pthread_mutex_init(&classifier.mutex, NULL);
+	pthread_cond_init(&classifier.cond, NULL);
+	for (long i=0; i<threads_number; ++i) {
+		if (pthread_create(&threads[i], NULL, worker_run, &classifier) != 0) print_err_and_exit("pthread_create");
+	}
+
+	double start = now();
+	uint64_t results[RESULTS_NUMBER] = {0};
+	size_t chunk_number = 0;
+	while (1) {
+		slot_type *slot = &classifier.slots[chunk_number % classifier.slots_number];
+		if (slot->state != SLOT_FREE) slot_retire(&classifier, slot, verdicts_file, results);
+		if (!input_read(&input, slot)) break;
+		pthread_mutex_lock(&classifier.mutex);
+		slot->state = SLOT_FILLED;
+		classifier.filled_number = ++chunk_number;
+		pthread_cond_broadcast(&classifier.cond);
+		pthread_mutex_unlock(&classifier.mutex);
+	}
+	pthread_mutex_lock(&classifier.mutex);
+	classifier.eof = 1;
+	pthread_cond_broadcast(&classifier.cond);
+	pthread_mutex_unlock(&classifier.mutex);
+	size_t retired_number = (chunk_number > classifier.slots_number ? chunk_number - classifier.slots_number : 0);
+	for (size_t i=retired_number; i<chunk_number; ++i) {
+		slot_type *slot = &classifier.slots[i % classifier.slots_number];
+		if (slot->state != SLOT_FREE) slot_retire(&classifier, slot, verdicts_file, results);
+	}
+	for (long i=0; i<threads_number; ++i) pthread_join(threads[i], NULL);
+	double seconds = now() - start;
+	uint64_t bytes = (input.map != NULL ? input.map_size : input.bytes);
+
+	int ok = input_close(&input);
+	if (verdicts_file != NULL && (fflush(verdicts_file) != 0 || (verdicts_file != stdout && fclose(verdicts_file) != 0))) {
+		perror("write verdicts");
+		ok = 0;
+	}
+	uint64_t lines = 0;
+	for (int r=0; r<RESULTS_NUMBER; ++r) lines += results[r];
+	if (json) {
+		fprintf(
+			counts_file,
+			"{\"lines\":%llu,\"allow\":%llu,\"deny\":%llu,\"unknown\":%llu,\"error\":%llu,"
+			"\"bytes\":%llu,\"seconds\":%.6f}\n",
+			(unsigned long long)lines,
+			(unsigned long long)results[FILTER_URI_ALLOW],
+			(unsigned long long)results[FILTER_URI_DENY],
+			(unsigned long long)results[FILTER_URI_DOESNT_EXIST],
+			(unsigned long long)results[FILTER_URI_ERROR],
+			(unsigned long long)bytes, seconds
+		);
+	} else {
+		fprintf(counts_file, "lines %llu\n", (unsigned long long)lines);
+		for (int r=0; r<RESULTS_NUMBER; ++r) {
+			fprintf(counts_file, "%s %llu\n", result_names[r], (unsigned long long)results[r]);
+		}
+		fprintf(
+			counts_file, "%llu bytes in %.3f s, %.1f MB/s\n",
+			(unsigned long long)bytes, seconds, (seconds > 0 ? bytes / seconds / 1e6 : 0)
+		);
+	}
+
+	pthread_cond_destroy(&classifier.cond);
+	pthread_mutex_destroy(&classifier.mutex);
+	for (size_t i=0; i<classifier.slots_number; ++i) {
+		free(classifier.slots[i].buf);
+		free(classifier.slots[i].out);
+	}
+	free(classifier.slots);
+	free(threads);
+	filter_destruct(filter);
+	return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "filter.h"
+#include "snapshot.h"
+
+void print_err_and_exit(const char *msg) {
+	fprintf(stderr, "error: %s\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+int compile(const char *db_uri, const char *snapshot_path) {
+	filter_config_struct filter_config;
+	memset(&filter_config, 0, sizeof(filter_config));
+	filter_config.index = FILTER_INDEX_HASH;
+	filter_struct *filter = filter_construct(db_uri, &filter_config);
+	if (filter == NULL) return 1;
+	int res = filter_save_snapshot(filter, snapshot_path);
+	filter_destruct(filter);
+	return res;
+}
+
+int verify(const char *snapshot_path) {
+	snapshot_struct *snapshot = snapshot_map(snapshot_path);
+	if (snapshot == NULL) return 1;
+	int res = snapshot_verify(snapshot);
+	snapshot_unmap(snapshot);
+	if (res) fprintf(stderr, "error: snapshot '%s': data checksum mismatch\n", snapshot_path);
+	return res;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 3) print_err_and_exit(
+		"wrong amount of arguments\n"
+		"usage: ecap_filter_compile <db_uri> <snapshot_path>\n"
+		"       ecap_filter_compile -c <snapshot_path>"
+	);
+	int res;
+	if (strcmp(argv[1], "-c") == 0) {
+		res = verify(argv[2]);
+	} else {
+		res = compile(argv[1], argv[2]);
+		if (!res) res = verify(argv[2]);
+	}
+	return (!res ? EXIT_SUCCESS : EXIT_FAILURE);
+}
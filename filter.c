@@ -1,16 +1,172 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include <sqlite3.h>
 #include "filter.h"
 #include "cdebug.h"
 #include "uri_parser.h"
-#include "map.h"
+#include "hash_index.h"
+#include "domain_dict.h"
+#include "snapshot.h"
+#include "verdict_cache.h"
+#include "bloom_filter.h"
+#include "category_blob.h"
+#include "pattern_matcher.h"
 
-struct filter_struct_ {
+typedef unsigned int category_id_type;
+#define CATEGORY_ID_TYPE_MAX UINT_MAX
+
+typedef uint64_t category_word_type;
+#define CATEGORY_WORD_BITS 64
+
+typedef int64_t group_id_type;
+#define FILTER_GROUP_TYPE_MAX UINT32_MAX
+
+// sites_index value of domain which category list could not be parsed
+#define CATEGORY_SET_INVALID UINT32_MAX
+// value of domain deleted by 'sites_delta': lookups do not find it
+#define CATEGORY_SET_DELETED (UINT32_MAX - 1)
+// values from this on are numbers of delta overlay sets, below it of category_sets
+#define CATEGORY_SET_DELTA_FIRST 0x80000000U
+#define CATEGORY_SETS_MAX (CATEGORY_SET_DELTA_FIRST - 2)
+
+// delta overlay is merged into hash index when it has this many domains
+// and at least 1/DELTA_MERGE_RATIO of index size
+#define DELTA_MERGE_SIZE_MIN 65536
+#define DELTA_MERGE_RATIO 64
+
+// suffix_match with FILTER_INDEX_SQLITE: number of suffixes queried at once,
+// domain with more of them is queried in several chunks
+#define SQLITE_SUFFIXES_MAX 32
+// labels are at least one byte and a dot
+#define DOMAIN_SUFFIXES_MAX ((URI_DOMAIN_SIZE_MAX + 1) / 2)
+// filter_uris_are_allowed(): uris whose index slots are prefetched before the first is resolved
+#define BATCH_GROUP_SIZE 16
+
+// Network of 'group_networks' table, IPv4 one as IPv4-mapped IPv6 network.
+typedef struct {
+	uint8_t address[16];
+	uint32_t prefix_bits;
+	filter_group_type group;
+} group_network_struct;
+
+typedef struct {
+	category_word_type *data;
+	size_t count;
+	size_t capacity;
+} category_sets_builder_struct;
+
+// Domains changed by 'sites_delta' rows applied after sites_index was built.
+// It is small and filter_apply_delta() copies it whole, so that data
+// read by lookups of other filters is never changed.
+typedef struct {
+	// domain -> CATEGORY_SET_DELTA_FIRST + number of its set, CATEGORY_SET_DELETED or CATEGORY_SET_INVALID
+	hash_index_struct *index;
+	// set -> number, equal sets are stored once
+	hash_index_struct *sets_index;
+	category_sets_builder_struct sets;
+} delta_struct;
+
+struct filter_struct_;
+
+// Per-thread lookup state: shared filter data is immutable after construct,
+// everything lookups have to mutate lives here.
+typedef struct context_struct_ {
+	struct filter_struct_ *filter;
+	struct context_struct_ *prev;
+	struct context_struct_ *next;
+	// FILTER_INDEX_SQLITE: connection used by this thread only
 	sqlite3 *db;
 	sqlite3_stmt *select_categories_stmt;
-	map_struct *map;
+	// NULL if cache_size is 0
+	verdict_cache_struct *cache;
+	// NULL if filter has no patterns of several pieces
+	pattern_matcher_scratch_struct *pattern_scratch;
+	// written by owner thread only, read by any thread
+	uint64_t lookups[4];
+	uint64_t parse_failures;
+	uint64_t pattern_denials;
+	histogram_struct backend_ticks;
+	uint64_t bloom_checks;
+	uint64_t bloom_skips;
+	uint64_t bloom_false_positives;
+} context_struct;
+
+struct filter_struct_ {
+	filter_index_enum index;
+	int suffix_match;
+	size_t cache_size;
+	int stats;
+	// tick counter and clock at construct, to convert ticks to ns
+	uint64_t construct_ticks;
+	uint64_t construct_ns;
+	// used at construct only
+	sqlite3 *db;
+	// database file and its state at construct, empty path if db is not a file
+	char *db_path;
+	struct stat db_stat;
+	// not FILTER_INDEX_SNAPSHOT: contexts of FILTER_INDEX_SQLITE and filter_apply_delta() open it
+	char *db_uri;
+	// FILTER_INDEX_SQLITE: all domains of db, NULL if not configured
+	bloom_filter_struct *bloom;
+	char *select_categories_sql;
+	pthread_key_t context_key;
+	// contexts list is locked only when thread gets or releases its context
+	pthread_mutex_t contexts_mutex;
+	context_struct *contexts;
+	// stats of contexts destructed on thread exit, locked by contexts_mutex
+	filter_stats_struct exited_stats;
+	// FILTER_INDEX_SNAPSHOT, FILTER_INDEX_SHARED: arrays below point into snapshot mapping
+	snapshot_struct *snapshot;
+	// FILTER_INDEX_SHARED: snapshot path and its generation when mapped
+	char *shared_path;
+	uint64_t shared_generation;
+	// categories from 'rules' table sorted by id, position is category bit number
+	const category_id_type *category_ids;
+	size_t categories_number;
+	size_t category_words;
+	// category_words per group, FILTER_GROUP_DEFAULT from 'rules' first,
+	// others from 'group_rules'; bit is set for not allowed categories
+	const category_word_type *deny_masks;
+	size_t groups_number;
+	// id of each group after FILTER_GROUP_DEFAULT, sorted
+	const group_id_type *group_ids;
+	// sorted by prefix_bits descending, so the first containing address is the longest
+	const group_network_struct *group_networks;
+	size_t group_networks_number;
+	// FILTER_INDEX_HASH: domain -> number of its category set in category_sets
+	hash_index_struct *sites_index;
+	// FILTER_INDEX_COMPACT: the same in front-coded dictionary
+	domain_dict_struct *sites_dict;
+	const category_word_type *category_sets;
+	size_t category_sets_number;
+	// patterns of denied categories from 'patterns' table, NULL if there are none;
+	// FILTER_INDEX_SNAPSHOT, FILTER_INDEX_SHARED: attached to snapshot mapping
+	pattern_matcher_struct *patterns;
+	// Filter made by filter_apply_delta() shares all data above but contexts with its
+	// origin, one made by filter_merge_delta() all but sites_index and category_sets;
+	// the last filter sharing data frees it.
+	size_t *shared_refs;
+	size_t *sites_refs;
+	// NULL if no 'sites_delta' rows were applied after sites_index was built
+	delta_struct *delta;
+	// seq of the last 'sites_delta' row applied
+	int64_t delta_seq;
 };
 
 static void print_err(const char *msg) {
@@ -25,16 +181,1331 @@ static void print_sqlite3_sql_err(const char *func, const char *sql, int errcode
 	cdebug_printf(CDEBUG_IL_CRITICAL, "sqlite3_%s sql '%s': %s\n", func, sql, sqlite3_errstr(errcode));
 }
 
-static void print_select_categories_stmt_err(const char *func, int errcode) {
-	cdebug_printf(CDEBUG_IL_CRITICAL, "sqlite3_%s select_categories_stmt: %s\n", func, sqlite3_errstr(errcode));
+static void print_select_categories_stmt_err(const char *func, int errcode) {
+	cdebug_printf(CDEBUG_IL_CRITICAL, "sqlite3_%s select_categories_stmt: %s\n", func, sqlite3_errstr(errcode));
+}
+
+typedef category_id_type number_type;
+#define NUMBER_TYPE_MAX CATEGORY_ID_TYPE_MAX
+
+typedef enum {
+	SPNR_SUCCESS,
+	SPNR_INVALID,
+	SPNR_OVERFLOW
+} str_parse_number_result_enum;
+
+static str_parse_number_result_enum str_parse_number(
+		const char *str, const char **end_out, number_type *number_out
+) {
+	number_type number = 0;
+	const char *cur = str;
+	while (*cur >= '0' && *cur <= '9') {
+		number_type digit = *cur - '0';
+		if (!(number <= NUMBER_TYPE_MAX / 10)) {*end_out = cur; return SPNR_OVERFLOW;}
+		number *= 10;
+		if (!(number <= NUMBER_TYPE_MAX - digit)) {*end_out = cur; return SPNR_OVERFLOW;}
+		number += digit;
+		++cur;
+	}
+	if (cur == str) {*end_out = cur; return SPNR_INVALID;}
+	*end_out = cur;
+	*number_out = number;
+	return SPNR_SUCCESS;
+}
+
+static bool category_bit(const filter_struct *filter, category_id_type category, size_t *bit_out) {
+	size_t lo = 0, hi = filter->categories_number;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (filter->category_ids[mid] < category) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == filter->categories_number || filter->category_ids[lo] != category) return false;
+	*bit_out = lo;
+	return true;
+}
+
+// group out of range is FILTER_GROUP_DEFAULT
+static const category_word_type *group_deny_mask(const filter_struct *filter, filter_group_type group) {
+	if (group >= filter->groups_number) group = FILTER_GROUP_DEFAULT;
+	return filter->deny_masks + (size_t)group * filter->category_words;
+}
+
+static bool category_is_denied(const category_word_type *deny_mask, size_t bit) {
+	return (deny_mask[bit / CATEGORY_WORD_BITS] & ((category_word_type)1 << (bit % CATEGORY_WORD_BITS))) != 0;
+}
+
+static bool category_set_is_allowed(
+		const filter_struct *filter, const category_word_type *deny_mask, const category_word_type *set
+) {
+	category_word_type denied = 0;
+	for (size_t i=0; i<filter->category_words; ++i) denied |= set[i] & deny_mask[i];
+	return denied == 0;
+}
+
+// Category list of sites row: comma separated text or category blob,
+// told apart by sqlite value type so both may be in one db.
+typedef struct {
+	const char *data;
+	size_t size;
+	bool is_blob;
+} category_list_struct;
+
+// false if value is NULL
+static bool column_category_list(sqlite3_stmt *stmt, int column, category_list_struct *list_out) {
+	list_out->is_blob = (sqlite3_column_type(stmt, column) == SQLITE_BLOB);
+	// empty blob is NULL: it is left to category_list_next() to reject
+	list_out->data = (list_out->is_blob ?
+		(const char *)sqlite3_column_blob(stmt, column) :
+		(const char *)sqlite3_column_text(stmt, column)
+	);
+	list_out->size = sqlite3_column_bytes(stmt, column);
+	return list_out->is_blob || list_out->data != NULL;
+}
+
+// *cur_inout -- list->data before the first call,
+// *category_inout -- previous category, 0 before the first call
+static category_blob_next_enum category_list_next(
+		const category_list_struct *list, const char **cur_inout, category_id_type *category_inout
+) {
+	if (list->is_blob) {
+		const uint8_t *begin = (const uint8_t *)list->data;
+		const uint8_t *cur = (const uint8_t *)*cur_inout;
+		category_blob_next_enum res = category_blob_next(&cur, begin, begin + list->size, category_inout);
+		*cur_inout = (const char *)cur;
+		return res;
+	}
+	// NULL: the last number was read
+	if (*cur_inout == NULL) return CATEGORY_BLOB_NEXT_END;
+	const char *cur;
+	str_parse_number_result_enum spn_res = str_parse_number(*cur_inout, &cur, category_inout);
+	if (spn_res != SPNR_SUCCESS || !(*cur == '\0' || *cur == ',')) return CATEGORY_BLOB_NEXT_INVALID;
+	*cur_inout = (*cur == ',' ? cur + 1 : NULL);
+	return CATEGORY_BLOB_NEXT_ID;
+}
+
+static void print_category_list_err(
+		const category_list_struct *list, const char *err,
+		const char *domain, size_t domain_size
+) {
+	if (list->is_blob) {
+		cdebug_printf(
+			CDEBUG_IL_CRITICAL, "%s in category blob of %zu bytes for domain '%.*s'",
+			err, list->size, (int)domain_size, domain
+		);
+	} else {
+		cdebug_printf(
+			CDEBUG_IL_CRITICAL, "%s in category list '%.*s' for domain '%.*s'",
+			err, (int)list->size, list->data, (int)domain_size, domain
+		);
+	}
+}
+
+// Reads category list and maps each category to its bit.
+// On error logs it and returns -1, at the end returns 0.
+static int category_list_next_bit(
+		const filter_struct *filter, const category_list_struct *list,
+		const char **cur_inout, category_id_type *category_inout,
+		const char *domain, size_t domain_size,
+		size_t *bit_out
+) {
+	switch (category_list_next(list, cur_inout, category_inout)) {
+		case CATEGORY_BLOB_NEXT_END:
+			return 0;
+		case CATEGORY_BLOB_NEXT_INVALID:
+			print_category_list_err(list, "invalid category", domain, domain_size);
+			return -1;
+		case CATEGORY_BLOB_NEXT_ID:
+			break;
+	}
+	if (! category_bit(filter, *category_inout, bit_out)) {
+		char err[64];
+		snprintf(err, sizeof(err), "unknown category '%u'", *category_inout);
+		print_category_list_err(list, err, domain, domain_size);
+		return -1;
+	}
+	return 1;
+}
+
+// Parse category list into category set.
+// On error logs it and returns 1.
+static int parse_category_list(
+		const filter_struct *filter, const category_list_struct *list,
+		const char *domain, size_t domain_size,
+		category_word_type *set_out
+) {
+	memset(set_out, 0, filter->category_words * sizeof(set_out[0]));
+	const char *cur = list->data;
+	category_id_type category = 0;
+	size_t bit;
+	int res;
+	while ((res = category_list_next_bit(filter, list, &cur, &category, domain, domain_size, &bit)) > 0) {
+		set_out[bit / CATEGORY_WORD_BITS] |= (category_word_type)1 << (bit % CATEGORY_WORD_BITS);
+	}
+	return res < 0;
+}
+
+static int load_rules(filter_struct *filter) {
+	const char *sql = "SELECT category_id, allowed FROM rules ORDER BY category_id";
+	sqlite3_stmt *stmt;
+	int res = sqlite3_prepare_v2(
+		filter->db,
+		sql, strlen(sql),
+		&stmt,
+		NULL
+	);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); return 1;}
+
+	size_t capacity = 0;
+	category_id_type *category_ids = NULL;
+	unsigned char *allowed_list = NULL;
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		sqlite3_int64 category_id = sqlite3_column_int64(stmt, 0);
+		int allowed                = sqlite3_column_int(stmt, 1);
+		if (category_id < 0 || category_id > CATEGORY_ID_TYPE_MAX) {
+			cdebug_printf(
+				CDEBUG_IL_CRITICAL,
+				"invalid 'category_id' column value '%lld'",
+				(long long)category_id
+			);
+			goto err_free;
+		}
+		if (!(allowed == 0 || allowed == 1)) {
+			cdebug_printf(
+				CDEBUG_IL_CRITICAL,
+				"invalid 'allowed' column value '%d' for category_id '%lld'",
+				allowed,
+				(long long)category_id
+			);
+			goto err_free;
+		}
+		if (filter->categories_number == capacity) {
+			capacity = (capacity != 0 ? capacity * 2 : 64);
+			category_id_type *new_category_ids = realloc(category_ids, capacity * sizeof(category_ids[0]));
+			if (new_category_ids == NULL) {print_err("realloc"); goto err_free;}
+			category_ids = new_category_ids;
+			unsigned char *new_allowed_list = realloc(allowed_list, capacity * sizeof(allowed_list[0]));
+			if (new_allowed_list == NULL) {print_err("realloc"); goto err_free;}
+			allowed_list = new_allowed_list;
+		}
+		category_ids[filter->categories_number] = (category_id_type)category_id;
+		allowed_list[filter->categories_number] = allowed;
+		++filter->categories_number;
+	}
+	if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); goto err_free;}
+	res = sqlite3_finalize(stmt);
+	filter->category_ids = category_ids;
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); free(allowed_list); return 1;}
+
+	filter->category_words = (filter->categories_number + CATEGORY_WORD_BITS - 1) / CATEGORY_WORD_BITS;
+	category_word_type *deny_mask = calloc(filter->category_words + 1, sizeof(deny_mask[0]));
+	if (deny_mask == NULL) {print_err("calloc"); free(allowed_list); return 1;}
+	for (size_t i=0; i<filter->categories_number; ++i) {
+		if (! allowed_list[i]) {
+			deny_mask[i / CATEGORY_WORD_BITS] |= (category_word_type)1 << (i % CATEGORY_WORD_BITS);
+		}
+	}
+	filter->deny_masks = deny_mask;
+	filter->groups_number = 1;
+	free(allowed_list);
+	return 0;
+
+err_free:
+	sqlite3_finalize(stmt);
+	free(category_ids);
+	free(allowed_list);
+	return 1;
+}
+
+// true if optional table is missing, so that failed prepare of its select is not an error
+static bool table_is_missing(sqlite3 *db, const char *table) {
+	return sqlite3_table_column_metadata(db, NULL, table, NULL, NULL, NULL, NULL, NULL, NULL) != SQLITE_OK;
+}
+
+// Optional 'group_rules' table: each group gets a copy of 'rules' deny mask
+// with its rows applied, so lookup in any group is one mask over the same category set.
+// Row of unknown category is logged and ignored.
+static int load_group_rules(filter_struct *filter) {
+	const char *sql = "SELECT group_id, category_id, allowed FROM group_rules ORDER BY group_id";
+	sqlite3_stmt *stmt;
+	int res = sqlite3_prepare_v2(
+		filter->db,
+		sql, strlen(sql),
+		&stmt,
+		NULL
+	);
+	if (res != SQLITE_OK) {
+		if (table_is_missing(filter->db, "group_rules")) return 0;
+		print_sqlite3_sql_err("prepare_v2", sql, res);
+		return 1;
+	}
+
+	size_t words = filter->category_words;
+	size_t capacity = 1;
+	group_id_type *group_ids = NULL;
+	// filter->deny_masks has one row of 'rules' yet, it becomes the first row of the matrix
+	category_word_type *deny_masks = (category_word_type *)filter->deny_masks;
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		sqlite3_int64 group_id     = sqlite3_column_int64(stmt, 0);
+		sqlite3_int64 category_id  = sqlite3_column_int64(stmt, 1);
+		int allowed                = sqlite3_column_int(stmt, 2);
+		if (!(allowed == 0 || allowed == 1)) {
+			cdebug_printf(
+				CDEBUG_IL_CRITICAL,
+				"invalid 'allowed' column value '%d' for group_id '%lld' category_id '%lld'",
+				allowed, (long long)group_id, (long long)category_id
+			);
+			goto err_free;
+		}
+		size_t bit;
+		if (category_id < 0 || category_id > CATEGORY_ID_TYPE_MAX || !category_bit(filter, category_id, &bit)) {
+			cdebug_printf(
+				CDEBUG_IL_CRITICAL,
+				"group_id '%lld' rule has unknown category_id '%lld', ignored",
+				(long long)group_id, (long long)category_id
+			);
+			continue;
+		}
+		if (filter->groups_number == 1 || group_ids[filter->groups_number - 2] != group_id) {
+			if (filter->groups_number == FILTER_GROUP_TYPE_MAX) {print_err("too many groups"); goto err_free;}
+			if (filter->groups_number == capacity) {
+				capacity *= 2;
+				group_id_type *new_group_ids = realloc(group_ids, capacity * sizeof(group_ids[0]));
+				if (new_group_ids == NULL) {print_err("realloc"); goto err_free;}
+				group_ids = new_group_ids;
+				// one extra word as in load_rules()
+				category_word_type *new_deny_masks = realloc(deny_masks, (capacity * words + 1) * sizeof(deny_masks[0]));
+				if (new_deny_masks == NULL) {print_err("realloc"); goto err_free;}
+				deny_masks = new_deny_masks;
+				filter->deny_masks = deny_masks;
+			}
+			group_ids[filter->groups_number - 1] = group_id;
+			memcpy(deny_masks + filter->groups_number * words, deny_masks, words * sizeof(deny_masks[0]));
+			++filter->groups_number;
+		}
+		category_word_type *deny_mask = deny_masks + (filter->groups_number - 1) * words;
+		category_word_type category_mask = (category_word_type)1 << (bit % CATEGORY_WORD_BITS);
+		if (allowed) deny_mask[bit / CATEGORY_WORD_BITS] &= ~category_mask;
+		else deny_mask[bit / CATEGORY_WORD_BITS] |= category_mask;
+	}
+	if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); goto err_free;}
+	filter->group_ids = group_ids;
+	res = sqlite3_finalize(stmt);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); return 1;}
+	return 0;
+
+err_free:
+	sqlite3_finalize(stmt);
+	free(group_ids);
+	return 1;
+}
+
+// Parses "address/prefix_bits" or address alone, IPv4 one into IPv4-mapped IPv6 network.
+static bool parse_network(const char *text, size_t text_size, uint8_t *address_out, uint32_t *prefix_bits_out) {
+	char buf[INET6_ADDRSTRLEN + 8];
+	if (text_size == 0 || text_size >= sizeof(buf)) return false;
+	memcpy(buf, text, text_size);
+	buf[text_size] = '\0';
+	char *slash = strchr(buf, '/');
+	if (slash != NULL) *slash = '\0';
+	uint32_t max_bits;
+	if (inet_pton(AF_INET6, buf, address_out) == 1) {
+		max_bits = 128;
+	} else if (inet_pton(AF_INET, buf, address_out + 12) == 1) {
+		memset(address_out, 0, 10);
+		address_out[10] = address_out[11] = 0xFF;
+		max_bits = 32;
+	} else {
+		return false;
+	}
+	number_type prefix_bits = max_bits;
+	if (slash != NULL) {
+		const char *end;
+		if (str_parse_number(slash + 1, &end, &prefix_bits) != SPNR_SUCCESS || *end != '\0') return false;
+		if (prefix_bits > max_bits) return false;
+	}
+	*prefix_bits_out = prefix_bits + (128 - max_bits);
+	return true;
+}
+
+static bool network_contains(const group_network_struct *network, const uint8_t *address) {
+	size_t full_bytes = network->prefix_bits / 8;
+	if (memcmp(network->address, address, full_bytes) != 0) return false;
+	unsigned int rest_bits = network->prefix_bits % 8;
+	if (rest_bits == 0) return true;
+	uint8_t mask = (uint8_t)(0xFF << (8 - rest_bits));
+	return ((network->address[full_bytes] ^ address[full_bytes]) & mask) == 0;
+}
+
+static int group_network_compare(const void *a, const void *b) {
+	uint32_t a_bits = ((const group_network_struct *)a)->prefix_bits;
+	uint32_t b_bits = ((const group_network_struct *)b)->prefix_bits;
+	return (a_bits > b_bits ? -1 : a_bits < b_bits ? 1 : 0);
+}
+
+// Optional 'group_networks' table maps client addresses to groups. Network of group
+// without 'group_rules' is logged and ignored, malformed network is an error.
+static int load_group_networks(filter_struct *filter) {
+	const char *sql = "SELECT network, group_id FROM group_networks";
+	sqlite3_stmt *stmt;
+	int res = sqlite3_prepare_v2(
+		filter->db,
+		sql, strlen(sql),
+		&stmt,
+		NULL
+	);
+	if (res != SQLITE_OK) {
+		if (table_is_missing(filter->db, "group_networks")) return 0;
+		print_sqlite3_sql_err("prepare_v2", sql, res);
+		return 1;
+	}
+
+	size_t capacity = 0;
+	group_network_struct *networks = NULL;
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *network = (const char *)sqlite3_column_text(stmt, 0);
+		size_t network_size = sqlite3_column_bytes(stmt, 0);
+		sqlite3_int64 group_id = sqlite3_column_int64(stmt, 1);
+		if (network == NULL) network = "";
+		filter_group_type group = filter_group_of_id(filter, group_id);
+		if (group == FILTER_GROUP_DEFAULT) {
+			cdebug_printf(
+				CDEBUG_IL_CRITICAL,
+				"network '%s' has group_id '%lld' without group_rules, ignored",
+				network, (long long)group_id
+			);
+			continue;
+		}
+		if (filter->group_networks_number == capacity) {
+			capacity = (capacity != 0 ? capacity * 2 : 64);
+			group_network_struct *new_networks = realloc(networks, capacity * sizeof(networks[0]));
+			if (new_networks == NULL) {print_err("realloc"); goto err_free;}
+			networks = new_networks;
+		}
+		group_network_struct *entry = &networks[filter->group_networks_number];
+		memset(entry, 0, sizeof(*entry));
+		if (! parse_network(network, network_size, entry->address, &entry->prefix_bits)) {
+			cdebug_printf(CDEBUG_IL_CRITICAL, "invalid network '%s' of group_id '%lld'", network, (long long)group_id);
+			goto err_free;
+		}
+		entry->group = group;
+		++filter->group_networks_number;
+	}
+	if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); goto err_free;}
+	if (filter->group_networks_number > 0) {
+		qsort(networks, filter->group_networks_number, sizeof(networks[0]), group_network_compare);
+	}
+	filter->group_networks = networks;
+	res = sqlite3_finalize(stmt);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); return 1;}
+	return 0;
+
+err_free:
+	sqlite3_finalize(stmt);
+	free(networks);
+	filter->group_networks_number = 0;
+	return 1;
+}
+
+// Optional 'patterns' table is compiled into one automaton, tag of pattern is its category bit.
+// Patterns of categories allowed in every group can never deny a request, so only those
+// denied in some group are kept. Pattern of unknown category is logged and ignored.
+static int load_patterns(filter_struct *filter) {
+	const char *sql = "SELECT pattern, category_id FROM patterns";
+	sqlite3_stmt *stmt;
+	int res = sqlite3_prepare_v2(
+		filter->db,
+		sql, strlen(sql),
+		&stmt,
+		NULL
+	);
+	if (res != SQLITE_OK) {
+		// no table -- no patterns
+		if (table_is_missing(filter->db, "patterns")) return 0;
+		print_sqlite3_sql_err("prepare_v2", sql, res);
+		return 1;
+	}
+
+	// pattern texts are kept in one buffer, their offsets are turned into pointers at the end
+	char *texts = NULL;
+	size_t texts_size = 0, texts_capacity = 0;
+	size_t *offsets = NULL;
+	size_t *sizes = NULL;
+	uint32_t *bits = NULL;
+	size_t patterns_number = 0, patterns_capacity = 0;
+	const char **patterns = NULL;
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *pattern = (const char *)sqlite3_column_text(stmt, 0);
+		size_t pattern_size = sqlite3_column_bytes(stmt, 0);
+		sqlite3_int64 category_id = sqlite3_column_int64(stmt, 1);
+		if (pattern == NULL) pattern = "";
+		size_t bit;
+		if (category_id < 0 || category_id > CATEGORY_ID_TYPE_MAX || !category_bit(filter, category_id, &bit)) {
+			cdebug_printf(
+				CDEBUG_IL_CRITICAL,
+				"pattern '%s' has unknown category_id '%lld', ignored",
+				pattern, (long long)category_id
+			);
+			continue;
+		}
+		bool denied = false;
+		for (filter_group_type group=0; group<filter->groups_number && !denied; ++group) {
+			denied = category_is_denied(group_deny_mask(filter, group), bit);
+		}
+		if (! denied) continue;
+		if (patterns_number == patterns_capacity) {
+			patterns_capacity = (patterns_capacity != 0 ? patterns_capacity * 2 : 64);
+			size_t *new_offsets = realloc(offsets, patterns_capacity * sizeof(offsets[0]));
+			if (new_offsets == NULL) {print_err("realloc"); goto err_free;}
+			offsets = new_offsets;
+			size_t *new_sizes = realloc(sizes, patterns_capacity * sizeof(sizes[0]));
+			if (new_sizes == NULL) {print_err("realloc"); goto err_free;}
+			sizes = new_sizes;
+			uint32_t *new_bits = realloc(bits, patterns_capacity * sizeof(bits[0]));
+			if (new_bits == NULL) {print_err("realloc"); goto err_free;}
+			bits = new_bits;
+		}
+		if (texts_size + pattern_size > texts_capacity) {
+			while (texts_size + pattern_size > texts_capacity) texts_capacity = (texts_capacity != 0 ? texts_capacity * 2 : 4096);
+			char *new_texts = realloc(texts, texts_capacity);
+			if (new_texts == NULL) {print_err("realloc"); goto err_free;}
+			texts = new_texts;
+		}
+		memcpy(texts + texts_size, pattern, pattern_size);
+		offsets[patterns_number] = texts_size;
+		sizes[patterns_number] = pattern_size;
+		bits[patterns_number] = bit;
+		texts_size += pattern_size;
+		++patterns_number;
+	}
+	if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); goto err_free;}
+
+	if (patterns_number > 0) {
+		patterns = malloc(patterns_number * sizeof(patterns[0]));
+		if (patterns == NULL) {print_err("malloc"); goto err_free;}
+		for (size_t i=0; i<patterns_number; ++i) patterns[i] = texts + offsets[i];
+		filter->patterns = pattern_matcher_construct(patterns, sizes, bits, patterns_number);
+		if (filter->patterns == NULL) {print_err("pattern_matcher_construct"); goto err_free;}
+		if (pattern_matcher_patterns_number(filter->patterns) == 0) {
+			pattern_matcher_destruct(filter->patterns);
+			filter->patterns = NULL;
+		}
+	}
+	free(patterns);
+	free(bits);
+	free(sizes);
+	free(offsets);
+	free(texts);
+	res = sqlite3_finalize(stmt);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); return 1;}
+	return 0;
+
+err_free:
+	sqlite3_finalize(stmt);
+	free(patterns);
+	free(bits);
+	free(sizes);
+	free(offsets);
+	free(texts);
+	return 1;
+}
+
+static int category_sets_append(
+		category_sets_builder_struct *builder, size_t category_words,
+		const category_word_type *set
+) {
+	if (builder->count == CATEGORY_SETS_MAX) {
+		print_err("too many distinct category sets");
+		return 1;
+	}
+	if (builder->count == builder->capacity) {
+		size_t capacity = (builder->capacity != 0 ? builder->capacity * 2 : 1024);
+		category_word_type *data = realloc(builder->data, capacity * category_words * sizeof(data[0]));
+		if (data == NULL) {print_err("realloc"); return 1;}
+		builder->data = data;
+		builder->capacity = capacity;
+	}
+	memcpy(builder->data + builder->count * category_words, set, category_words * sizeof(set[0]));
+	++builder->count;
+	return 0;
+}
+
+// Number of set in sets, equal sets are stored once: sets_index maps set to its number.
+// set -- category_words + 1 words, the last one zero, so that set key is never empty
+static int category_sets_intern(
+		hash_index_struct *sets_index, category_sets_builder_struct *sets, size_t category_words,
+		const category_word_type *set, hash_index_value_type *set_number_out
+) {
+	*set_number_out = sets->count;
+	size_t set_size = (category_words + 1) * sizeof(set[0]);
+	switch (hash_index_put(sets_index, (const char *)set, set_size, *set_number_out, set_number_out)) {
+		case HIPR_INSERTED:
+			return category_sets_append(sets, category_words, set);
+		case HIPR_EXISTS:
+			return 0;
+		case HIPR_ERROR:
+			break;
+	}
+	print_err("hash_index_put");
+	return 1;
+}
+
+static int select_sites_count(sqlite3 *db, size_t *count_out) {
+	const char *sql = "SELECT COUNT(*) FROM sites";
+	sqlite3_stmt *stmt;
+	int res = sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); return 1;}
+	res = sqlite3_step(stmt);
+	if (res != SQLITE_ROW) {
+		print_sqlite3_sql_err("step", sql, res);
+		sqlite3_finalize(stmt);
+		return 1;
+	}
+	sqlite3_int64 count = sqlite3_column_int64(stmt, 0);
+	res = sqlite3_finalize(stmt);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); return 1;}
+	*count_out = (count > 0 ? (size_t)count : 0);
+	return 0;
+}
+
+// Load whole 'sites' table into sites_index, or into dict_builder if it is not NULL.
+// Category lists are parsed into category sets, equal sets are stored once.
+static int load_sites(filter_struct *filter, domain_dict_builder_struct *dict_builder) {
+	size_t sites_count;
+	if (select_sites_count(filter->db, &sites_count)) return 1;
+
+	size_t domain_size_max = HASH_INDEX_KEY_SIZE_MAX;
+	if (dict_builder != NULL) {
+		domain_size_max = DOMAIN_DICT_KEY_SIZE_MAX;
+	} else {
+		filter->sites_index = hash_index_construct(sites_count);
+		if (filter->sites_index == NULL) {print_err("hash_index_construct"); return 1;}
+	}
+	hash_index_struct *sets_index = hash_index_construct(0);
+	if (sets_index == NULL) {print_err("hash_index_construct"); return 1;}
+	category_sets_builder_struct sets = {NULL, 0, 0};
+	category_word_type *set = calloc(filter->category_words + 1, sizeof(set[0]));
+	if (set == NULL) {print_err("calloc"); goto err_sets_free;}
+
+	const char *sql = "SELECT domain, categories FROM sites";
+	sqlite3_stmt *stmt;
+	int res = sqlite3_prepare_v2(filter->db, sql, strlen(sql), &stmt, NULL);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); goto err_sets_free;}
+
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *domain = (const char *)sqlite3_column_text(stmt, 0);
+		size_t domain_size = sqlite3_column_bytes(stmt, 0);
+		category_list_struct category_list;
+		if (domain == NULL || ! column_category_list(stmt, 1, &category_list)) {print_err("sqlite3_column_text"); goto err_finalize;}
+		if (domain_size == 0 || domain_size > domain_size_max) {
+			cdebug_printf(CDEBUG_IL_CRITICAL, "invalid domain '%.*s'", (int)domain_size, domain);
+			goto err_finalize;
+		}
+
+		hash_index_value_type set_number = CATEGORY_SET_INVALID;
+		if (
+			! parse_category_list(filter, &category_list, domain, domain_size, set) &&
+			category_sets_intern(sets_index, &sets, filter->category_words, set, &set_number)
+		) {
+			goto err_finalize;
+		}
+		if (dict_builder != NULL) {
+			if (domain_dict_builder_add(dict_builder, domain, domain_size, set_number)) {
+				print_err("domain_dict_builder_add");
+				goto err_finalize;
+			}
+		} else if (hash_index_put(filter->sites_index, domain, domain_size, set_number, NULL) == HIPR_ERROR) {
+			print_err("hash_index_put");
+			goto err_finalize;
+		}
+	}
+	if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); goto err_finalize;}
+	res = sqlite3_finalize(stmt);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); goto err_sets_free;}
+
+	free(set);
+	hash_index_destruct(sets_index);
+	filter->category_sets = sets.data;
+	filter->category_sets_number = sets.count;
+	return 0;
+
+err_finalize:
+	sqlite3_finalize(stmt);
+err_sets_free:
+	free(set);
+	free(sets.data);
+	hash_index_destruct(sets_index);
+	return 1;
+}
+
+static void delta_destruct(delta_struct *delta) {
+	if (delta->index != NULL) hash_index_destruct(delta->index);
+	if (delta->sets_index != NULL) hash_index_destruct(delta->sets_index);
+	free(delta->sets.data);
+	free(delta);
+}
+
+static delta_struct *delta_construct(void) {
+	delta_struct *delta = calloc(1, sizeof(delta_struct));
+	if (delta == NULL) {print_err("calloc"); return NULL;}
+	delta->index = hash_index_construct(0);
+	delta->sets_index = hash_index_construct(0);
+	if (delta->index == NULL || delta->sets_index == NULL) {
+		print_err("hash_index_construct");
+		delta_destruct(delta);
+		return NULL;
+	}
+	return delta;
+}
+
+static delta_struct *delta_clone(const delta_struct *delta, size_t category_words) {
+	delta_struct *clone = calloc(1, sizeof(delta_struct));
+	if (clone == NULL) {print_err("calloc"); return NULL;}
+	clone->index = hash_index_clone(delta->index);
+	clone->sets_index = hash_index_clone(delta->sets_index);
+	if (clone->index == NULL || clone->sets_index == NULL) {print_err("hash_index_clone"); goto err_destruct;}
+	clone->sets.data = malloc((delta->sets.capacity * category_words + 1) * sizeof(clone->sets.data[0]));
+	if (clone->sets.data == NULL) {print_err("malloc"); goto err_destruct;}
+	if (delta->sets.count != 0) {
+		memcpy(clone->sets.data, delta->sets.data, delta->sets.count * category_words * sizeof(clone->sets.data[0]));
+	}
+	clone->sets.count = delta->sets.count;
+	clone->sets.capacity = delta->sets.capacity;
+	return clone;
+
+err_destruct:
+	delta_destruct(clone);
+	return NULL;
+}
+
+static int select_delta_max_seq(sqlite3 *db, int64_t *seq_out) {
+	*seq_out = 0;
+	if (table_is_missing(db, "sites_delta")) return 0;
+	const char *sql = "SELECT MAX(seq) FROM sites_delta";
+	sqlite3_stmt *stmt;
+	int res = sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); return 1;}
+	res = sqlite3_step(stmt);
+	if (res != SQLITE_ROW) {
+		print_sqlite3_sql_err("step", sql, res);
+		sqlite3_finalize(stmt);
+		return 1;
+	}
+	*seq_out = sqlite3_column_int64(stmt, 0);
+	res = sqlite3_finalize(stmt);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); return 1;}
+	return 0;
+}
+
+// Apply rows of optional 'sites_delta' table after filter->delta_seq to delta overlay
+// in seq order: 'insert' and 'update' set categories of domain, 'delete' removes it.
+static int load_delta(filter_struct *filter, sqlite3 *db, size_t *rows_out) {
+	*rows_out = 0;
+	if (table_is_missing(db, "sites_delta")) return 0;
+	category_word_type *set = calloc(filter->category_words + 1, sizeof(set[0]));
+	if (set == NULL) {print_err("calloc"); return 1;}
+
+	const char *sql = "SELECT seq, op, domain, categories FROM sites_delta WHERE seq > ? ORDER BY seq";
+	sqlite3_stmt *stmt;
+	int res = sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); goto err_free;}
+	res = sqlite3_bind_int64(stmt, 1, filter->delta_seq);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("bind_int64", sql, res); goto err_finalize;}
+
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		int64_t seq = sqlite3_column_int64(stmt, 0);
+		const char *op = (const char *)sqlite3_column_text(stmt, 1);
+		const char *domain = (const char *)sqlite3_column_text(stmt, 2);
+		size_t domain_size = sqlite3_column_bytes(stmt, 2);
+		if (op == NULL || domain == NULL) {print_err("sqlite3_column_text"); goto err_finalize;}
+		if (domain_size == 0 || domain_size > HASH_INDEX_KEY_SIZE_MAX) {
+			cdebug_printf(CDEBUG_IL_CRITICAL, "sites_delta: invalid domain '%.*s'", (int)domain_size, domain);
+			goto err_finalize;
+		}
+		if (filter->delta == NULL && (filter->delta = delta_construct()) == NULL) goto err_finalize;
+		delta_struct *delta = filter->delta;
+
+		hash_index_value_type value = CATEGORY_SET_DELETED;
+		if (strcmp(op, "insert") == 0 || strcmp(op, "update") == 0) {
+			category_list_struct category_list;
+			if (! column_category_list(stmt, 3, &category_list)) {print_err("sqlite3_column_text"); goto err_finalize;}
+			value = CATEGORY_SET_INVALID;
+			if (! parse_category_list(filter, &category_list, domain, domain_size, set)) {
+				hash_index_value_type set_number;
+				if (category_sets_intern(delta->sets_index, &delta->sets, filter->category_words, set, &set_number)) {
+					goto err_finalize;
+				}
+				value = CATEGORY_SET_DELTA_FIRST + set_number;
+			}
+		} else if (strcmp(op, "delete") != 0) {
+			cdebug_printf(CDEBUG_IL_CRITICAL, "sites_delta: invalid op '%s' of seq %lld", op, (long long)seq);
+			goto err_finalize;
+		}
+		if (hash_index_set(delta->index, domain, domain_size, value) == HIPR_ERROR) {print_err("hash_index_set"); goto err_finalize;}
+		filter->delta_seq = seq;
+		++*rows_out;
+	}
+	if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); goto err_finalize;}
+	res = sqlite3_finalize(stmt);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); goto err_free;}
+	free(set);
+	return 0;
+
+err_finalize:
+	sqlite3_finalize(stmt);
+err_free:
+	free(set);
+	return 1;
+}
+
+// Fold delta overlay into sites_index, or into dict_builder if it is not NULL, and
+// category_sets, which filter must own; deleted domains stay as CATEGORY_SET_DELETED.
+static int delta_merge(filter_struct *filter, domain_dict_builder_struct *dict_builder) {
+	delta_struct *delta = filter->delta;
+	if (delta == NULL) return 0;
+	size_t words = filter->category_words;
+	size_t base_sets_number = filter->category_sets_number;
+	if (delta->sets.count > CATEGORY_SETS_MAX - base_sets_number) {
+		print_err("too many distinct category sets");
+		return 1;
+	}
+	category_word_type *sets = realloc(
+		(void *)filter->category_sets,
+		((base_sets_number + delta->sets.count) * words + 1) * sizeof(sets[0])
+	);
+	if (sets == NULL) {print_err("realloc"); return 1;}
+	if (delta->sets.count != 0) {
+		memcpy(sets + base_sets_number * words, delta->sets.data, delta->sets.count * words * sizeof(sets[0]));
+	}
+	filter->category_sets = sets;
+	filter->category_sets_number = base_sets_number + delta->sets.count;
+
+	size_t position = 0;
+	const char *domain;
+	size_t domain_size;
+	hash_index_value_type value;
+	while (hash_index_next(delta->index, &position, &domain, &domain_size, &value)) {
+		if (value >= CATEGORY_SET_DELTA_FIRST && value < CATEGORY_SET_DELETED) {
+			value = base_sets_number + (value - CATEGORY_SET_DELTA_FIRST);
+		}
+		if (dict_builder != NULL) {
+			if (domain_dict_builder_add(dict_builder, domain, domain_size, value)) {
+				cdebug_printf(CDEBUG_IL_CRITICAL, "sites_delta: invalid domain '%.*s'", (int)domain_size, domain);
+				return 1;
+			}
+		} else if (hash_index_set(filter->sites_index, domain, domain_size, value) == HIPR_ERROR) {
+			print_err("hash_index_set");
+			return 1;
+		}
+	}
+	delta_destruct(delta);
+	filter->delta = NULL;
+	return 0;
+}
+
+// Load 'sites' table and 'sites_delta' rows into sites_dict.
+static int load_sites_dict(filter_struct *filter) {
+	size_t sites_count;
+	if (select_sites_count(filter->db, &sites_count)) return 1;
+	domain_dict_builder_struct *builder = domain_dict_builder_construct(sites_count);
+	if (builder == NULL) {print_err("domain_dict_builder_construct"); return 1;}
+	size_t delta_rows;
+	if (
+		load_sites(filter, builder) ||
+		load_delta(filter, filter->db, &delta_rows) ||
+		delta_merge(filter, builder)
+	) {
+		domain_dict_builder_destruct(builder);
+		return 1;
+	}
+	filter->sites_dict = domain_dict_build(builder);
+	if (filter->sites_dict == NULL) {print_err("domain_dict_build"); return 1;}
+	size_t count = domain_dict_count(filter->sites_dict);
+	size_t size = domain_dict_memory_size(filter->sites_dict);
+	cdebug_printf(
+		CDEBUG_IL_NORMAL, "compact index: %zu domains in %zu bytes, %.1f bytes per domain",
+		count, size, (count != 0 ? (double)size / count : 0.0)
+	);
+	return 0;
+}
+
+static hash_index_hash_type domain_hash(const char *domain, size_t domain_size) {
+	hash_index_hash_type h = HASH_INDEX_HASH_INIT;
+	for (size_t i=domain_size; i>0; --i) h = hash_index_hash_step(h, domain[i-1]);
+	return hash_index_hash_finish(h);
+}
+
+// Add all domains of 'sites' table to Bloom filter.
+static int load_bloom_filter(filter_struct *filter, double fpr) {
+	size_t sites_count;
+	if (select_sites_count(filter->db, &sites_count)) return 1;
+	filter->bloom = bloom_filter_construct(sites_count, fpr);
+	if (filter->bloom == NULL) {print_err("bloom_filter_construct"); return 1;}
+
+	const char *sql = "SELECT domain FROM sites";
+	sqlite3_stmt *stmt;
+	int res = sqlite3_prepare_v2(filter->db, sql, strlen(sql), &stmt, NULL);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); return 1;}
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *domain = (const char *)sqlite3_column_text(stmt, 0);
+		size_t domain_size = sqlite3_column_bytes(stmt, 0);
+		if (domain == NULL) {print_err("sqlite3_column_text"); sqlite3_finalize(stmt); return 1;}
+		bloom_filter_add(filter->bloom, domain_hash(domain, domain_size));
+	}
+	if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); sqlite3_finalize(stmt); return 1;}
+	res = sqlite3_finalize(stmt);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); return 1;}
+	return 0;
+}
+
+static const void *snapshot_required_section(
+		const filter_struct *filter, const char *path,
+		uint32_t type, size_t element_size, size_t *number_out
+) {
+	size_t size = 0;
+	const void *data = snapshot_section(filter->snapshot, type, &size);
+	if (data == NULL || size % element_size != 0) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "snapshot '%s': missing or malformed section %u", path, type);
+		return NULL;
+	}
+	*number_out = size / element_size;
+	return data;
+}
+
+// Set up filter arrays over mapped snapshot: no data is read here,
+// pages are loaded on demand by lookups and shared between processes.
+static int map_snapshot(filter_struct *filter, const char *path) {
+	filter->snapshot = snapshot_map(path);
+	if (filter->snapshot == NULL) return 1;
+
+	size_t deny_masks_words, category_sets_words, group_ids_number;
+	filter->category_ids = snapshot_required_section(
+		filter, path, SNAPSHOT_SECTION_CATEGORY_IDS, sizeof(filter->category_ids[0]), &filter->categories_number
+	);
+	if (filter->category_ids == NULL) return 1;
+	filter->deny_masks = snapshot_required_section(
+		filter, path, SNAPSHOT_SECTION_DENY_MASK, sizeof(filter->deny_masks[0]), &deny_masks_words
+	);
+	if (filter->deny_masks == NULL) return 1;
+	filter->category_sets = snapshot_required_section(
+		filter, path, SNAPSHOT_SECTION_CATEGORY_SETS, sizeof(filter->category_sets[0]), &category_sets_words
+	);
+	if (filter->category_sets == NULL) return 1;
+	filter->category_words = (filter->categories_number + CATEGORY_WORD_BITS - 1) / CATEGORY_WORD_BITS;
+	// no section -- no groups
+	size_t size = 0;
+	filter->group_ids = snapshot_section(filter->snapshot, SNAPSHOT_SECTION_GROUP_IDS, &size);
+	group_ids_number = size / sizeof(filter->group_ids[0]);
+	filter->groups_number = group_ids_number + 1;
+	if (
+		size % sizeof(filter->group_ids[0]) != 0 || group_ids_number >= FILTER_GROUP_TYPE_MAX ||
+		deny_masks_words != filter->groups_number * filter->category_words
+	) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "snapshot '%s': deny masks size mismatch", path);
+		return 1;
+	}
+	size = 0;
+	filter->group_networks = snapshot_section(filter->snapshot, SNAPSHOT_SECTION_GROUP_NETWORKS, &size);
+	filter->group_networks_number = size / sizeof(filter->group_networks[0]);
+	bool networks_are_valid = (size % sizeof(filter->group_networks[0]) == 0);
+	for (size_t i=0; networks_are_valid && i<filter->group_networks_number; ++i) {
+		const group_network_struct *network = &filter->group_networks[i];
+		networks_are_valid = (network->prefix_bits <= 128 && network->group < filter->groups_number);
+	}
+	if (! networks_are_valid) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "snapshot '%s': malformed group networks", path);
+		return 1;
+	}
+	filter->category_sets_number = (filter->category_words != 0 ? category_sets_words / filter->category_words : 0);
+	if (filter->category_sets_number > CATEGORY_SETS_MAX) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "snapshot '%s': too many category sets", path);
+		return 1;
+	}
+	size = 0;
+	const int64_t *delta_seq = snapshot_section(filter->snapshot, SNAPSHOT_SECTION_DELTA_SEQ, &size);
+	if (delta_seq != NULL) {
+		if (size != sizeof(*delta_seq)) {
+			cdebug_printf(CDEBUG_IL_CRITICAL, "snapshot '%s': malformed delta seq", path);
+			return 1;
+		}
+		filter->delta_seq = *delta_seq;
+	}
+
+	hash_index_raw_struct sites_raw;
+	size_t slots_size, keys_size, count_size;
+	sites_raw.slots = snapshot_section(filter->snapshot, SNAPSHOT_SECTION_SITES_SLOTS, &slots_size);
+	sites_raw.keys = snapshot_section(filter->snapshot, SNAPSHOT_SECTION_SITES_KEYS, &keys_size);
+	const uint64_t *sites_count = snapshot_section(filter->snapshot, SNAPSHOT_SECTION_SITES_COUNT, &count_size);
+	if (sites_raw.slots == NULL || sites_raw.keys == NULL || sites_count == NULL || count_size != sizeof(*sites_count)) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "snapshot '%s': missing sites sections", path);
+		return 1;
+	}
+	sites_raw.slots_size = slots_size;
+	sites_raw.keys_size = keys_size;
+	sites_raw.count = *sites_count;
+	filter->sites_index = hash_index_attach(&sites_raw);
+	if (filter->sites_index == NULL) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "snapshot '%s': malformed sites index", path);
+		return 1;
+	}
+
+	// no section -- no patterns
+	size_t patterns_size;
+	const void *patterns = snapshot_section(filter->snapshot, SNAPSHOT_SECTION_PATTERNS, &patterns_size);
+	if (patterns != NULL) {
+		filter->patterns = pattern_matcher_attach(patterns, patterns_size);
+		if (filter->patterns == NULL) {
+			cdebug_printf(CDEBUG_IL_CRITICAL, "snapshot '%s': malformed patterns", path);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void context_destruct(context_struct *context) {
+	int res;
+	if (context->cache != NULL) verdict_cache_destruct(context->cache);
+	if (context->pattern_scratch != NULL) pattern_matcher_scratch_destruct(context->pattern_scratch);
+	if (context->select_categories_stmt != NULL) {
+		res = sqlite3_finalize(context->select_categories_stmt);
+		if (res != SQLITE_OK) print_select_categories_stmt_err("finalize", res);
+	}
+	if (context->db != NULL) {
+		res = sqlite3_close(context->db);
+		if (res != SQLITE_OK) print_sqlite3_err("close", res);
+	}
+	free(context);
+}
+
+static void contexts_unlink(filter_struct *filter, context_struct *context) {
+	if (context->prev != NULL) context->prev->next = context->next;
+	else filter->contexts = context->next;
+	if (context->next != NULL) context->next->prev = context->prev;
+}
+
+static void counter_increment(uint64_t *counter) {
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Backend time is measured by cpu tick counter: reading it costs a few ns,
+// reading clock costs tens. Other architectures use clock.
+static inline uint64_t ticks_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return clock_ns();
+#endif
+}
+
+// double bits of the last ratio measured over at least 1ms, 0 -- none yet;
+// tick rate is the same for all filters of process
+static uint64_t measured_ns_per_tick_bits;
+
+// Ratio of time and ticks since filter was built or forked. Within its first
+// millisecond the error is large, so the ratio measured by an older filter
+// is returned then, or the rough one if there is none yet.
+static double ns_per_tick(const filter_struct *filter) {
+	uint64_t ns = clock_ns();
+	uint64_t ticks = ticks_now();
+	double ratio = 1;
+	if (ticks != filter->construct_ticks) {
+		ratio = (double)(ns - filter->construct_ns) / (double)(ticks - filter->construct_ticks);
+	}
+	uint64_t bits;
+	if (ns - filter->construct_ns >= 1000000) {
+		memcpy(&bits, &ratio, sizeof(bits));
+		__atomic_store_n(&measured_ns_per_tick_bits, bits, __ATOMIC_RELAXED);
+		return ratio;
+	}
+	bits = __atomic_load_n(&measured_ns_per_tick_bits, __ATOMIC_RELAXED);
+	if (bits == 0) return ratio;
+	double measured;
+	memcpy(&measured, &bits, sizeof(measured));
+	return measured;
+}
+
+static void context_add_stats(const context_struct *context, filter_stats_struct *stats) {
+	for (size_t i=0; i<sizeof(stats->lookups)/sizeof(stats->lookups[0]); ++i) {
+		stats->lookups[i] += __atomic_load_n(&context->lookups[i], __ATOMIC_RELAXED);
+	}
+	stats->parse_failures += __atomic_load_n(&context->parse_failures, __ATOMIC_RELAXED);
+	stats->pattern_denials += __atomic_load_n(&context->pattern_denials, __ATOMIC_RELAXED);
+	histogram_add(&stats->backend_ticks, &context->backend_ticks);
+	stats->bloom_checks += __atomic_load_n(&context->bloom_checks, __ATOMIC_RELAXED);
+	stats->bloom_skips += __atomic_load_n(&context->bloom_skips, __ATOMIC_RELAXED);
+	stats->bloom_false_positives += __atomic_load_n(&context->bloom_false_positives, __ATOMIC_RELAXED);
+	if (context->cache == NULL) return;
+	verdict_cache_stats_struct cache_stats;
+	verdict_cache_get_stats(context->cache, &cache_stats);
+	stats->cache_hits += cache_stats.hits;
+	stats->cache_misses += cache_stats.misses;
+	stats->cache_evictions += cache_stats.evictions;
+}
+
+// called on exit of thread that used filter
+static void context_thread_exit(void *ptr) {
+	context_struct *context = ptr;
+	filter_struct *filter = context->filter;
+	pthread_mutex_lock(&filter->contexts_mutex);
+	contexts_unlink(filter, context);
+	context_add_stats(context, &filter->exited_stats);
+	pthread_mutex_unlock(&filter->contexts_mutex);
+	context_destruct(context);
+}
+
+static int contexts_init(filter_struct *filter) {
+	int res = pthread_key_create(&filter->context_key, context_thread_exit);
+	if (res != 0) {print_err("pthread_key_create"); return 1;}
+	res = pthread_mutex_init(&filter->contexts_mutex, NULL);
+	if (res != 0) {
+		print_err("pthread_mutex_init");
+		pthread_key_delete(filter->context_key);
+		return 1;
+	}
+	filter->contexts = NULL;
+	memset(&filter->exited_stats, 0, sizeof(filter->exited_stats));
+	return 0;
+}
+
+static context_struct *context_construct(filter_struct *filter) {
+	context_struct *context = calloc(1, sizeof(context_struct));
+	if (context == NULL) {print_err("calloc"); return NULL;}
+	context->filter = filter;
+
+	if (filter->cache_size > 0) {
+		context->cache = verdict_cache_construct(filter->cache_size);
+		if (context->cache == NULL) {print_err("verdict_cache_construct"); goto err_destruct;}
+	}
+	if (filter->patterns != NULL && pattern_matcher_needs_scratch(filter->patterns)) {
+		context->pattern_scratch = pattern_matcher_scratch_construct(filter->patterns);
+		if (context->pattern_scratch == NULL) {print_err("pattern_matcher_scratch_construct"); goto err_destruct;}
+	}
+
+	if (filter->index == FILTER_INDEX_SQLITE) {
+		// connection is never shared between threads, so sqlite mutexes are not needed
+		int res = sqlite3_open_v2(
+			filter->db_uri,
+			&context->db,
+			SQLITE_OPEN_URI | SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+			NULL
+		);
+		if (res != SQLITE_OK) {print_sqlite3_err("open_v2", res); goto err_destruct;}
+		const char *sql = filter->select_categories_sql;
+		res = sqlite3_prepare_v2(
+			context->db,
+			sql, strlen(sql),
+			&context->select_categories_stmt,
+			NULL
+		);
+		if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); goto err_destruct;}
+	}
+	return context;
+
+err_destruct:
+	context_destruct(context);
+	return NULL;
+}
+
+// Context of calling thread, created on first lookup made by the thread.
+static context_struct *get_context(const filter_struct *const_filter) {
+	context_struct *context = pthread_getspecific(const_filter->context_key);
+	if (context != NULL) return context;
+
+	// contexts list is the only part of filter that is changed after construct
+	filter_struct *filter = (filter_struct *)const_filter;
+	context = context_construct(filter);
+	if (context == NULL) return NULL;
+	if (pthread_setspecific(filter->context_key, context) != 0) {
+		print_err("pthread_setspecific");
+		context_destruct(context);
+		return NULL;
+	}
+	pthread_mutex_lock(&filter->contexts_mutex);
+	context->prev = NULL;
+	context->next = filter->contexts;
+	if (filter->contexts != NULL) filter->contexts->prev = context;
+	filter->contexts = context;
+	pthread_mutex_unlock(&filter->contexts_mutex);
+	return context;
+}
+
+static int remember_db_file(filter_struct *filter, const char *path) {
+	filter->db_path = strdup(path != NULL ? path : "");
+	if (filter->db_path == NULL) {print_err("strdup"); return 1;}
+	if (filter->db_path[0] != '\0' && stat(filter->db_path, &filter->db_stat) != 0) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "stat '%s' failed", filter->db_path);
+		return 1;
+	}
+	return 0;
+}
+
+static void source_of_stat(const struct stat *st, snapshot_source_struct *source_out) {
+	memset(source_out, 0, sizeof(*source_out));
+	source_out->dev = st->st_dev;
+	source_out->ino = st->st_ino;
+	source_out->size = st->st_size;
+	source_out->mtime_sec = st->st_mtim.tv_sec;
+	source_out->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static void unmap_snapshot(filter_struct *filter) {
+	if (filter->sites_index != NULL) hash_index_destruct(filter->sites_index);
+	if (filter->patterns != NULL) pattern_matcher_destruct(filter->patterns);
+	if (filter->snapshot != NULL) snapshot_unmap(filter->snapshot);
+	filter->sites_index = NULL;
+	filter->patterns = NULL;
+	filter->snapshot = NULL;
+	filter->category_ids = NULL;
+	filter->deny_masks = NULL;
+	filter->groups_number = 0;
+	filter->group_ids = NULL;
+	filter->group_networks = NULL;
+	filter->group_networks_number = 0;
+	filter->category_sets = NULL;
+	filter->delta_seq = 0;
+}
+
+// true if mapped snapshot was built from db file as it is now
+static bool snapshot_is_built_from_db(const filter_struct *filter) {
+	size_t size;
+	const snapshot_source_struct *source = snapshot_section(filter->snapshot, SNAPSHOT_SECTION_SOURCE, &size);
+	if (source == NULL || size != sizeof(*source)) return false;
+	snapshot_source_struct db_source;
+	source_of_stat(&filter->db_stat, &db_source);
+	return memcmp(source, &db_source, sizeof(db_source)) == 0;
+}
+
+// Maps snapshot at shared_path, building it from db first if it is missing or stale.
+// Processes hold lock file while checking and building, so db is loaded by one
+// of them and the others map its result.
+static int map_shared_snapshot(filter_struct *filter, const char *db_uri, const char *shared_path) {
+	int res;
+	sqlite3 *db;
+	res = sqlite3_open_v2(db_uri, &db, SQLITE_OPEN_URI | SQLITE_OPEN_READONLY, NULL);
+	if (res != SQLITE_OK) {print_sqlite3_err("open_v2", res); sqlite3_close(db); return 1;}
+	int remember_res = remember_db_file(filter, sqlite3_db_filename(db, "main"));
+	sqlite3_close(db);
+	if (remember_res) return 1;
+
+	filter->shared_path = strdup(shared_path);
+	if (filter->shared_path == NULL) {print_err("strdup"); return 1;}
+	size_t path_size = strlen(shared_path);
+	char *lock_path = malloc(path_size + sizeof(".lock"));
+	if (lock_path == NULL) {print_err("malloc"); return 1;}
+	memcpy(lock_path, shared_path, path_size);
+	memcpy(lock_path + path_size, ".lock", sizeof(".lock"));
+	int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock_fd < 0) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "open '%s': %s", lock_path, strerror(errno));
+		free(lock_path);
+		return 1;
+	}
+	while ((res = flock(lock_fd, LOCK_EX)) != 0 && errno == EINTR);
+	if (res != 0) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "flock '%s': %s", lock_path, strerror(errno));
+		goto err_close;
+	}
+
+	if (access(shared_path, F_OK) == 0) {
+		if (map_snapshot(filter, shared_path) == 0 && snapshot_is_built_from_db(filter)) goto done;
+		unmap_snapshot(filter);
+	}
+	filter_config_struct builder_config;
+	memset(&builder_config, 0, sizeof(builder_config));
+	builder_config.index = FILTER_INDEX_HASH;
+	filter_struct *builder = filter_construct(db_uri, &builder_config);
+	if (builder == NULL) goto err_close;
+	// db may have changed since its stat above: watch the version snapshot is built from
+	filter->db_stat = builder->db_stat;
+	res = filter_save_snapshot(builder, shared_path);
+	filter_destruct(builder);
+	if (res != 0) goto err_close;
+	if (map_snapshot(filter, shared_path)) goto err_close;
+done:
+	filter->shared_generation = snapshot_generation(filter->snapshot);
+	// closing releases lock
+	close(lock_fd);
+	free(lock_path);
+	return 0;
+
+err_close:
+	close(lock_fd);
+	free(lock_path);
+	return 1;
+}
+
+static char *build_select_categories_sql(const filter_struct *filter) {
+	// suffix_match: all suffixes of domain in one query, the longest listed wins
+	const char *exact_sql = "SELECT categories FROM sites WHERE domain = ?";
+	char *sql = malloc(128 + 2 * SQLITE_SUFFIXES_MAX);
+	if (sql == NULL) {print_err("malloc"); return NULL;}
+	if (! filter->suffix_match) {
+		strcpy(sql, exact_sql);
+		return sql;
+	}
+	char *cur = sql;
+	cur += sprintf(cur, "SELECT categories FROM sites WHERE domain IN (?");
+	for (size_t i=1; i<SQLITE_SUFFIXES_MAX; ++i) cur += sprintf(cur, ",?");
+	sprintf(cur, ") ORDER BY length(domain) DESC LIMIT 1");
+	return sql;
 }
 
-filter_struct *filter_construct(const char *db_uri) {
+filter_struct *filter_construct(const char *db_uri, const filter_config_struct *config) {
 	filter_struct *filter = malloc(sizeof(filter_struct));
 	if (filter == NULL) {print_err("malloc"); goto err_return;}
+	filter->index = config->index;
+	filter->suffix_match = config->suffix_match;
+	filter->cache_size = config->cache_size;
+	filter->stats = config->stats;
+	filter->construct_ticks = ticks_now();
+	filter->construct_ns = clock_ns();
+	filter->db = NULL;
+	filter->db_path = NULL;
+	filter->db_uri = NULL;
+	filter->bloom = NULL;
+	filter->select_categories_sql = NULL;
+	filter->snapshot = NULL;
+	filter->shared_path = NULL;
+	filter->category_ids = NULL;
+	filter->categories_number = 0;
+	filter->category_words = 0;
+	filter->deny_masks = NULL;
+	filter->groups_number = 0;
+	filter->group_ids = NULL;
+	filter->group_networks = NULL;
+	filter->group_networks_number = 0;
+	filter->sites_index = NULL;
+	filter->sites_dict = NULL;
+	filter->category_sets = NULL;
+	filter->category_sets_number = 0;
+	filter->patterns = NULL;
+	filter->delta = NULL;
+	filter->delta_seq = 0;
+	filter->shared_refs = malloc(sizeof(*filter->shared_refs));
+	filter->sites_refs = malloc(sizeof(*filter->sites_refs));
+	if (filter->shared_refs == NULL || filter->sites_refs == NULL) {print_err("malloc"); goto err_snapshot_unmap;}
+	*filter->shared_refs = 1;
+	*filter->sites_refs = 1;
 
-	filter->map = map_construct();
-	if (filter->map == NULL) {print_err("map_construct"); goto err_filter_free;}
+	if (filter->index == FILTER_INDEX_SNAPSHOT) {
+		if (remember_db_file(filter, db_uri)) goto err_snapshot_unmap;
+		if (map_snapshot(filter, db_uri)) goto err_snapshot_unmap;
+		if (contexts_init(filter)) goto err_snapshot_unmap;
+		return filter;
+	}
+	filter->db_uri = strdup(db_uri);
+	if (filter->db_uri == NULL) {print_err("strdup"); goto err_snapshot_unmap;}
+	if (filter->index == FILTER_INDEX_SHARED) {
+		if (map_shared_snapshot(filter, db_uri, config->shared_path)) goto err_snapshot_unmap;
+		if (contexts_init(filter)) goto err_snapshot_unmap;
+		return filter;
+	}
 
 	int res;
 	res = sqlite3_open_v2(
@@ -43,11 +1514,43 @@ filter_struct *filter_construct(const char *db_uri) {
 		SQLITE_OPEN_URI | SQLITE_OPEN_READONLY,
 		NULL
 	);
-	if (res != SQLITE_OK) {print_sqlite3_err("open_v2", res); goto err_map_destruct;}
+	if (res != SQLITE_OK) {print_sqlite3_err("open_v2", res); goto err_sqlite3_close;}
+	if (remember_db_file(filter, sqlite3_db_filename(filter->db, "main"))) goto err_sqlite3_close;
+
+	if (load_rules(filter)) goto err_rules_free;
+	if (load_group_rules(filter)) goto err_rules_free;
+	if (load_group_networks(filter)) goto err_rules_free;
+	if (load_patterns(filter)) goto err_rules_free;
+
+	size_t delta_rows;
+	if (filter->index == FILTER_INDEX_HASH) {
+		// sqlite database is not needed after sites are loaded
+		if (load_sites(filter, NULL)) goto err_sites_free;
+		if (load_delta(filter, filter->db, &delta_rows)) goto err_sites_free;
+		if (delta_merge(filter, NULL)) goto err_sites_free;
+		res = sqlite3_close(filter->db);
+		if (res != SQLITE_OK) {print_sqlite3_err("close", res); goto err_sites_free;}
+		filter->db = NULL;
+		if (contexts_init(filter)) goto err_sites_free;
+		return filter;
+	}
+	if (filter->index == FILTER_INDEX_COMPACT) {
+		if (load_sites_dict(filter)) goto err_sites_free;
+		res = sqlite3_close(filter->db);
+		if (res != SQLITE_OK) {print_sqlite3_err("close", res); goto err_sites_free;}
+		filter->db = NULL;
+		if (contexts_init(filter)) goto err_sites_free;
+		return filter;
+	}
+
+	if (load_delta(filter, filter->db, &delta_rows)) goto err_sql_free;
+	if (config->bloom_fpr > 0 && load_bloom_filter(filter, config->bloom_fpr)) goto err_sql_free;
 
-	// select rules
+	// check select_categories statement, contexts prepare it for their connections
 	{
-		const char *sql = "SELECT category_id, allowed FROM rules";
+		filter->select_categories_sql = build_select_categories_sql(filter);
+		if (filter->select_categories_sql == NULL) goto err_rules_free;
+		const char *sql = filter->select_categories_sql;
 		sqlite3_stmt *stmt;
 		res = sqlite3_prepare_v2(
 			filter->db,
@@ -55,56 +1558,52 @@ filter_struct *filter_construct(const char *db_uri) {
 			&stmt,
 			NULL
 		);
-		if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); goto err_sqlite3_close;}
-
-		while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
-			int category_id = sqlite3_column_int(stmt, 0);
-			int allowed     = sqlite3_column_int(stmt, 1);
-			if (category_id < 0) {
-				cdebug_printf(
-					CDEBUG_IL_CRITICAL,
-					"invalid 'category_id' column value '%d'",
-					category_id
-				);
-				goto err_sqlite3_close;
-			}
-			assert((map_key_type)category_id <= MAP_KEY_TYPE_MAX);
-			if (!(allowed == 0 || allowed == 1)) {
-				cdebug_printf(
-					CDEBUG_IL_CRITICAL,
-					"invalid 'allowed' column value '%d' for category_id '%d'",
-					allowed,
-					category_id
-				);
-				goto err_sqlite3_close;
-			}
-			map_put_uniq(filter->map, (map_key_type)category_id, (map_value_type)allowed);
-		}
-		if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); goto err_sqlite3_close;}
+		if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); goto err_sql_free;}
 		res = sqlite3_finalize(stmt);
-		if (res!= SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); goto err_sqlite3_close;}
-	}
-
-	// prepare select_categories statement
-	{
-		const char *sql = "SELECT categories FROM sites WHERE domain = ?";
-		res = sqlite3_prepare_v2(
-			filter->db,
-			sql, strlen(sql),
-			&filter->select_categories_stmt,
-			NULL
-		);
-		if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); goto err_sqlite3_close;}
+		if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); goto err_sql_free;}
 	}
+	res = sqlite3_close(filter->db);
+	if (res != SQLITE_OK) {print_sqlite3_err("close", res); goto err_sql_free;}
+	filter->db = NULL;
+	if (contexts_init(filter)) goto err_sql_free;
 
 	return filter;
 
+err_sql_free:
+	if (filter->bloom != NULL) bloom_filter_destruct(filter->bloom);
+	free(filter->select_categories_sql);
+	goto err_rules_free;
+err_sites_free:
+	free((void *)filter->category_sets);
+	if (filter->sites_index != NULL) hash_index_destruct(filter->sites_index);
+	if (filter->sites_dict != NULL) domain_dict_destruct(filter->sites_dict);
+err_rules_free:
+	if (filter->delta != NULL) delta_destruct(filter->delta);
+	if (filter->patterns != NULL) pattern_matcher_destruct(filter->patterns);
+	free((void *)filter->group_networks);
+	free((void *)filter->group_ids);
+	free((void *)filter->deny_masks);
+	free((void *)filter->category_ids);
 err_sqlite3_close:
-	res = sqlite3_close(filter->db);
-	if (res != SQLITE_OK) print_sqlite3_err("close", res);
-err_map_destruct:
-	map_destruct(filter->map);
-err_filter_free:
+	if (filter->db != NULL) {
+		res = sqlite3_close(filter->db);
+		if (res != SQLITE_OK) print_sqlite3_err("close", res);
+	}
+	free(filter->db_path);
+	free(filter->db_uri);
+	free(filter->sites_refs);
+	free(filter->shared_refs);
+	free(filter);
+	goto err_return;
+err_snapshot_unmap:
+	if (filter->patterns != NULL) pattern_matcher_destruct(filter->patterns);
+	if (filter->sites_index != NULL) hash_index_destruct(filter->sites_index);
+	if (filter->snapshot != NULL) snapshot_unmap(filter->snapshot);
+	free(filter->shared_path);
+	free(filter->db_path);
+	free(filter->db_uri);
+	free(filter->sites_refs);
+	free(filter->shared_refs);
 	free(filter);
 err_return:
 	return NULL;
@@ -112,102 +1611,378 @@ err_return:
 }
 
 void filter_destruct(filter_struct *filter) {
+	// threads exiting after this do not call context_thread_exit()
+	pthread_key_delete(filter->context_key);
+	pthread_mutex_lock(&filter->contexts_mutex);
+	while (filter->contexts != NULL) {
+		context_struct *context = filter->contexts;
+		contexts_unlink(filter, context);
+		context_destruct(context);
+	}
+	pthread_mutex_unlock(&filter->contexts_mutex);
+	pthread_mutex_destroy(&filter->contexts_mutex);
+	if (filter->delta != NULL) delta_destruct(filter->delta);
+
+	if (__atomic_sub_fetch(filter->sites_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(filter->sites_refs);
+		if (filter->sites_index != NULL) hash_index_destruct(filter->sites_index);
+		if (filter->sites_dict != NULL) domain_dict_destruct(filter->sites_dict);
+		if (filter->snapshot == NULL) free((void *)filter->category_sets);
+	}
+	if (__atomic_sub_fetch(filter->shared_refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		free(filter);
+		return;
+	}
+	free(filter->shared_refs);
+	free(filter->db_path);
+	free(filter->db_uri);
+	free(filter->shared_path);
+	if (filter->bloom != NULL) bloom_filter_destruct(filter->bloom);
+	free(filter->select_categories_sql);
+	if (filter->patterns != NULL) pattern_matcher_destruct(filter->patterns);
+	if (filter->snapshot != NULL) {
+		snapshot_unmap(filter->snapshot);
+	} else {
+		free((void *)filter->group_networks);
+		free((void *)filter->group_ids);
+		free((void *)filter->deny_masks);
+		free((void *)filter->category_ids);
+	}
+	free(filter);
+}
+
+int filter_db_is_changed(const filter_struct *filter) {
+	uint64_t generation;
+	if (
+		filter->shared_path != NULL &&
+		snapshot_read_generation(filter->shared_path, &generation) == 0 &&
+		generation != filter->shared_generation
+	) {
+		return 1;
+	}
+	if (filter->db_path[0] == '\0') return 0;
+	struct stat st;
+	// file may be missing for a moment while it is being replaced
+	if (stat(filter->db_path, &st) != 0) return 0;
+	return (
+		st.st_dev != filter->db_stat.st_dev ||
+		st.st_ino != filter->db_stat.st_ino ||
+		st.st_size != filter->db_stat.st_size ||
+		st.st_mtim.tv_sec != filter->db_stat.st_mtim.tv_sec ||
+		st.st_mtim.tv_nsec != filter->db_stat.st_mtim.tv_nsec
+	);
+}
+
+int filter_save_snapshot(const filter_struct *filter, const char *path) {
+	assert(filter->index == FILTER_INDEX_HASH);
+	if (filter->delta != NULL) {print_err("filter_save_snapshot: delta overlay is not merged"); return 1;}
+	hash_index_raw_struct sites_raw;
+	hash_index_get_raw(filter->sites_index, &sites_raw);
+	uint64_t sites_count = sites_raw.count;
+	snapshot_source_struct source;
+	source_of_stat(&filter->db_stat, &source);
+	// optional sections are first and last
+	snapshot_section_data_struct sections[] = {
+		{SNAPSHOT_SECTION_PATTERNS, NULL, 0},
+		{SNAPSHOT_SECTION_DELTA_SEQ, &filter->delta_seq, sizeof(filter->delta_seq)},
+		{
+			SNAPSHOT_SECTION_CATEGORY_IDS,
+			filter->category_ids,
+			filter->categories_number * sizeof(filter->category_ids[0])
+		},
+		{
+			SNAPSHOT_SECTION_DENY_MASK,
+			filter->deny_masks,
+			filter->groups_number * filter->category_words * sizeof(filter->deny_masks[0])
+		},
+		{
+			SNAPSHOT_SECTION_GROUP_IDS,
+			filter->group_ids,
+			(filter->groups_number - 1) * sizeof(filter->group_ids[0])
+		},
+		{
+			SNAPSHOT_SECTION_GROUP_NETWORKS,
+			filter->group_networks,
+			filter->group_networks_number * sizeof(filter->group_networks[0])
+		},
+		{
+			SNAPSHOT_SECTION_CATEGORY_SETS,
+			filter->category_sets,
+			filter->category_sets_number * filter->category_words * sizeof(filter->category_sets[0])
+		},
+		{SNAPSHOT_SECTION_SITES_SLOTS, sites_raw.slots, sites_raw.slots_size},
+		{SNAPSHOT_SECTION_SITES_KEYS, sites_raw.keys, sites_raw.keys_size},
+		{SNAPSHOT_SECTION_SITES_COUNT, &sites_count, sizeof(sites_count)},
+		{SNAPSHOT_SECTION_SOURCE, &source, sizeof(source)}
+	};
+	size_t sections_total = sizeof(sections)/sizeof(sections[0]);
+	// sections of type 0 are left out
+	if (filter->patterns != NULL) {
+		pattern_matcher_get_raw(filter->patterns, &sections[0].data, &sections[0].size);
+	} else {
+		sections[0].type = 0;
+	}
+	if (filter->delta_seq == 0) sections[1].type = 0;
+	// in-memory db has no file
+	if (filter->db_path[0] == '\0') sections[sections_total - 1].type = 0;
+	size_t sections_number = 0;
+	for (size_t i=0; i<sections_total; ++i) {
+		if (sections[i].type != 0) sections[sections_number++] = sections[i];
+	}
+	return snapshot_write(path, sections, sections_number);
+}
+
+// New filter over data of filter with its own contexts and copy of delta overlay.
+static filter_struct *filter_fork(const filter_struct *filter) {
+	filter_struct *fork = malloc(sizeof(filter_struct));
+	if (fork == NULL) {print_err("malloc"); return NULL;}
+	// contexts of filter change under their mutex, contexts_init() replaces copied ones
+	pthread_mutex_t *contexts_mutex = &((filter_struct *)filter)->contexts_mutex;
+	pthread_mutex_lock(contexts_mutex);
+	*fork = *filter;
+	pthread_mutex_unlock(contexts_mutex);
+	fork->construct_ticks = ticks_now();
+	fork->construct_ns = clock_ns();
+	fork->delta = NULL;
+	if (filter->delta != NULL) {
+		fork->delta = delta_clone(filter->delta, filter->category_words);
+		if (fork->delta == NULL) {free(fork); return NULL;}
+	}
+	if (contexts_init(fork)) {
+		if (fork->delta != NULL) delta_destruct(fork->delta);
+		free(fork);
+		return NULL;
+	}
+	__atomic_add_fetch(fork->shared_refs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(fork->sites_refs, 1, __ATOMIC_RELAXED);
+	return fork;
+}
+
+filter_delta_result_enum filter_apply_delta(const filter_struct *filter, filter_struct **updated_out) {
+	*updated_out = NULL;
+	// snapshot and in-memory db have no file to read rows from
+	if (filter->index == FILTER_INDEX_SNAPSHOT || filter->db_path[0] == '\0') return FILTER_DELTA_RELOAD;
+	uint64_t generation;
+	if (
+		filter->shared_path != NULL &&
+		snapshot_read_generation(filter->shared_path, &generation) == 0 &&
+		generation != filter->shared_generation
+	) {
+		return FILTER_DELTA_RELOAD;
+	}
+	if (! filter_db_is_changed(filter)) return FILTER_DELTA_NONE;
+
 	int res;
-	res = sqlite3_finalize(filter->select_categories_stmt);
-	if (res != SQLITE_OK) print_select_categories_stmt_err("finalize", res);
-	res = sqlite3_close(filter->db);
+	sqlite3 *db;
+	res = sqlite3_open_v2(filter->db_uri, &db, SQLITE_OPEN_URI | SQLITE_OPEN_READONLY, NULL);
+	if (res != SQLITE_OK) {print_sqlite3_err("open_v2", res); sqlite3_close(db); return FILTER_DELTA_ERROR;}
+	filter_delta_result_enum result = FILTER_DELTA_ERROR;
+	filter_struct *updated = NULL;
+	// read lock is held from the first select to commit, so that file
+	// does not change between stat and reading rows
+	res = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+	if (res != SQLITE_OK) {print_sqlite3_err("exec(BEGIN)", res); goto done;}
+	int64_t max_seq;
+	if (select_delta_max_seq(db, &max_seq)) goto done;
+	struct stat st;
+	if (stat(filter->db_path, &st) != 0) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "stat '%s' failed", filter->db_path);
+		goto done;
+	}
+	result = FILTER_DELTA_RELOAD;
+	// replaced file is a new base, rows are appended to 'sites_delta' in place
+	if (st.st_dev != filter->db_stat.st_dev || st.st_ino != filter->db_stat.st_ino) goto done;
+	if (max_seq < filter->delta_seq) goto done;
+
+	result = FILTER_DELTA_ERROR;
+	updated = filter_fork(filter);
+	if (updated == NULL) goto done;
+	updated->db_stat = st;
+	size_t rows;
+	if (load_delta(updated, db, &rows)) goto done;
+	// file changed other than by new rows
+	result = (rows != 0 ? FILTER_DELTA_APPLIED : FILTER_DELTA_RELOAD);
+done:
+	if (result == FILTER_DELTA_APPLIED) {
+		*updated_out = updated;
+	} else if (updated != NULL) {
+		filter_destruct(updated);
+	}
+	// read-only transaction has nothing to commit, its end releases lock
+	sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+	res = sqlite3_close(db);
 	if (res != SQLITE_OK) print_sqlite3_err("close", res);
-	map_destruct(filter->map);
-	free(filter);
+	return result;
 }
 
-typedef map_key_type number_type;
-#define NUMBER_TYPE_MAX MAP_KEY_TYPE_MAX
+size_t filter_delta_size(const filter_struct *filter) {
+	return (filter->delta != NULL ? hash_index_count(filter->delta->index) : 0);
+}
 
-typedef enum {
-	SPNR_SUCCESS,
-	SPNR_INVALID,
-	SPNR_OVERFLOW
-} str_parse_number_result_enum;
+int filter_delta_needs_merge(const filter_struct *filter) {
+	// sqlite index reads whole overlay from 'sites_delta' again when constructed
+	if (filter->index == FILTER_INDEX_SQLITE || filter->index == FILTER_INDEX_SNAPSHOT) return 0;
+	size_t delta_size = filter_delta_size(filter);
+	size_t sites_count = (
+		filter->sites_dict != NULL ? domain_dict_count(filter->sites_dict) : hash_index_count(filter->sites_index)
+	);
+	return (delta_size >= DELTA_MERGE_SIZE_MIN && delta_size >= sites_count / DELTA_MERGE_RATIO);
+}
 
-static str_parse_number_result_enum str_parse_number(
-		const char *str, const char **end_out, number_type *number_out
+filter_struct *filter_merge_delta(const filter_struct *filter) {
+	if (filter->index != FILTER_INDEX_HASH) {print_err("filter_merge_delta: index is not hash"); return NULL;}
+	filter_struct *merged = filter_fork(filter);
+	if (merged == NULL) return NULL;
+	size_t *sites_refs = malloc(sizeof(*sites_refs));
+	hash_index_struct *sites_index = hash_index_clone(filter->sites_index);
+	size_t sets_words = filter->category_sets_number * filter->category_words;
+	category_word_type *sets = malloc((sets_words + 1) * sizeof(sets[0]));
+	if (sites_refs == NULL || sites_index == NULL || sets == NULL) {print_err("malloc"); goto err_free;}
+	if (sets_words != 0) memcpy(sets, filter->category_sets, sets_words * sizeof(sets[0]));
+	// merged filter owns its sites, filter still holds a reference to the old ones
+	__atomic_sub_fetch(merged->sites_refs, 1, __ATOMIC_RELAXED);
+	*sites_refs = 1;
+	merged->sites_refs = sites_refs;
+	merged->sites_index = sites_index;
+	merged->category_sets = sets;
+	if (delta_merge(merged, NULL)) {filter_destruct(merged); return NULL;}
+	return merged;
+
+err_free:
+	free(sets);
+	if (sites_index != NULL) hash_index_destruct(sites_index);
+	free(sites_refs);
+	filter_destruct(merged);
+	return NULL;
+}
+
+// Check category list without building category set: stop at first denied category.
+// denied_category_out -- NULL, or else the list is read to its end for the least
+// denied category, the one category_set_denied_category() finds in its set
+static filter_uri_result_enum category_list_is_allowed(
+		const filter_struct *filter, const category_word_type *deny_mask,
+		const category_list_struct *list, const char *domain, size_t domain_size,
+		category_id_type *denied_category_out
 ) {
-	number_type number = 0;
-	const char *cur = str;
-	while (*cur >= '0' && *cur <= '9') {
-		number_type digit = *cur - '0';
-		if (!(number <= NUMBER_TYPE_MAX / 10)) {*end_out = cur; return SPNR_OVERFLOW;}
-		number *= 10;
-		if (!(number <= NUMBER_TYPE_MAX - digit)) {*end_out = cur; return SPNR_OVERFLOW;}
-		number += digit;
-		++cur;
+	const char *cur = list->data;
+	category_id_type category = 0;
+	size_t bit;
+	int res;
+	bool denied = false;
+	while ((res = category_list_next_bit(filter, list, &cur, &category, domain, domain_size, &bit)) > 0) {
+		if (! category_is_denied(deny_mask, bit)) continue;
+		if (denied_category_out == NULL) return FILTER_URI_DENY;
+		if (! denied || category < *denied_category_out) *denied_category_out = category;
+		denied = true;
 	}
-	if (cur == str) {*end_out = cur; return SPNR_INVALID;}
-	*end_out = cur;
-	*number_out = number;
-	return SPNR_SUCCESS;
+	if (denied) return FILTER_URI_DENY;
+	return (res < 0 ? FILTER_URI_ERROR : FILTER_URI_ALLOW);
 }
 
-static filter_uri_result_enum filter_domain_is_allowed(
-		const filter_struct *filter, const char *domain, size_t domain_size
+// Hosts like IP addresses have no parent domains.
+static bool domain_has_ancestors(const char *domain, size_t domain_size) {
+	if (memchr(domain, ':', domain_size) != NULL) return false;
+	// top level domain is never numeric, so numeric last label means IPv4 address
+	for (size_t i=domain_size; i>0 && domain[i-1] != '.'; --i) {
+		if (!(domain[i-1] >= '0' && domain[i-1] <= '9')) return true;
+	}
+	return false;
+}
+
+// Offsets of domain and, with suffix_match, its ancestors to query, the longest first;
+// offsets_out -- DOMAIN_SUFFIXES_MAX entries.
+// Delta overlay decides for suffixes it has, so they are not queried: deleted ones
+// are skipped, the longest one with categories ends the list and is returned in
+// *delta_value_out, *delta_found_out is false if there is none.
+static size_t sqlite_query_suffixes(
+		const filter_struct *filter, const char *domain, size_t domain_size,
+		size_t *offsets_out, bool *delta_found_out, hash_index_value_type *delta_value_out
 ) {
-	int res;
+	*delta_found_out = false;
+	size_t offsets_number = 0;
+	bool has_ancestors = filter->suffix_match && domain_has_ancestors(domain, domain_size);
+	for (size_t i=0; i<domain_size && offsets_number<DOMAIN_SUFFIXES_MAX; ++i) {
+		if (!(i == 0 || (has_ancestors && domain[i-1] == '.'))) continue;
+		hash_index_value_type value;
+		if (filter->delta != NULL && hash_index_get(filter->delta->index, domain + i, domain_size - i, &value)) {
+			if (value == CATEGORY_SET_DELETED) continue;
+			*delta_found_out = true;
+			*delta_value_out = value;
+			break;
+		}
+		offsets_out[offsets_number++] = i;
+	}
+	return offsets_number;
+}
 
-	res = sqlite3_bind_text(
-		filter->select_categories_stmt,
-		1,
-		domain, domain_size*sizeof(domain[0]),
-		SQLITE_STATIC
-	);
-	if (res != SQLITE_OK) {
-		print_select_categories_stmt_err("bind_text", res);
-		return FILTER_URI_ERROR;
+// Bind suffixes of domain at offsets, unused parameters are bound to NULL.
+static int sqlite_bind_suffixes(
+		const filter_struct *filter, const context_struct *context, const char *domain, size_t domain_size,
+		const size_t *offsets, size_t offsets_number
+) {
+	int res;
+	int params_number = (filter->suffix_match ? SQLITE_SUFFIXES_MAX : 1);
+	for (int param=1; param<=params_number; ++param) {
+		if ((size_t)param <= offsets_number) {
+			size_t offset = offsets[param-1];
+			res = sqlite3_bind_text(
+				context->select_categories_stmt,
+				param,
+				domain + offset, (domain_size - offset)*sizeof(domain[0]),
+				SQLITE_STATIC
+			);
+		} else {
+			res = sqlite3_bind_null(context->select_categories_stmt, param);
+		}
+		if (res != SQLITE_OK) return res;
 	}
+	return SQLITE_OK;
+}
 
-	res = sqlite3_step(filter->select_categories_stmt);
-	if (res != SQLITE_ROW && res != SQLITE_DONE) {
-		print_select_categories_stmt_err("step(1)", res);
-		return FILTER_URI_ERROR;
+// denied_category_out -- see category_list_is_allowed()
+static filter_uri_result_enum sqlite_domain_is_allowed(
+		const filter_struct *filter, const context_struct *context,
+		const category_word_type *deny_mask, const char *domain, size_t domain_size,
+		const size_t *offsets, size_t offsets_number, category_id_type *denied_category_out
+) {
+	// chunks go from the longest suffixes, so the first row found is of the longest one in db
+	int res = SQLITE_DONE;
+	for (size_t chunk=0; chunk<offsets_number && res == SQLITE_DONE; chunk+=SQLITE_SUFFIXES_MAX) {
+		if (chunk != 0) {
+			res = sqlite3_reset(context->select_categories_stmt);
+			if (res != SQLITE_OK) {
+				print_select_categories_stmt_err("reset", res);
+				return FILTER_URI_ERROR;
+			}
+		}
+		size_t chunk_size = offsets_number - chunk;
+		if (chunk_size > SQLITE_SUFFIXES_MAX) chunk_size = SQLITE_SUFFIXES_MAX;
+		res = sqlite_bind_suffixes(filter, context, domain, domain_size, offsets + chunk, chunk_size);
+		if (res != SQLITE_OK) {
+			print_select_categories_stmt_err("bind_text", res);
+			return FILTER_URI_ERROR;
+		}
+		res = sqlite3_step(context->select_categories_stmt);
+		if (res != SQLITE_ROW && res != SQLITE_DONE) {
+			print_select_categories_stmt_err("step(1)", res);
+			return FILTER_URI_ERROR;
+		}
 	}
 	if (res == SQLITE_DONE) {
 		return FILTER_URI_DOESNT_EXIST;
 	}
 	assert(res == SQLITE_ROW);
 
-	const char *category_list = (const char *)sqlite3_column_text(filter->select_categories_stmt, 0);
-	assert(category_list != NULL);
-	const char *cur = category_list;
-	filter_uri_result_enum filter_result = FILTER_URI_ALLOW;
-	while (1) {
-		map_key_type category;
-		str_parse_number_result_enum spn_res = str_parse_number(cur, &cur, &category);
-		if (spn_res != SPNR_SUCCESS || !(*cur == '\0' || *cur == ',')) {
-			cdebug_printf(
-				CDEBUG_IL_CRITICAL,
-				"invalid category list '%s' for domain '%.*s'",
-				category_list, domain_size, domain
-			);
-			filter_result = FILTER_URI_ERROR;
-			break;
-		}
-		if (! map_exists(filter->map, category)) {
-			cdebug_printf(
-				CDEBUG_IL_CRITICAL,
-				"unknown category '%u' in category list '%s' for domain '%.*s'",
-				category, category_list, domain_size, domain
-			);
-			filter_result = FILTER_URI_ERROR;
-			break;
-		}
-		map_value_type is_allowed = map_get(filter->map, category);
-		if (! is_allowed) {filter_result = FILTER_URI_DENY; break;}
-		if (*cur == '\0') break;
-		assert(*cur == ',');
-		++cur;
+	category_list_struct category_list;
+	if (! column_category_list(context->select_categories_stmt, 0, &category_list)) {
+		cdebug_printf(CDEBUG_IL_CRITICAL, "NULL categories of domain '%.*s'", (int)domain_size, domain);
+		return FILTER_URI_ERROR;
 	}
+	filter_uri_result_enum filter_result = category_list_is_allowed(
+		filter, deny_mask, &category_list, domain, domain_size, denied_category_out
+	);
 
-	res = sqlite3_step(filter->select_categories_stmt);
+	res = sqlite3_step(context->select_categories_stmt);
 	if (res != SQLITE_DONE) {
 		print_select_categories_stmt_err("step(2)", res);
 		return FILTER_URI_ERROR;
@@ -216,33 +1991,469 @@ static filter_uri_result_enum filter_domain_is_allowed(
 	return filter_result;
 }
 
-filter_uri_result_enum filter_uri_is_allowed(
-		const filter_struct *filter,
-		const char *uri, int uri_is_authority
+// false if neither domain nor its ancestors looked up are in db
+static bool bloom_may_contain_domain(const filter_struct *filter, const char *domain, size_t domain_size) {
+	if (! (filter->suffix_match && domain_has_ancestors(domain, domain_size))) {
+		return bloom_filter_may_contain(filter->bloom, domain_hash(domain, domain_size));
+	}
+	hash_index_hash_type h = HASH_INDEX_HASH_INIT;
+	for (size_t i=domain_size; i>0; --i) {
+		h = hash_index_hash_step(h, domain[i-1]);
+		if (i == 1 || domain[i-2] == '.') {
+			if (bloom_filter_may_contain(filter->bloom, hash_index_hash_finish(h))) return true;
+		}
+	}
+	return false;
+}
+
+// Value of domain in delta overlay if it has one, else in sites_index or sites_dict;
+// false if domain is in neither or was deleted.
+static bool sites_get(
+		const filter_struct *filter, const char *domain, size_t domain_size, hash_index_hash_type hash,
+		hash_index_value_type *value_out
 ) {
-	assert(filter != NULL);
-	if (filter == NULL) return FILTER_URI_ERROR;
-	const char *domain;
+	hash_index_value_type value;
+	bool found = (
+		(filter->delta != NULL && hash_index_get_hashed(filter->delta->index, domain, domain_size, hash, &value)) ||
+		(
+			filter->sites_dict != NULL ?
+			domain_dict_get(filter->sites_dict, domain, domain_size, &value) :
+			hash_index_get_hashed(filter->sites_index, domain, domain_size, hash, &value)
+		)
+	);
+	if (! found || value == CATEGORY_SET_DELETED) return false;
+	*value_out = value;
+	return true;
+}
+
+// Probe domain and each of its ancestors while hashing it once from right to left.
+// Probes go from the shortest suffix to the longest, the last found wins.
+static bool index_find_suffix(
+		const filter_struct *filter, const char *domain, size_t domain_size,
+		hash_index_value_type *set_number_out
+) {
+	if (! domain_has_ancestors(domain, domain_size)) {
+		return sites_get(filter, domain, domain_size, domain_hash(domain, domain_size), set_number_out);
+	}
+	bool found = false;
+	hash_index_hash_type h = HASH_INDEX_HASH_INIT;
+	for (size_t i=domain_size; i>0; --i) {
+		h = hash_index_hash_step(h, domain[i-1]);
+		if (i == 1 || domain[i-2] == '.') {
+			const char *suffix = domain + i - 1;
+			size_t suffix_size = domain_size - i + 1;
+			hash_index_hash_type hash = hash_index_hash_finish(h);
+			if (sites_get(filter, suffix, suffix_size, hash, set_number_out)) found = true;
+		}
+	}
+	return found;
+}
+
+// Set of category_sets or of delta overlay, NULL if set_number is neither.
+static const category_word_type *index_category_set(const filter_struct *filter, hash_index_value_type set_number) {
+	if (set_number < filter->category_sets_number) {
+		return filter->category_sets + (size_t)set_number * filter->category_words;
+	}
+	if (
+		filter->delta != NULL && set_number >= CATEGORY_SET_DELTA_FIRST &&
+		set_number - CATEGORY_SET_DELTA_FIRST < filter->delta->sets.count
+	) {
+		return filter->delta->sets.data + (size_t)(set_number - CATEGORY_SET_DELTA_FIRST) * filter->category_words;
+	}
+	return NULL;
+}
+
+static filter_uri_result_enum index_set_is_allowed(
+		const filter_struct *filter, const category_word_type *deny_mask,
+		bool found, hash_index_value_type set_number
+) {
+	if (! found) return FILTER_URI_DOESNT_EXIST;
+	// category list parse error was logged at load time,
+	// comparisons also reject set numbers out of malformed snapshot
+	const category_word_type *set = index_category_set(filter, set_number);
+	if (set == NULL) return FILTER_URI_ERROR;
+	return (category_set_is_allowed(filter, deny_mask, set) ? FILTER_URI_ALLOW : FILTER_URI_DENY);
+}
+
+static bool index_find_domain(
+		const filter_struct *filter, const char *domain, size_t domain_size,
+		hash_index_value_type *set_number_out
+) {
+	return (
+		filter->suffix_match ?
+		index_find_suffix(filter, domain, domain_size, set_number_out) :
+		sites_get(filter, domain, domain_size, domain_hash(domain, domain_size), set_number_out)
+	);
+}
+
+static filter_uri_result_enum index_domain_is_allowed(
+		const filter_struct *filter, const category_word_type *deny_mask,
+		const char *domain, size_t domain_size
+) {
+	hash_index_value_type set_number;
+	bool found = index_find_domain(filter, domain, domain_size, &set_number);
+	return index_set_is_allowed(filter, deny_mask, found, set_number);
+}
+
+// Hashes domain as index_find_suffix() does and prefetches the home slots it will probe,
+// returns hash of whole domain.
+static hash_index_hash_type index_prefetch_domain(
+		const filter_struct *filter, const char *domain, size_t domain_size
+) {
+	hash_index_hash_type h = HASH_INDEX_HASH_INIT;
+	for (size_t i=domain_size; i>0; --i) {
+		h = hash_index_hash_step(h, domain[i-1]);
+		if (filter->suffix_match && i > 1 && domain[i-2] == '.') {
+			hash_index_prefetch(filter->sites_index, hash_index_hash_finish(h));
+		}
+	}
+	hash_index_hash_type hash = hash_index_hash_finish(h);
+	hash_index_prefetch(filter->sites_index, hash);
+	return hash;
+}
+
+// Verdicts of all groups share the cache: in groups other than FILTER_GROUP_DEFAULT
+// domain is followed by '\0', which domain never has, and group number. Returns key size.
+static size_t group_cache_key(
+		filter_group_type group, const char *domain, size_t domain_size,
+		char *key_out
+) {
+	memcpy(key_out, domain, domain_size);
+	key_out[domain_size] = '\0';
+	memcpy(key_out + domain_size + 1, &group, sizeof(group));
+	return domain_size + 1 + sizeof(group);
+}
+
+// context -- NULL if filter does not need it (see filter_uri_is_allowed_n())
+static filter_uri_result_enum filter_domain_is_allowed(
+		const filter_struct *filter, context_struct *context, filter_group_type group,
+		const char *domain, size_t domain_size
+) {
+	if (group >= filter->groups_number) group = FILTER_GROUP_DEFAULT;
+	const category_word_type *deny_mask = group_deny_mask(filter, group);
+	if (context == NULL) return index_domain_is_allowed(filter, deny_mask, domain, domain_size);
+
+	const char *key = domain;
+	size_t key_size = domain_size;
+	char group_key[URI_DOMAIN_SIZE_MAX + 1 + sizeof(group)];
+	verdict_cache_value_type cached;
+	if (context->cache != NULL) {
+		if (group != FILTER_GROUP_DEFAULT) {
+			key_size = group_cache_key(group, domain, domain_size, group_key);
+			key = group_key;
+		}
+		if (verdict_cache_get(context->cache, key, key_size, &cached)) return (filter_uri_result_enum)cached;
+	}
+
+	uint64_t start_ticks = (filter->stats ? ticks_now() : 0);
+	filter_uri_result_enum filter_result;
+	if (filter->index != FILTER_INDEX_SQLITE) {
+		filter_result = index_domain_is_allowed(filter, deny_mask, domain, domain_size);
+	} else {
+		size_t offsets[DOMAIN_SUFFIXES_MAX];
+		bool delta_found;
+		hash_index_value_type delta_value;
+		size_t offsets_number = sqlite_query_suffixes(filter, domain, domain_size, offsets, &delta_found, &delta_value);
+		if (offsets_number == 0) {
+			filter_result = FILTER_URI_DOESNT_EXIST;
+		} else if (filter->bloom != NULL && ! bloom_may_contain_domain(filter, domain, domain_size)) {
+			counter_increment(&context->bloom_checks);
+			counter_increment(&context->bloom_skips);
+			filter_result = FILTER_URI_DOESNT_EXIST;
+		} else {
+			filter_result = sqlite_domain_is_allowed(
+				filter, context, deny_mask, domain, domain_size, offsets, offsets_number, NULL
+			);
+			int res = sqlite3_reset(context->select_categories_stmt);
+			if (res != SQLITE_OK) {
+				print_select_categories_stmt_err("reset", res);
+				filter_result = FILTER_URI_ERROR;
+			}
+			if (filter->bloom != NULL) {
+				counter_increment(&context->bloom_checks);
+				if (filter_result == FILTER_URI_DOESNT_EXIST) counter_increment(&context->bloom_false_positives);
+			}
+		}
+		// suffix of delta overlay is shorter than suffixes queried
+		if (filter_result == FILTER_URI_DOESNT_EXIST && delta_found) {
+			filter_result = index_set_is_allowed(filter, deny_mask, true, delta_value);
+		}
+	}
+	if (filter->stats) histogram_record(&context->backend_ticks, ticks_now() - start_ticks);
+
+	// errors are not cached so that they are logged and retried each time
+	if (context->cache != NULL && filter_result != FILTER_URI_ERROR) {
+		verdict_cache_put(context->cache, key, key_size, filter_result);
+	}
+	return filter_result;
+}
+
+// index lookup without cache, stats and patterns of several pieces needs no per-thread state
+static bool filter_needs_context(const filter_struct *filter) {
+	return (
+		filter->index == FILTER_INDEX_SQLITE || filter->cache_size > 0 || filter->stats ||
+		(filter->patterns != NULL && pattern_matcher_needs_scratch(filter->patterns))
+	);
+}
+
+// returns size of domain written to domain_out, 0 if uri has none (logged and counted);
+// *path_offset_out -- where path and query begin, uri_size for authority
+static size_t filter_extract_domain(
+		const filter_struct *filter, context_struct *context,
+		const char *uri, size_t uri_size, int uri_is_authority,
+		char *domain_out, size_t *path_offset_out
+) {
+	*path_offset_out = uri_size;
 	size_t domain_size = (
 		!uri_is_authority ?
-		uri_extract_domain(uri, &domain) :
-		authority_extract_domain(uri, &domain)
+		uri_extract_domain_path_n(uri, uri_size, domain_out, path_offset_out) :
+		authority_extract_domain_n(uri, uri_size, domain_out)
 	);
 	if (domain_size == 0) {
 		cdebug_printf(
 			CDEBUG_IL_CRITICAL,
-			"extract_domain from uri '%s', uri_is_authority = %d",
-			uri, uri_is_authority
+			"extract_domain from uri '%.*s', uri_is_authority = %d",
+			(int)(uri_size < INT_MAX ? uri_size : INT_MAX), uri, uri_is_authority
 		);
-		return FILTER_URI_ERROR;
+		if (filter->stats) {
+			counter_increment(&context->parse_failures);
+			counter_increment(&context->lookups[FILTER_URI_ERROR]);
+		}
 	}
+	return domain_size;
+}
+
+static bool pattern_category_is_denied(uint32_t bit, const void *deny_mask) {
+	return category_is_denied(deny_mask, bit);
+}
 
-	filter_uri_result_enum filter_result = filter_domain_is_allowed(filter, domain, domain_size);
+// Patterns are run over path and query of requests that pass the domain check,
+// only patterns of categories denied in group count.
+static filter_uri_result_enum filter_patterns_apply(
+		const filter_struct *filter, context_struct *context, filter_group_type group,
+		const char *uri, size_t uri_size, size_t path_offset,
+		filter_uri_result_enum filter_result
+) {
+	if (filter->patterns == NULL || path_offset == uri_size) return filter_result;
+	if (!(filter_result == FILTER_URI_ALLOW || filter_result == FILTER_URI_DOESNT_EXIST)) return filter_result;
+	pattern_matcher_scratch_struct *scratch = (context != NULL ? context->pattern_scratch : NULL);
+	// with the only group all patterns kept are of its denied categories
+	pattern_matcher_accept_type accept = (filter->groups_number > 1 ? pattern_category_is_denied : NULL);
+	if (!pattern_matcher_matches(
+		filter->patterns, scratch,
+		uri + path_offset, uri_size - path_offset,
+		accept, group_deny_mask(filter, group)
+	)) return filter_result;
+	if (filter->stats) counter_increment(&context->pattern_denials);
+	return FILTER_URI_DENY;
+}
 
-	int res = sqlite3_reset(filter->select_categories_stmt);
-	if (res != SQLITE_OK) {
-		print_select_categories_stmt_err("reset", res);
-		filter_result = FILTER_URI_ERROR;
+int filter_uri_is_absolute_n(const char *uri, size_t uri_size) {
+	return uri_has_scheme_n(uri, uri_size);
+}
+
+filter_uri_result_enum filter_uri_is_allowed(
+		const filter_struct *filter,
+		const char *uri, int uri_is_authority
+) {
+	return filter_uri_is_allowed_n(filter, uri, strlen(uri), uri_is_authority);
+}
+
+filter_uri_result_enum filter_uri_is_allowed_n(
+		const filter_struct *filter,
+		const char *uri, size_t uri_size, int uri_is_authority
+) {
+	return filter_uri_is_allowed_in_group_n(filter, FILTER_GROUP_DEFAULT, uri, uri_size, uri_is_authority);
+}
+
+filter_uri_result_enum filter_uri_is_allowed_in_group_n(
+		const filter_struct *filter, filter_group_type group,
+		const char *uri, size_t uri_size, int uri_is_authority
+) {
+	assert(filter != NULL);
+	if (filter == NULL) return FILTER_URI_ERROR;
+	context_struct *context = NULL;
+	if (filter_needs_context(filter)) {
+		context = get_context(filter);
+		if (context == NULL) return FILTER_URI_ERROR;
 	}
+
+	char domain[URI_DOMAIN_SIZE_MAX];
+	size_t path_offset;
+	size_t domain_size = filter_extract_domain(filter, context, uri, uri_size, uri_is_authority, domain, &path_offset);
+	if (domain_size == 0) return FILTER_URI_ERROR;
+
+	filter_uri_result_enum filter_result = filter_domain_is_allowed(filter, context, group, domain, domain_size);
+	filter_result = filter_patterns_apply(filter, context, group, uri, uri_size, path_offset, filter_result);
+	if (filter->stats) counter_increment(&context->lookups[filter_result]);
 	return filter_result;
 }
+
+// Each group of uris goes in three passes: domains are extracted, hashed and
+// their index slots prefetched; keys stored in those slots are prefetched;
+// only then verdicts are resolved, by which time most lines have arrived.
+void filter_uris_are_allowed(
+		const filter_struct *filter,
+		const filter_uri_struct *uris, size_t uris_number,
+		filter_uri_result_enum *results_out
+) {
+	assert(filter != NULL);
+	context_struct *context = NULL;
+	if (filter == NULL || (filter_needs_context(filter) && (context = get_context(filter)) == NULL)) {
+		for (size_t i=0; i<uris_number; ++i) results_out[i] = FILTER_URI_ERROR;
+		return;
+	}
+
+	// sqlite lookups are not worth prefetching for, memory misses are hidden behind query anyway;
+	// compact index is probed by binary search, which has no single slot to prefetch
+	bool prefetch = (filter->sites_index != NULL);
+	char domains[BATCH_GROUP_SIZE][URI_DOMAIN_SIZE_MAX];
+	size_t domain_sizes[BATCH_GROUP_SIZE];
+	size_t path_offsets[BATCH_GROUP_SIZE];
+	hash_index_hash_type hashes[BATCH_GROUP_SIZE];
+	for (size_t begin=0; begin<uris_number; begin+=BATCH_GROUP_SIZE) {
+		size_t group_size = (uris_number - begin < BATCH_GROUP_SIZE ? uris_number - begin : BATCH_GROUP_SIZE);
+		const filter_uri_struct *group = uris + begin;
+		filter_uri_result_enum *group_results = results_out + begin;
+
+		for (size_t i=0; i<group_size; ++i) {
+			domain_sizes[i] = filter_extract_domain(
+				filter, context,
+				group[i].uri, group[i].uri_size, group[i].uri_is_authority,
+				domains[i], &path_offsets[i]
+			);
+			if (domain_sizes[i] == 0) {
+				group_results[i] = FILTER_URI_ERROR;
+			} else if (prefetch) {
+				hashes[i] = index_prefetch_domain(filter, domains[i], domain_sizes[i]);
+			} else if (filter->sites_dict != NULL) {
+				hashes[i] = domain_hash(domains[i], domain_sizes[i]);
+			}
+		}
+		// suffix probes would need keys of every ancestor, whole domain is the likely hit anyway
+		if (prefetch) {
+			for (size_t i=0; i<group_size; ++i) {
+				if (domain_sizes[i] != 0) hash_index_prefetch_key(filter->sites_index, hashes[i]);
+			}
+		}
+		for (size_t i=0; i<group_size; ++i) {
+			if (domain_sizes[i] == 0) continue;
+			filter_uri_result_enum filter_result;
+			if (context == NULL && ! filter->suffix_match) {
+				hash_index_value_type set_number;
+				bool found = sites_get(filter, domains[i], domain_sizes[i], hashes[i], &set_number);
+				filter_result = index_set_is_allowed(filter, group_deny_mask(filter, group[i].group), found, set_number);
+			} else {
+				filter_result = filter_domain_is_allowed(filter, context, group[i].group, domains[i], domain_sizes[i]);
+			}
+			filter_result = filter_patterns_apply(
+				filter, context, group[i].group,
+				group[i].uri, group[i].uri_size, path_offsets[i],
+				filter_result
+			);
+			if (filter->stats) counter_increment(&context->lookups[filter_result]);
+			group_results[i] = filter_result;
+		}
+	}
+}
+
+// The least category of set denied by deny_mask: bits are in order of category ids.
+static bool category_set_denied_category(
+		const filter_struct *filter, const category_word_type *deny_mask, const category_word_type *set,
+		category_id_type *category_out
+) {
+	for (size_t i=0; i<filter->category_words; ++i) {
+		category_word_type denied = set[i] & deny_mask[i];
+		if (denied != 0) {
+			*category_out = filter->category_ids[i * CATEGORY_WORD_BITS + __builtin_ctzll(denied)];
+			return true;
+		}
+	}
+	return false;
+}
+
+int filter_uri_denied_category_in_group_n(
+		const filter_struct *filter, filter_group_type group,
+		const char *uri, size_t uri_size, int uri_is_authority,
+		unsigned int *category_out
+) {
+	assert(filter != NULL);
+	context_struct *context = NULL;
+	if (filter->index == FILTER_INDEX_SQLITE && (context = get_context(filter)) == NULL) return 0;
+
+	char domain[URI_DOMAIN_SIZE_MAX];
+	size_t path_offset;
+	size_t domain_size = (
+		!uri_is_authority ?
+		uri_extract_domain_path_n(uri, uri_size, domain, &path_offset) :
+		authority_extract_domain_n(uri, uri_size, domain)
+	);
+	if (domain_size == 0) return 0;
+	const category_word_type *deny_mask = group_deny_mask(filter, group);
+
+	hash_index_value_type set_number;
+	bool found;
+	if (filter->index != FILTER_INDEX_SQLITE) {
+		found = index_find_domain(filter, domain, domain_size, &set_number);
+	} else {
+		size_t offsets[DOMAIN_SUFFIXES_MAX];
+		size_t offsets_number = sqlite_query_suffixes(filter, domain, domain_size, offsets, &found, &set_number);
+		if (offsets_number != 0) {
+			category_id_type category;
+			filter_uri_result_enum filter_result = sqlite_domain_is_allowed(
+				filter, context, deny_mask, domain, domain_size, offsets, offsets_number, &category
+			);
+			sqlite3_reset(context->select_categories_stmt);
+			if (filter_result == FILTER_URI_DENY) *category_out = category;
+			// suffix of delta overlay is shorter than suffixes queried
+			if (filter_result != FILTER_URI_DOESNT_EXIST) return (filter_result == FILTER_URI_DENY);
+		}
+	}
+	if (! found) return 0;
+	const category_word_type *set = index_category_set(filter, set_number);
+	category_id_type category;
+	if (set == NULL || ! category_set_denied_category(filter, deny_mask, set, &category)) return 0;
+	*category_out = category;
+	return 1;
+}
+
+size_t filter_groups_number(const filter_struct *filter) {
+	return filter->groups_number;
+}
+
+filter_group_type filter_group_of_id(const filter_struct *filter, int64_t group_id) {
+	size_t lo = 0, hi = filter->groups_number - 1;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (filter->group_ids[mid] < group_id) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == filter->groups_number - 1 || filter->group_ids[lo] != group_id) return FILTER_GROUP_DEFAULT;
+	return (filter_group_type)(lo + 1);
+}
+
+size_t filter_group_networks_number(const filter_struct *filter) {
+	return filter->group_networks_number;
+}
+
+filter_group_type filter_group_of_ip(const filter_struct *filter, const char *ip, size_t ip_size) {
+	if (filter->group_networks_number == 0) return FILTER_GROUP_DEFAULT;
+	uint8_t address[16];
+	uint32_t prefix_bits;
+	if (! parse_network(ip, ip_size, address, &prefix_bits) || prefix_bits != 128) return FILTER_GROUP_DEFAULT;
+	for (size_t i=0; i<filter->group_networks_number; ++i) {
+		if (network_contains(&filter->group_networks[i], address)) return filter->group_networks[i].group;
+	}
+	return FILTER_GROUP_DEFAULT;
+}
+
+void filter_get_stats(const filter_struct *const_filter, filter_stats_struct *stats_out) {
+	filter_struct *filter = (filter_struct *)const_filter;
+	pthread_mutex_lock(&filter->contexts_mutex);
+	*stats_out = filter->exited_stats;
+	for (const context_struct *context = filter->contexts; context != NULL; context = context->next) {
+		context_add_stats(context, stats_out);
+	}
+	pthread_mutex_unlock(&filter->contexts_mutex);
+	stats_out->ns_per_tick = ns_per_tick(filter);
+}
@@ -1,6 +1,10 @@
 #ifndef FILTER_H
 #define FILTER_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "histogram.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -15,9 +19,136 @@ typedef enum {
 	FILTER_URI_ERROR
 } filter_uri_result_enum;
 
-filter_struct *filter_construct(const char *db_uri);
+typedef enum {
+	FILTER_INDEX_SQLITE, // query sqlite database on each lookup
+	FILTER_INDEX_HASH,    // load all sites into memory hash table at construct
+	FILTER_INDEX_SNAPSHOT, // map snapshot made by filter_save_snapshot(), db_uri is its path
+	// map snapshot of db at shared_path, built by the first process
+	// that finds it missing or older than db; other processes wait for it
+	FILTER_INDEX_SHARED,
+	// load all sites into sorted front-coded dictionary at construct:
+	// a few bytes per domain, lookups are binary searches
+	FILTER_INDEX_COMPACT
+} filter_index_enum;
+
+typedef struct {
+	filter_index_enum index;
+	// domain not in db is looked up as its longest ancestor in db
+	// (cdn.img.example.com -> img.example.com -> example.com -> com)
+	int suffix_match;
+	// entries in verdict cache of each thread, 0 -- no cache
+	size_t cache_size;
+	// FILTER_INDEX_SQLITE: false positive rate of Bloom filter of all domains
+	// used to skip queries of domains not in db, 0 -- no Bloom filter
+	double bloom_fpr;
+	// count lookups and measure backend time, see filter_get_stats()
+	int stats;
+	// FILTER_INDEX_SHARED: snapshot path, <shared_path>.lock is used to build it once
+	const char *shared_path;
+} filter_config_struct;
+
+// summed over all threads that used the filter
+typedef struct {
+	// lookups by filter_uri_result_enum
+	uint64_t lookups[4];
+	// uris without valid domain, also counted as FILTER_URI_ERROR lookups
+	uint64_t parse_failures;
+	// uris denied by 'patterns' table only, also counted as FILTER_URI_DENY lookups
+	uint64_t pattern_denials;
+	// time of lookups not answered by verdict cache, in ticks of cpu counter
+	histogram_struct backend_ticks;
+	double ns_per_tick;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_evictions;
+	// queries checked by Bloom filter, skipped and made in vain
+	uint64_t bloom_checks;
+	uint64_t bloom_skips;
+	uint64_t bloom_false_positives;
+} filter_stats_struct;
+
+filter_struct *filter_construct(const char *db_uri, const filter_config_struct *config);
 void filter_destruct(filter_struct *filter);
+// 1 if database file was replaced or modified since filter was constructed,
+// FILTER_INDEX_SHARED: also if shared snapshot was republished
+int filter_db_is_changed(const filter_struct *filter);
+// filter must be constructed with FILTER_INDEX_HASH, returns 0 on success
+int filter_save_snapshot(const filter_struct *filter, const char *path);
+
+typedef enum {
+	FILTER_DELTA_APPLIED,
+	FILTER_DELTA_NONE,   // database file is as filter saw it
+	// database was replaced or changed other than by new 'sites_delta' rows,
+	// or filter is FILTER_INDEX_SNAPSHOT: construct filter anew
+	FILTER_DELTA_RELOAD,
+	FILTER_DELTA_ERROR
+} filter_delta_result_enum;
+// FILTER_DELTA_APPLIED: *updated_out is a new filter that sees 'sites_delta' rows added
+// since filter was made. It shares index with filter and costs time and memory proportional
+// to the domains changed since index was built; both filters must be destructed.
+filter_delta_result_enum filter_apply_delta(const filter_struct *filter, filter_struct **updated_out);
+// number of domains in delta overlay, changed by 'sites_delta' since index was built
+size_t filter_delta_size(const filter_struct *filter);
+// 1 if delta overlay is large enough to be merged into index: by filter_merge_delta()
+// for FILTER_INDEX_HASH, by constructing filter anew for FILTER_INDEX_COMPACT and
+// FILTER_INDEX_SHARED, which also rebuilds shared snapshot; always 0 for other indexes
+int filter_delta_needs_merge(const filter_struct *filter);
+// FILTER_INDEX_HASH: new filter with delta overlay merged into a copy of index, without
+// reading database; NULL on error
+filter_struct *filter_merge_delta(const filter_struct *filter);
+
+// Policy group of client: requests are checked against its row of 'group_rules'
+// instead of 'rules'. Groups share the sites index, each costs one bit per category.
+typedef uint32_t filter_group_type;
+// 'rules' only, also the group of clients matching no group
+#define FILTER_GROUP_DEFAULT 0
+
+// number of groups including FILTER_GROUP_DEFAULT, 1 if db has no 'group_rules'
+size_t filter_groups_number(const filter_struct *filter);
+// FILTER_GROUP_DEFAULT if group_id has no rows in 'group_rules'
+filter_group_type filter_group_of_id(const filter_struct *filter, int64_t group_id);
+// number of networks in 'group_networks', 0 -- filter_group_of_ip() is always FILTER_GROUP_DEFAULT
+size_t filter_group_networks_number(const filter_struct *filter);
+// group of the longest network of 'group_networks' containing ip (IPv4 or IPv6 text
+// of ip_size bytes), FILTER_GROUP_DEFAULT if there is none or ip is malformed
+filter_group_type filter_group_of_ip(const filter_struct *filter, const char *ip, size_t ip_size);
+
+// 1 if uri starts with "scheme://", 0 for path and anything else whose host is not
+// at its start, e.g. "/go?u=http://host/"; only such uri has a domain to look up
+int filter_uri_is_absolute_n(const char *uri, size_t uri_size);
+// lookups in FILTER_GROUP_DEFAULT
 filter_uri_result_enum filter_uri_is_allowed(const filter_struct *filter, const char *uri, int uri_is_authority);
+// uri of uri_size bytes, need not be null-terminated
+filter_uri_result_enum filter_uri_is_allowed_n(
+	const filter_struct *filter,
+	const char *uri, size_t uri_size, int uri_is_authority
+);
+filter_uri_result_enum filter_uri_is_allowed_in_group_n(
+	const filter_struct *filter, filter_group_type group,
+	const char *uri, size_t uri_size, int uri_is_authority
+);
+typedef struct {
+	const char *uri;
+	size_t uri_size;
+	int uri_is_authority;
+	filter_group_type group;
+} filter_uri_struct;
+// results_out[i] is what filter_uri_is_allowed_in_group_n() would return for uris[i];
+// lookups of a batch overlap their memory accesses, so index lookups are faster than one by one
+void filter_uris_are_allowed(
+	const filter_struct *filter,
+	const filter_uri_struct *uris, size_t uris_number,
+	filter_uri_result_enum *results_out
+);
+// 1 if a category of the domain of uri denies it in group, the least such category_id
+// is written to *category_out; 0 if uri is allowed, unlisted, denied by patterns only or malformed.
+// Index lookup is made anew, past verdict cache and stats: meant for uris already denied.
+int filter_uri_denied_category_in_group_n(
+	const filter_struct *filter, filter_group_type group,
+	const char *uri, size_t uri_size, int uri_is_authority,
+	unsigned int *category_out
+);
+void filter_get_stats(const filter_struct *filter, filter_stats_struct *stats_out);
 
 #ifdef __cplusplus
 }
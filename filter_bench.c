@@ -0,0 +1,422 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "filter.h"
+#include "cdebug.h"
+
+// Replays a mix of URIs (or a request trace made by make_test_db) through
+// filter_uri_is_allowed_n() from 1..N threads and reports throughput
+// and latency percentiles for each number of threads. With -B each run
+// is repeated through filter_uris_are_allowed() in batches. Speedup is
+// throughput relative to one thread, -e makes too small a speedup an error.
+
+#define URI_SIZE_MAX 300
+// mix of URIs, in percents
+#define HIT_PERCENT 70
+#define MISS_PERCENT 15
+#define AUTHORITY_PERCENT 10
+// the rest are malformed
+
+typedef struct {
+	char *uri;
+	size_t uri_size;
+	int uri_is_authority;
+} request_type;
+
+typedef struct {
+	const filter_struct *filter;
+	const request_type *requests;
+	size_t requests_number;
+	size_t lookups;
+	size_t batch;                 // 0 -- one by one
+	unsigned int seed;
+	pthread_barrier_t *barrier;
+	uint32_t *latencies;          // ns, one per lookup
+	uint64_t results[4];          // by filter_uri_result_enum
+	double start;
+	double end;
+} worker_type;
+
+static const char *malformed_uris[] = {
+	"not a uri",
+	"http:/example.com/",
+	"http://:8080/",
+	"http://user@/",
+	""
+};
+#define MALFORMED_URIS_NUMBER (sizeof(malformed_uris)/sizeof(malformed_uris[0]))
+
+// lookup of malformed uri logs error: messages are dropped after filter is loaded
+// so that stderr writes are not measured
+static int cdebug_quiet;
+
+int cdebug_printf(cdebug_lvmask_type lvmask, const char *format, ...) {
+	(void)lvmask;
+	if (__atomic_load_n(&cdebug_quiet, __ATOMIC_RELAXED)) return 0;
+	va_list args;
+	va_start(args, format);
+	int res = vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+	return res;
+}
+
+void cdebug_flush(void) {
+}
+
+void print_err_and_exit(const char *msg) {
+	fprintf(stderr, "error: %s\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Samples domains of db and builds requests in shuffled order.
+static request_type *make_requests(const char *db_uri, size_t requests_number, unsigned int seed) {
+	request_type *requests = calloc(requests_number, sizeof(request_type));
+	if (requests == NULL) print_err_and_exit("calloc");
+	sqlite3 *db;
+	int res = sqlite3_open_v2(db_uri, &db, SQLITE_OPEN_URI | SQLITE_OPEN_READONLY, NULL);
+	if (res != SQLITE_OK) {
+		fprintf(stderr, "error: sqlite3_open_v2 '%s': %s\n", db_uri, sqlite3_errstr(res));
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_stmt *stmt;
+	const char *sql = "SELECT domain FROM sites ORDER BY random() LIMIT ?";
+	res = sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
+	if (res != SQLITE_OK) {
+		fprintf(stderr, "error: sqlite3_prepare_v2 sql '%s': %s\n", sql, sqlite3_errstr(res));
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_bind_int64(stmt, 1, requests_number * (HIT_PERCENT + AUTHORITY_PERCENT) / 100 + 1);
+
+	srand(seed);
+	char uri[URI_SIZE_MAX];
+	for (size_t i=0; i<requests_number; ++i) {
+		request_type *request = &requests[i];
+		unsigned int kind = i * 100 / requests_number;
+		if (kind < HIT_PERCENT + AUTHORITY_PERCENT) {
+			res = sqlite3_step(stmt);
+			if (res != SQLITE_ROW) print_err_and_exit("not enough domains in db");
+			const char *domain = (const char *)sqlite3_column_text(stmt, 0);
+			if (kind < HIT_PERCENT) snprintf(uri, URI_SIZE_MAX, "http://%s/index.html", domain);
+			else snprintf(uri, URI_SIZE_MAX, "%s:443", domain);
+			request->uri_is_authority = !(kind < HIT_PERCENT);
+		} else if (kind < HIT_PERCENT + AUTHORITY_PERCENT + MISS_PERCENT) {
+			snprintf(uri, URI_SIZE_MAX, "http://miss%d.bench.invalid/", rand());
+		} else {
+			snprintf(uri, URI_SIZE_MAX, "%s", malformed_uris[i % MALFORMED_URIS_NUMBER]);
+		}
+		request->uri = strdup(uri);
+		if (request->uri == NULL) print_err_and_exit("strdup");
+		request->uri_size = strlen(uri);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	for (size_t i=requests_number; i>1; --i) {
+		size_t j = rand() % i;
+		request_type tmp = requests[i-1];
+		requests[i-1] = requests[j];
+		requests[j] = tmp;
+	}
+	return requests;
+}
+
+// Reads trace lines "<method> <uri>": popular URIs repeat in it,
+// so random picks keep trace popularity.
+static request_type *load_trace(const char *path, size_t *requests_number_out) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {perror(path); exit(EXIT_FAILURE);}
+	size_t requests_size = 1024;
+	size_t requests_number = 0;
+	request_type *requests = malloc(requests_size * sizeof(request_type));
+	if (requests == NULL) print_err_and_exit("malloc");
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t line_length;
+	while ((line_length = getline(&line, &line_size, f)) != -1) {
+		if (line_length > 0 && line[line_length-1] == '\n') line[--line_length] = '\0';
+		const char *uri = strchr(line, ' ');
+		if (uri == NULL) continue;
+		++uri;
+		if (requests_number == requests_size) {
+			requests_size *= 2;
+			requests = realloc(requests, requests_size * sizeof(request_type));
+			if (requests == NULL) print_err_and_exit("realloc");
+		}
+		request_type *request = &requests[requests_number++];
+		request->uri_is_authority = (strncmp(line, "CONNECT ", 8) == 0);
+		request->uri_size = line + line_length - uri;
+		request->uri = strdup(uri);
+		if (request->uri == NULL) print_err_and_exit("strdup");
+	}
+	free(line);
+	fclose(f);
+	if (requests_number == 0) print_err_and_exit("empty trace");
+	*requests_number_out = requests_number;
+	return requests;
+}
+
+// latency of each lookup is that of its batch divided by batch size
+static void worker_run_batches(worker_type *worker) {
+	unsigned int seed = worker->seed;
+	filter_uri_struct *uris = malloc(worker->batch * sizeof(filter_uri_struct));
+	filter_uri_result_enum *results = malloc(worker->batch * sizeof(filter_uri_result_enum));
+	if (uris == NULL || results == NULL) print_err_and_exit("malloc");
+	worker->start = now();
+	for (size_t i=0; i<worker->lookups; i+=worker->batch) {
+		size_t batch = (worker->lookups - i < worker->batch ? worker->lookups - i : worker->batch);
+		for (size_t j=0; j<batch; ++j) {
+			const request_type *request = &worker->requests[rand_r(&seed) % worker->requests_number];
+			uris[j].uri = request->uri;
+			uris[j].uri_size = request->uri_size;
+			uris[j].uri_is_authority = request->uri_is_authority;
+			uris[j].group = FILTER_GROUP_DEFAULT;
+		}
+		uint64_t t0 = now_ns();
+		filter_uris_are_allowed(worker->filter, uris, batch, results);
+		uint64_t t1 = now_ns();
+		uint64_t latency = (t1 - t0) / batch;
+		for (size_t j=0; j<batch; ++j) {
+			worker->latencies[i+j] = (latency > UINT32_MAX ? UINT32_MAX : latency);
+			++worker->results[results[j]];
+		}
+	}
+	worker->end = now();
+	free(results);
+	free(uris);
+}
+
+static void *worker_run(void *ptr) {
+	worker_type *worker = ptr;
+	unsigned int seed = worker->seed;
+	// warm up: thread context, cache and page cache
+	for (size_t i=0; i<worker->requests_number; ++i) {
+		const request_type *request = &worker->requests[i];
+		filter_uri_is_allowed_n(worker->filter, request->uri, request->uri_size, request->uri_is_authority);
+	}
+	pthread_barrier_wait(worker->barrier);
+	if (worker->batch > 0) {
+		worker_run_batches(worker);
+		return NULL;
+	}
+	worker->start = now();
+	for (size_t i=0; i<worker->lookups; ++i) {
+		const request_type *request = &worker->requests[rand_r(&seed) % worker->requests_number];
+		uint64_t t0 = now_ns();
+		filter_uri_result_enum result = filter_uri_is_allowed_n(
+			worker->filter,
+			request->uri, request->uri_size, request->uri_is_authority
+		);
+		uint64_t t1 = now_ns();
+		worker->latencies[i] = (t1 - t0 > UINT32_MAX ? UINT32_MAX : t1 - t0);
+		++worker->results[result];
+	}
+	worker->end = now();
+	return NULL;
+}
+
+static int uint32_compare(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, size_t size, double p) {
+	size_t i = (size_t)(p * size);
+	return sorted[i < size ? i : size - 1];
+}
+
+// returns throughput, base_throughput -- of one thread, 0 for the one thread run itself
+static double run(
+		const filter_struct *filter, const char *index_name,
+		const request_type *requests, size_t requests_number,
+		size_t lookups, size_t batch, unsigned int threads_number, double base_throughput, int json
+) {
+	worker_type *workers = calloc(threads_number, sizeof(worker_type));
+	pthread_t *threads = calloc(threads_number, sizeof(pthread_t));
+	uint32_t *latencies = malloc(threads_number * lookups * sizeof(uint32_t));
+	if (workers == NULL || threads == NULL || latencies == NULL) print_err_and_exit("malloc");
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, threads_number);
+	for (unsigned int i=0; i<threads_number; ++i) {
+		worker_type *worker = &workers[i];
+		worker->filter = filter;
+		worker->requests = requests;
+		worker->requests_number = requests_number;
+		worker->lookups = lookups;
+		worker->batch = batch;
+		worker->seed = i + 1;
+		worker->barrier = &barrier;
+		worker->latencies = latencies + i * lookups;
+		if (pthread_create(&threads[i], NULL, worker_run, worker) != 0) print_err_and_exit("pthread_create");
+	}
+	uint64_t results[4] = {0};
+	double start = 0, end = 0;
+	for (unsigned int i=0; i<threads_number; ++i) {
+		pthread_join(threads[i], NULL);
+		if (i == 0 || workers[i].start < start) start = workers[i].start;
+		if (i == 0 || workers[i].end > end) end = workers[i].end;
+		for (int r=0; r<4; ++r) results[r] += workers[i].results[r];
+	}
+	pthread_barrier_destroy(&barrier);
+
+	size_t total = threads_number * lookups;
+	qsort(latencies, total, sizeof(latencies[0]), uint32_compare);
+	double throughput = total / (end - start);
+	double speedup = (base_throughput > 0 ? throughput / base_throughput : 1);
+	uint32_t p50 = percentile(latencies, total, 0.50);
+	uint32_t p99 = percentile(latencies, total, 0.99);
+	uint32_t p999 = percentile(latencies, total, 0.999);
+	if (json) {
+		printf(
+			"{\"index\":\"%s\",\"threads\":%u,\"batch\":%zu,\"lookups\":%zu,\"seconds\":%.6f,"
+			"\"lookups_per_second\":%.0f,\"speedup\":%.2f,\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,"
+			"\"allow\":%llu,\"deny\":%llu,\"doesnt_exist\":%llu,\"error\":%llu}\n",
+			index_name, threads_number, (batch > 0 ? batch : 1), total, end - start,
+			throughput, speedup, p50, p99, p999,
+			(unsigned long long)results[FILTER_URI_ALLOW],
+			(unsigned long long)results[FILTER_URI_DENY],
+			(unsigned long long)results[FILTER_URI_DOESNT_EXIST],
+			(unsigned long long)results[FILTER_URI_ERROR]
+		);
+	} else {
+		printf(
+			"%-8u %6zu %14.0f %8.2f %10u %10u %10u\n",
+			threads_number, (batch > 0 ? batch : 1), throughput, speedup, p50, p99, p999
+		);
+	}
+	fflush(stdout);
+	free(latencies);
+	free(threads);
+	free(workers);
+	return throughput;
+}
+
+static void print_usage_and_exit(void) {
+	print_err_and_exit(
+		"wrong arguments\n"
+		"usage: filter_bench [options] <db_uri>\n"
+		"  -i <index>               sqlite, hash, compact or snapshot (default hash)\n"
+		"  -s <snapshot_path>       snapshot for -i snapshot, made from db by ecap_filter_compile\n"
+		"  -m                       suffix match\n"
+		"  -c <entries>             verdict cache size (default 0)\n"
+		"  -b <fpr>                 Bloom filter false positive rate for -i sqlite (default 0)\n"
+		"  -S                       count lookups and measure backend time as adapter does\n"
+		"  -t <threads>             max threads (default number of CPUs)\n"
+		"  -n <lookups>             lookups per thread (default 1000000)\n"
+		"  -u <uris>                distinct URIs (default 100000)\n"
+		"  -f <trace>               replay request trace made by make_test_db -T instead of URI mix\n"
+		"  -B <batch>               also run lookups in batches of this size (default 0 -- don't)\n"
+		"  -e <efficiency>          fail if speedup of max threads is below efficiency * threads\n"
+		"  -j                       JSON line per run"
+	);
+}
+
+int main(int argc, char *argv[]) {
+	filter_config_struct filter_config;
+	memset(&filter_config, 0, sizeof(filter_config));
+	filter_config.index = FILTER_INDEX_HASH;
+	const char *index_name = "hash";
+	const char *snapshot_path = NULL;
+	long threads_max = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t lookups = 1000000;
+	size_t requests_number = 100000;
+	size_t batch = 0;
+	double efficiency = 0;
+	const char *trace_path = NULL;
+	int json = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:s:mc:b:St:n:u:f:B:e:j")) != -1) {
+		switch (opt) {
+		case 'i':
+			index_name = optarg;
+			if (strcmp(optarg, "sqlite") == 0) filter_config.index = FILTER_INDEX_SQLITE;
+			else if (strcmp(optarg, "hash") == 0) filter_config.index = FILTER_INDEX_HASH;
+			else if (strcmp(optarg, "compact") == 0) filter_config.index = FILTER_INDEX_COMPACT;
+			else if (strcmp(optarg, "snapshot") == 0) filter_config.index = FILTER_INDEX_SNAPSHOT;
+			else print_usage_and_exit();
+			break;
+		case 's': snapshot_path = optarg; break;
+		case 'm': filter_config.suffix_match = 1; break;
+		case 'c': filter_config.cache_size = strtoul(optarg, NULL, 10); break;
+		case 'b': filter_config.bloom_fpr = strtod(optarg, NULL); break;
+		case 'S': filter_config.stats = 1; break;
+		case 't': threads_max = strtol(optarg, NULL, 10); break;
+		case 'n': lookups = strtoul(optarg, NULL, 10); break;
+		case 'u': requests_number = strtoul(optarg, NULL, 10); break;
+		case 'f': trace_path = optarg; break;
+		case 'B': batch = strtoul(optarg, NULL, 10); break;
+		case 'e': efficiency = strtod(optarg, NULL); break;
+		case 'j': json = 1; break;
+		default: print_usage_and_exit();
+		}
+	}
+	if (optind + 1 != argc) print_usage_and_exit();
+	if (threads_max < 1 || lookups == 0 || requests_number == 0 || efficiency < 0) print_usage_and_exit();
+	if ((filter_config.index == FILTER_INDEX_SNAPSHOT) != (snapshot_path != NULL)) print_usage_and_exit();
+	const char *db_uri = argv[optind];
+
+	request_type *requests = (trace_path != NULL ?
+		load_trace(trace_path, &requests_number) :
+		make_requests(db_uri, requests_number, 1)
+	);
+	double start = now();
+	filter_struct *filter = filter_construct(snapshot_path != NULL ? snapshot_path : db_uri, &filter_config);
+	if (filter == NULL) print_err_and_exit("filter_construct");
+	double load_seconds = now() - start;
+	__atomic_store_n(&cdebug_quiet, 1, __ATOMIC_RELAXED);
+	if (json) printf("{\"index\":\"%s\",\"load_seconds\":%.6f}\n", index_name, load_seconds);
+	else printf(
+		"index %s, load %.3f s\n%-8s %6s %14s %8s %10s %10s %10s\n",
+		index_name, load_seconds, "threads", "batch", "lookups/s", "speedup", "p50 ns", "p99 ns", "p999 ns"
+	);
+
+	double base_throughput = 0, base_batch_throughput = 0, throughput = 0;
+	for (long threads_number=1; ; threads_number*=2) {
+		if (threads_number > threads_max) threads_number = threads_max;
+		throughput = run(
+			filter, index_name, requests, requests_number,
+			lookups, 0, threads_number, base_throughput, json
+		);
+		if (threads_number == 1) base_throughput = throughput;
+		if (batch > 0) {
+			double batch_throughput = run(
+				filter, index_name, requests, requests_number,
+				lookups, batch, threads_number, base_batch_throughput, json
+			);
+			if (threads_number == 1) base_batch_throughput = batch_throughput;
+		}
+		if (threads_number == threads_max) break;
+	}
+	// lookups one by one of max threads against the one thread run
+	int status = EXIT_SUCCESS;
+	if (efficiency > 0 && throughput < efficiency * threads_max * base_throughput) {
+		fprintf(
+			stderr, "scaling check failed: speedup %.2f with %ld threads, expected at least %.2f\n",
+			throughput / base_throughput, threads_max, efficiency * threads_max
+		);
+		status = EXIT_FAILURE;
+	}
+
+	filter_destruct(filter);
+	for (size_t i=0; i<requests_number; ++i) free(requests[i].uri);
+	free(requests);
+	return status;
+}
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "filter.h"
+
+// Regression checks of lookups: each case is looked up with every index
+// and with the batch API, all of them must agree with the expected verdict.
+// Database is made from SQL below in a temporary file.
+
+typedef struct {
+	const char *sql;
+	int suffix_match;
+	const char *uri;
+	int uri_is_authority;
+	filter_group_type group;
+	filter_uri_result_enum expected;
+	// by filter_uri_denied_category_in_group_n(), 0 -- none
+	unsigned int denied_category;
+} check_case_struct;
+
+static const char *result_names[] = {"allow", "deny", "unlisted", "error"};
+
+static const char base_sql[] =
+	"CREATE TABLE sites(domain TEXT PRIMARY KEY NOT NULL, categories TEXT NOT NULL);"
+	"CREATE TABLE rules(category_id INTEGER PRIMARY KEY NOT NULL, allowed INTEGER NOT NULL);"
+	"INSERT INTO rules VALUES(1,1),(2,0);"
+	"INSERT INTO sites VALUES('example.com','2'),('ok.example.com','1'),('a.b.example.com','2');";
+
+static const char patterns_sql[] =
+	"CREATE TABLE sites(domain TEXT PRIMARY KEY NOT NULL, categories TEXT NOT NULL);"
+	"CREATE TABLE rules(category_id INTEGER PRIMARY KEY NOT NULL, allowed INTEGER NOT NULL);"
+	"CREATE TABLE patterns(pattern TEXT NOT NULL, category_id INTEGER NOT NULL);"
+	"INSERT INTO rules VALUES(1,1),(2,0);"
+	"INSERT INTO sites VALUES('ok.example.com','1');"
+	"INSERT INTO patterns VALUES('/bad1/',1),('/bad2/',2);";
+
+// group 1 (group_id 10) allows category 2 and denies category 3 which 'rules' allow
+static const char group_patterns_sql[] =
+	"CREATE TABLE sites(domain TEXT PRIMARY KEY NOT NULL, categories TEXT NOT NULL);"
+	"CREATE TABLE rules(category_id INTEGER PRIMARY KEY NOT NULL, allowed INTEGER NOT NULL);"
+	"CREATE TABLE group_rules(group_id INTEGER NOT NULL, category_id INTEGER NOT NULL, allowed INTEGER NOT NULL);"
+	"CREATE TABLE patterns(pattern TEXT NOT NULL, category_id INTEGER NOT NULL);"
+	"INSERT INTO rules VALUES(1,1),(2,0),(3,1);"
+	"INSERT INTO group_rules VALUES(10,2,1),(10,3,0);"
+	"INSERT INTO sites VALUES('ok.example.com','1');"
+	"INSERT INTO patterns VALUES('/bad1/',1),('/bad2/',2),('/x3/*.exe',3);";
+
+// hosts of more labels than suffixes queried at once with index=sqlite
+#define LABELS_40 "a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a."
+
+static const check_case_struct cases[] = {
+	{base_sql, 0, "http://example.com/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_DENY, 2},
+	{base_sql, 0, "http://www.example.com/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_DOESNT_EXIST, 0},
+	{base_sql, 1, "http://www.example.com/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_DENY, 2},
+	{base_sql, 1, "http://" LABELS_40 "example.com/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_DENY, 2},
+	{base_sql, 1, LABELS_40 "example.com:443", 1, FILTER_GROUP_DEFAULT, FILTER_URI_DENY, 2},
+	{base_sql, 1, "http://" LABELS_40 "ok.example.com/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_ALLOW, 0},
+	{base_sql, 1, "http://" LABELS_40 "a.b.example.com/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_DENY, 2},
+	{base_sql, 1, "http://" LABELS_40 "example.org/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_DOESNT_EXIST, 0},
+	// path passed by squid to wantsUrl(): URL in its query is not the request one
+	{base_sql, 0, "/go?u=http://ok.example.com/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_ERROR, 0},
+	{base_sql, 1, "/go?u=http://ok.example.com/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_ERROR, 0},
+	{patterns_sql, 0, "http://ok.example.com/bad2/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_DENY, 0},
+	{patterns_sql, 0, "http://ok.example.com/bad1/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_ALLOW, 0},
+	{group_patterns_sql, 0, "http://ok.example.com/bad2/", 0, FILTER_GROUP_DEFAULT, FILTER_URI_DENY, 0},
+	{group_patterns_sql, 0, "http://ok.example.com/bad2/", 0, 1, FILTER_URI_ALLOW, 0},
+	{group_patterns_sql, 0, "http://ok.example.com/x3/a.exe", 0, FILTER_GROUP_DEFAULT, FILTER_URI_ALLOW, 0},
+	{group_patterns_sql, 0, "http://ok.example.com/x3/a.exe", 0, 1, FILTER_URI_DENY, 0},
+	{group_patterns_sql, 0, "http://example.org/x3/a.exe", 0, 1, FILTER_URI_DENY, 0},
+	{group_patterns_sql, 0, "http://ok.example.com/bad2/x3/a.exe", 0, 1, FILTER_URI_DENY, 0},
+	{group_patterns_sql, 0, "http://ok.example.com/bad1/", 0, 1, FILTER_URI_ALLOW, 0},
+};
+
+// adapter wantsUrl() looks up only absolute URLs, anything else goes to transaction
+typedef struct {
+	const char *uri;
+	int is_absolute;
+} absolute_case_struct;
+
+static const absolute_case_struct absolute_cases[] = {
+	{"http://ok.example.com/", 1},
+	{"HTTPS://ok.example.com:443/", 1},
+	{"svn+ssh.x-1://ok.example.com/", 1},
+	{"/go?u=http://ok.example.com/", 0},
+	{"/", 0},
+	{"ok.example.com:443", 0},
+	{"1http://ok.example.com/", 0},
+	{"http:/ok.example.com/", 0},
+	{"://ok.example.com/", 0},
+	{"", 0},
+};
+
+static const filter_index_enum indexes[] = {FILTER_INDEX_SQLITE, FILTER_INDEX_HASH, FILTER_INDEX_COMPACT};
+static const char *index_names[] = {"sqlite", "hash", "compact"};
+
+static int make_db(const char *path, const char *sql) {
+	unlink(path);
+	sqlite3 *db;
+	int res = sqlite3_open(path, &db);
+	if (res == SQLITE_OK) res = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	if (res != SQLITE_OK) fprintf(stderr, "db: %s\n", sqlite3_errmsg(db));
+	sqlite3_close(db);
+	return (res != SQLITE_OK);
+}
+
+static int check(const filter_struct *filter, const char *index_name, double bloom_fpr, const check_case_struct *c) {
+	filter_uri_struct uri = {c->uri, strlen(c->uri), c->uri_is_authority, c->group};
+	filter_uri_result_enum result = filter_uri_is_allowed_in_group_n(
+		filter, c->group, c->uri, strlen(c->uri), c->uri_is_authority
+	);
+	filter_uri_result_enum batch_result;
+	filter_uris_are_allowed(filter, &uri, 1, &batch_result);
+	unsigned int denied_category = 0;
+	if (! filter_uri_denied_category_in_group_n(
+		filter, c->group, c->uri, strlen(c->uri), c->uri_is_authority, &denied_category
+	)) {
+		denied_category = 0;
+	}
+	if (result == c->expected && batch_result == c->expected && denied_category == c->denied_category) return 0;
+	printf(
+		"FAIL index %s bloom_fpr %g suffix_match %d group %u %s: %s, batch %s, category %u, expected %s, category %u\n",
+		index_name, bloom_fpr, c->suffix_match, c->group, c->uri,
+		result_names[result], result_names[batch_result], denied_category,
+		result_names[c->expected], c->denied_category
+	);
+	return 1;
+}
+
+int main(void) {
+	char path[] = "/tmp/filter_check_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {perror("mkstemp"); return 2;}
+	close(fd);
+
+	size_t failures = 0;
+	size_t checks = 0;
+	for (size_t i=0; i<sizeof(absolute_cases)/sizeof(absolute_cases[0]); ++i) {
+		const absolute_case_struct *c = &absolute_cases[i];
+		int is_absolute = filter_uri_is_absolute_n(c->uri, strlen(c->uri));
+		if (is_absolute != c->is_absolute) {
+			printf("FAIL absolute %s: %d, expected %d\n", c->uri, is_absolute, c->is_absolute);
+			++failures;
+		}
+		++checks;
+	}
+	size_t cases_number = sizeof(cases) / sizeof(cases[0]);
+	for (size_t i=0; i<cases_number; ++i) {
+		const check_case_struct *c = &cases[i];
+		if ((i == 0 || c->sql != cases[i-1].sql) && make_db(path, c->sql)) {unlink(path); return 2;}
+		for (size_t j=0; j<sizeof(indexes)/sizeof(indexes[0]); ++j) {
+			for (int bloom=0; bloom<=(indexes[j] == FILTER_INDEX_SQLITE); ++bloom) {
+				filter_config_struct config;
+				memset(&config, 0, sizeof(config));
+				config.index = indexes[j];
+				config.suffix_match = c->suffix_match;
+				config.bloom_fpr = (bloom ? 0.01 : 0);
+				filter_struct *filter = filter_construct(path, &config);
+				if (filter == NULL) {
+					printf("FAIL index %s: filter_construct\n", index_names[j]);
+					++failures;
+					continue;
+				}
+				failures += check(filter, index_names[j], config.bloom_fpr, c);
+				++checks;
+				filter_destruct(filter);
+			}
+		}
+	}
+	unlink(path);
+	printf("%zu checks, %zu failed\n", checks, failures);
+	return (failures != 0);
+}
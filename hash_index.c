@@ -0,0 +1,271 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash_index.h"
+
+// Flat open-addressing table with linear probing.
+// Keys are kept in one contiguous arena and referenced from slots by offset,
+// so a lookup costs one hash and usually one cache line of slots.
+
+#define KEY_REF_SIZE_BITS 16
+#define KEY_REF_SIZE_MASK ((1ULL << KEY_REF_SIZE_BITS) - 1)
+#define MIN_CAPACITY 16
+#define MAX_LOAD_NUM 1
+#define MAX_LOAD_DEN 2
+
+typedef struct {
+	uint32_t tag;                 // upper half of key hash
+	hash_index_value_type value;
+	uint64_t key_ref;             // (key offset << 16) | key size, 0 -- empty slot
+} slot_type;
+
+struct hash_index_struct_ {
+	slot_type *slots;
+	size_t mask;                  // capacity - 1, capacity is power of 2
+	size_t count;
+	char *keys;
+	size_t keys_size;
+	size_t keys_capacity;
+	bool owns_memory;
+};
+
+static hash_index_hash_type key_hash(const char *key, size_t key_size) {
+	hash_index_hash_type h = HASH_INDEX_HASH_INIT;
+	for (size_t i=key_size; i>0; --i) h = hash_index_hash_step(h, key[i-1]);
+	return hash_index_hash_finish(h);
+}
+
+static size_t capacity_for(size_t count) {
+	size_t capacity = MIN_CAPACITY;
+	while (capacity * MAX_LOAD_NUM < count * MAX_LOAD_DEN) capacity *= 2;
+	return capacity;
+}
+
+hash_index_struct *hash_index_construct(size_t expected_count) {
+	hash_index_struct *index = malloc(sizeof(hash_index_struct));
+	if (index == NULL) return NULL;
+	size_t capacity = capacity_for(expected_count);
+	index->slots = calloc(capacity, sizeof(slot_type));
+	if (index->slots == NULL) {free(index); return NULL;}
+	index->mask = capacity - 1;
+	index->count = 0;
+	// offset 0 is never used so that key_ref of a filled slot is never 0
+	index->keys_capacity = 4096;
+	index->keys = malloc(index->keys_capacity);
+	if (index->keys == NULL) {free(index->slots); free(index); return NULL;}
+	index->keys_size = 1;
+	index->owns_memory = true;
+	return index;
+}
+
+hash_index_struct *hash_index_attach(const hash_index_raw_struct *raw) {
+	size_t capacity = raw->slots_size / sizeof(slot_type);
+	if (capacity * sizeof(slot_type) != raw->slots_size) return NULL;
+	if (capacity < MIN_CAPACITY || (capacity & (capacity - 1)) != 0) return NULL;
+	if (raw->count * MAX_LOAD_DEN > capacity * MAX_LOAD_NUM) return NULL;
+	if (raw->keys_size == 0) return NULL;
+	// lookups follow key refs and probe until an empty slot, both must hold for any memory
+	const slot_type *slots = raw->slots;
+	size_t count = 0;
+	for (size_t i=0; i<capacity; ++i) {
+		uint64_t key_ref = slots[i].key_ref;
+		if (key_ref == 0) continue;
+		uint64_t key_offset = key_ref >> KEY_REF_SIZE_BITS;
+		uint64_t key_size = key_ref & KEY_REF_SIZE_MASK;
+		if (key_offset == 0 || key_offset > raw->keys_size || key_size > raw->keys_size - key_offset) return NULL;
+		++count;
+	}
+	if (count != raw->count || count == capacity) return NULL;
+	hash_index_struct *index = malloc(sizeof(hash_index_struct));
+	if (index == NULL) return NULL;
+	index->slots = (slot_type *)raw->slots;
+	index->mask = capacity - 1;
+	index->count = raw->count;
+	index->keys = (char *)raw->keys;
+	index->keys_size = raw->keys_size;
+	index->keys_capacity = raw->keys_size;
+	index->owns_memory = false;
+	return index;
+}
+
+hash_index_struct *hash_index_clone(const hash_index_struct *index) {
+	hash_index_struct *clone = malloc(sizeof(hash_index_struct));
+	if (clone == NULL) return NULL;
+	size_t capacity = index->mask + 1;
+	clone->slots = malloc(capacity * sizeof(slot_type));
+	if (clone->slots == NULL) {free(clone); return NULL;}
+	memcpy(clone->slots, index->slots, capacity * sizeof(slot_type));
+	clone->mask = index->mask;
+	clone->count = index->count;
+	clone->keys_capacity = index->keys_size;
+	clone->keys = malloc(clone->keys_capacity);
+	if (clone->keys == NULL) {free(clone->slots); free(clone); return NULL;}
+	memcpy(clone->keys, index->keys, index->keys_size);
+	clone->keys_size = index->keys_size;
+	clone->owns_memory = true;
+	return clone;
+}
+
+void hash_index_destruct(hash_index_struct *index) {
+	if (index->owns_memory) {
+		free(index->keys);
+		free(index->slots);
+	}
+	free(index);
+}
+
+void hash_index_get_raw(const hash_index_struct *index, hash_index_raw_struct *raw_out) {
+	raw_out->slots = index->slots;
+	raw_out->slots_size = (index->mask + 1) * sizeof(slot_type);
+	raw_out->keys = index->keys;
+	raw_out->keys_size = index->keys_size;
+	raw_out->count = index->count;
+}
+
+static const char *slot_key(const hash_index_struct *index, const slot_type *slot, size_t *key_size_out) {
+	*key_size_out = slot->key_ref & KEY_REF_SIZE_MASK;
+	return index->keys + (slot->key_ref >> KEY_REF_SIZE_BITS);
+}
+
+static slot_type *find_slot(const hash_index_struct *index, const char *key, size_t key_size, hash_index_hash_type hash) {
+	uint32_t tag = hash >> 32;
+	size_t i = hash & index->mask;
+	while (1) {
+		slot_type *slot = &index->slots[i];
+		if (slot->key_ref == 0) return slot;
+		if (slot->tag == tag) {
+			size_t slot_key_size;
+			const char *slot_key_data = slot_key(index, slot, &slot_key_size);
+			if (slot_key_size == key_size && memcmp(slot_key_data, key, key_size) == 0) return slot;
+		}
+		i = (i + 1) & index->mask;
+	}
+}
+
+static int grow(hash_index_struct *index) {
+	size_t capacity = (index->mask + 1) * 2;
+	slot_type *slots = calloc(capacity, sizeof(slot_type));
+	if (slots == NULL) return 1;
+	slot_type *old_slots = index->slots;
+	size_t old_capacity = index->mask + 1;
+	index->slots = slots;
+	index->mask = capacity - 1;
+	for (size_t i=0; i<old_capacity; ++i) {
+		slot_type *old_slot = &old_slots[i];
+		if (old_slot->key_ref == 0) continue;
+		size_t key_size;
+		const char *key = slot_key(index, old_slot, &key_size);
+		*find_slot(index, key, key_size, key_hash(key, key_size)) = *old_slot;
+	}
+	free(old_slots);
+	return 0;
+}
+
+static int store_key(hash_index_struct *index, const char *key, size_t key_size, uint64_t *key_ref_out) {
+	if (index->keys_size + key_size > index->keys_capacity) {
+		size_t keys_capacity = index->keys_capacity;
+		while (index->keys_size + key_size > keys_capacity) keys_capacity *= 2;
+		char *keys = realloc(index->keys, keys_capacity);
+		if (keys == NULL) return 1;
+		index->keys = keys;
+		index->keys_capacity = keys_capacity;
+	}
+	memcpy(index->keys + index->keys_size, key, key_size);
+	*key_ref_out = ((uint64_t)index->keys_size << KEY_REF_SIZE_BITS) | key_size;
+	index->keys_size += key_size;
+	return 0;
+}
+
+static hash_index_put_result_enum put(
+		hash_index_struct *index,
+		const char *key, size_t key_size,
+		hash_index_value_type value, bool replace, hash_index_value_type *existing_out
+) {
+	assert(index->owns_memory);
+	assert(key_size > 0 && key_size <= HASH_INDEX_KEY_SIZE_MAX);
+	hash_index_hash_type hash = key_hash(key, key_size);
+	slot_type *slot = find_slot(index, key, key_size, hash);
+	if (slot->key_ref != 0) {
+		if (existing_out != NULL) *existing_out = slot->value;
+		if (replace) slot->value = value;
+		return HIPR_EXISTS;
+	}
+	if ((index->count + 1) * MAX_LOAD_DEN > (index->mask + 1) * MAX_LOAD_NUM) {
+		if (grow(index)) return HIPR_ERROR;
+		slot = find_slot(index, key, key_size, hash);
+	}
+	uint64_t key_ref;
+	if (store_key(index, key, key_size, &key_ref)) return HIPR_ERROR;
+	slot->tag = hash >> 32;
+	slot->value = value;
+	slot->key_ref = key_ref;
+	++index->count;
+	return HIPR_INSERTED;
+}
+
+hash_index_put_result_enum hash_index_put(
+		hash_index_struct *index,
+		const char *key, size_t key_size,
+		hash_index_value_type value, hash_index_value_type *existing_out
+) {
+	return put(index, key, key_size, value, false, existing_out);
+}
+
+hash_index_put_result_enum hash_index_set(
+		hash_index_struct *index,
+		const char *key, size_t key_size,
+		hash_index_value_type value
+) {
+	return put(index, key, key_size, value, true, NULL);
+}
+
+bool hash_index_get(
+		const hash_index_struct *index,
+		const char *key, size_t key_size,
+		hash_index_value_type *value_out
+) {
+	return hash_index_get_hashed(index, key, key_size, key_hash(key, key_size), value_out);
+}
+
+bool hash_index_get_hashed(
+		const hash_index_struct *index,
+		const char *key, size_t key_size, hash_index_hash_type hash,
+		hash_index_value_type *value_out
+) {
+	if (key_size == 0 || key_size > HASH_INDEX_KEY_SIZE_MAX) return false;
+	const slot_type *slot = find_slot(index, key, key_size, hash);
+	if (slot->key_ref == 0) return false;
+	*value_out = slot->value;
+	return true;
+}
+
+void hash_index_prefetch(const hash_index_struct *index, hash_index_hash_type hash) {
+	__builtin_prefetch(&index->slots[hash & index->mask]);
+}
+
+void hash_index_prefetch_key(const hash_index_struct *index, hash_index_hash_type hash) {
+	const slot_type *slot = &index->slots[hash & index->mask];
+	if (slot->key_ref != 0 && slot->tag == (uint32_t)(hash >> 32)) {
+		__builtin_prefetch(index->keys + (slot->key_ref >> KEY_REF_SIZE_BITS));
+	}
+}
+
+size_t hash_index_count(const hash_index_struct *index) {
+	return index->count;
+}
+
+bool hash_index_next(
+		const hash_index_struct *index, size_t *position_inout,
+		const char **key_out, size_t *key_size_out, hash_index_value_type *value_out
+) {
+	for (size_t i=*position_inout; i<=index->mask; ++i) {
+		const slot_type *slot = &index->slots[i];
+		if (slot->key_ref == 0) continue;
+		*key_out = slot_key(index, slot, key_size_out);
+		*value_out = slot->value;
+		*position_inout = i + 1;
+		return true;
+	}
+	*position_inout = index->mask + 1;
+	return false;
+}
@@ -0,0 +1,99 @@
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint32_t hash_index_value_type;
+#define HASH_INDEX_KEY_SIZE_MAX 0xFFFF
+
+// Keys are hashed from the last byte to the first (FNV-1a with murmur3 finalizer),
+// so hashes of all suffixes of a key are computed in one pass over it.
+typedef uint64_t hash_index_hash_type;
+#define HASH_INDEX_HASH_INIT 0xcbf29ce484222325ULL
+
+static inline hash_index_hash_type hash_index_hash_step(hash_index_hash_type h, char c) {
+	return (h ^ (unsigned char)c) * 0x100000001b3ULL;
+}
+
+static inline hash_index_hash_type hash_index_hash_finish(hash_index_hash_type h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+struct hash_index_struct_;
+typedef struct hash_index_struct_ hash_index_struct;
+
+// Raw memory of index: used to save index and to attach saved one.
+// Keys are referenced from slots by offset, so memory is position-independent.
+typedef struct {
+	const void *slots;
+	size_t slots_size;
+	const char *keys;
+	size_t keys_size;
+	size_t count;
+} hash_index_raw_struct;
+
+typedef enum {
+	HIPR_INSERTED,
+	HIPR_EXISTS,
+	HIPR_ERROR
+} hash_index_put_result_enum;
+
+hash_index_struct *hash_index_construct(size_t expected_count);
+// read-only index over memory owned by caller, NULL if raw memory is malformed;
+// every slot is checked, so that lookups in corrupt memory neither loop nor read out of it
+hash_index_struct *hash_index_attach(const hash_index_raw_struct *raw);
+// writable copy of any index, also of attached one
+hash_index_struct *hash_index_clone(const hash_index_struct *index);
+void hash_index_destruct(hash_index_struct *index);
+void hash_index_get_raw(const hash_index_struct *index, hash_index_raw_struct *raw_out);
+// on HIPR_EXISTS the value already stored for the key is written to existing_out
+hash_index_put_result_enum hash_index_put(
+	hash_index_struct *index,
+	const char *key, size_t key_size,
+	hash_index_value_type value, hash_index_value_type *existing_out
+);
+// like hash_index_put(), but value of existing key is replaced
+hash_index_put_result_enum hash_index_set(
+	hash_index_struct *index,
+	const char *key, size_t key_size,
+	hash_index_value_type value
+);
+bool hash_index_get(
+	const hash_index_struct *index,
+	const char *key, size_t key_size,
+	hash_index_value_type *value_out
+);
+// hash -- hash_index_hash_finish() of key state
+bool hash_index_get_hashed(
+	const hash_index_struct *index,
+	const char *key, size_t key_size, hash_index_hash_type hash,
+	hash_index_value_type *value_out
+);
+size_t hash_index_count(const hash_index_struct *index);
+// Iterates over entries in slot order: *position_inout is 0 before the first call,
+// returns false after the last entry.
+bool hash_index_next(
+	const hash_index_struct *index, size_t *position_inout,
+	const char **key_out, size_t *key_size_out, hash_index_value_type *value_out
+);
+// Batch lookups: prefetch home slot of key, then (after other work) the key
+// stored in it, so that misses of several lookups overlap. Nothing is checked.
+void hash_index_prefetch(const hash_index_struct *index, hash_index_hash_type hash);
+void hash_index_prefetch_key(const hash_index_struct *index, hash_index_hash_type hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*HASH_INDEX_H*/
@@ -0,0 +1,40 @@
+#include "histogram.h"
+
+uint64_t histogram_bucket_low(size_t bucket) {
+	if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+	unsigned int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	uint64_t top = HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS;
+	return top << shift;
+}
+
+uint64_t histogram_bucket_high(size_t bucket) {
+	if (bucket + 1 == HISTOGRAM_BUCKETS) return UINT64_MAX;
+	return histogram_bucket_low(bucket + 1) - 1;
+}
+
+void histogram_add(histogram_struct *to, const histogram_struct *from) {
+	for (size_t i=0; i<HISTOGRAM_BUCKETS; ++i) {
+		to->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t histogram_count(const histogram_struct *histogram) {
+	uint64_t count = 0;
+	for (size_t i=0; i<HISTOGRAM_BUCKETS; ++i) count += histogram->counts[i];
+	return count;
+}
+
+uint64_t histogram_value_at_quantile(const histogram_struct *histogram, double quantile) {
+	uint64_t count = histogram_count(histogram);
+	if (count == 0) return 0;
+	// rank of the value, 1-based
+	uint64_t rank = (uint64_t)(quantile * count + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank > count) rank = count;
+	uint64_t seen = 0;
+	for (size_t i=0; i<HISTOGRAM_BUCKETS; ++i) {
+		seen += histogram->counts[i];
+		if (seen >= rank) return histogram_bucket_high(i);
+	}
+	return histogram_bucket_high(HISTOGRAM_BUCKETS - 1);
+}
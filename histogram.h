@@ -0,0 +1,47 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Log-linear histogram (HDR style): each power of two is split into
+// 2^HISTOGRAM_SUB_BITS buckets, so recorded values are kept with about 6% precision.
+// Histogram is written by one thread and may be read by others at the same time.
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+} histogram_struct;
+
+static inline size_t histogram_bucket(uint64_t value) {
+	if (value < HISTOGRAM_SUB_BUCKETS) return value;
+	unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+static inline void histogram_record(histogram_struct *histogram, uint64_t value) {
+	uint64_t *count = &histogram->counts[histogram_bucket(value)];
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+// lowest and highest values counted in bucket
+uint64_t histogram_bucket_low(size_t bucket);
+uint64_t histogram_bucket_high(size_t bucket);
+// to += from, from may be written meanwhile
+void histogram_add(histogram_struct *to, const histogram_struct *from);
+uint64_t histogram_count(const histogram_struct *histogram);
+// highest value of bucket holding given quantile (0..1), 0 if histogram is empty
+uint64_t histogram_value_at_quantile(const histogram_struct *histogram, double quantile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*HISTOGRAM_H*/
@@ -1,14 +1,24 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sqlite3.h>
+#include "category_blob.h"
 
-#define MAX_CATEGS_NUMBER 512
-#define MAX_CATEG_DEC_SIZE 3
+// Rows are generated by worker threads in chunks and appended to a temporary
+// staging table, then copied into sites sorted by domain: sorted insertion
+// into WITHOUT ROWID table only appends pages.
+// Each row is generated from its own PRNG stream seeded by (seed, row number),
+// so db does not depend on threads number and trace can regenerate any domain.
+
+#define MAX_CATEGS_NUMBER 4096
+#define MAX_CATEG_DEC_SIZE 4
 #define MAX_CATEGS_OF_DOMAIN 32
 #define MAX_CATEGS_STR_SIZE ((MAX_CATEG_DEC_SIZE+1)*MAX_CATEGS_OF_DOMAIN-1)
 
@@ -20,11 +30,57 @@ static const char domain_symbols[] = "abcdefghijklmnopqrstuvwxyz0123456789.";
 #define DOMAIN_LENGTH_GAMMA_THETA 2.0
 #define DOMAIN_LENGTH_GAMMA_K 11
 
-typedef unsigned int categ_type;
+#define CHUNK_ROWS 65536
+#define CHUNK_BUF_SIZE_INIT (CHUNK_ROWS * 128)
+// trace rows of unlisted domains are numbered from here, far from db rows
+#define UNLISTED_ROWS_BASE (1ULL << 62)
+#define CONNECT_PERCENT 10
+
+typedef uint32_t categ_type;
 #define CATEG_TYPE_MAX UINT_MAX
 typedef unsigned long long int domains_number_type;
 #define DOMAINS_NUMBER_TYPE_MAX ULLONG_MAX
 
+typedef enum {
+	CATEGS_DISTRIBUTION_UNIFORM,
+	CATEGS_DISTRIBUTION_GEOMETRIC
+} categs_distribution_enum;
+
+typedef struct {
+	domains_number_type domains_number;
+	categ_type categs_number;
+	categ_type max_categs_of_domain;
+	categs_distribution_enum categs_distribution;
+	int categs_blob;         // categories as category blob instead of text
+	unsigned int threads_number;
+	uint64_t seed;
+} params_type;
+
+typedef struct {
+	uint64_t state;
+} rng_type;
+
+typedef struct {
+	char *buf;           // domain and categories of each row, not terminated
+	size_t buf_size;
+	size_t used;
+	uint16_t domain_sizes[CHUNK_ROWS];
+	uint16_t categs_sizes[CHUNK_ROWS];
+	size_t rows_number;
+	long long chunk;     // chunk number held, -1 -- slot is free
+	int ready;
+} chunk_slot_type;
+
+typedef struct {
+	const params_type *params;
+	unsigned long long chunks_number;
+	chunk_slot_type *slots;
+	size_t slots_number;
+	unsigned long long next_chunk;  // next chunk to generate
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} generator_type;
+
 void print_err_and_exit(const char *msg) {
 	fprintf(stderr, "error: %s\n", msg);
 	exit(EXIT_FAILURE);
@@ -45,15 +101,44 @@ int sqlite3_do(sqlite3 *db, const char *sql) {
 	return 1;
 }
 
-int create_tables(sqlite3 *db) {
+// splitmix64
+uint64_t rng_next(rng_type *rng) {
+	uint64_t z = (rng->state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+rng_type rng_of_row(uint64_t seed, domains_number_type row) {
+	rng_type rng = {seed * 0xd1342543de82ef95ULL + row};
+	rng.state = rng_next(&rng);
+	return rng;
+}
+
+// uniform in (0, 1]
+double rng_double(rng_type *rng) {
+	return ((rng_next(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// uniform in [0, n)
+uint64_t rng_below(rng_type *rng, uint64_t n) {
+	return (uint64_t)(((unsigned __int128)rng_next(rng) * n) >> 64);
+}
+
+int create_tables(sqlite3 *db, const params_type *params) {
 	if (sqlite3_do(db, "BEGIN TRANSACTION")) return 1;
 	if (sqlite3_do(db, "DROP TABLE IF EXISTS sites")) return 1;
 	if (sqlite3_do(
 		db,
+		params->categs_blob ?
+		"CREATE TABLE sites (\n"
+		"	domain TEXT PRIMARY KEY NOT NULL,\n"
+		"	categories BLOB NOT NULL\n"
+		") WITHOUT ROWID" :
 		"CREATE TABLE sites (\n"
 		"	domain TEXT PRIMARY KEY NOT NULL,\n"
 		"	categories TEXT NOT NULL\n"
-		")"
+		") WITHOUT ROWID"
 	)) return 1;
 	if (sqlite3_do(db, "DROP TABLE IF EXISTS rules")) return 1;
 	if (sqlite3_do(
@@ -67,8 +152,8 @@ int create_tables(sqlite3 *db) {
 	return 0;
 }
 
-int fill_rules(sqlite3 *db, categ_type categs_number) {
-	assert(categs_number > 0 && categs_number < CATEG_TYPE_MAX);
+int fill_rules(sqlite3 *db, const params_type *params) {
+	assert(params->categs_number > 0 && params->categs_number < CATEG_TYPE_MAX);
 	int res;
 	if (sqlite3_do(db, "BEGIN TRANSACTION")) return 1;
 
@@ -77,9 +162,10 @@ int fill_rules(sqlite3 *db, categ_type categs_number) {
 	res = sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
 	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); return 1;}
 
-	for (categ_type i=0; i<categs_number; ++i) {
+	rng_type rng = rng_of_row(params->seed, DOMAINS_NUMBER_TYPE_MAX);
+	for (categ_type i=0; i<params->categs_number; ++i) {
 		categ_type categ = i + 1;
-		int allowed = rand() & 1;
+		int allowed = rng_next(&rng) & 1;
 
 		res = sqlite3_bind_int(stmt, 1, categ);
 		if (res != SQLITE_OK) {print_sqlite3_sql_err("bind_int(1)", sql, res); return 1;}
@@ -98,23 +184,23 @@ int fill_rules(sqlite3 *db, categ_type categs_number) {
 	return 0;
 }
 
-unsigned int rand_gamma_distributed(double theta, unsigned int k) {
+unsigned int rand_gamma_distributed(rng_type *rng, double theta, unsigned int k) {
 	assert(theta > 0);
 	assert(k > 0);
 	double value = 0;
-	for (unsigned int i=0; i<k; ++i) value += log((double)RAND_MAX+1.0) - log((double)rand()+1.0);
+	for (unsigned int i=0; i<k; ++i) value -= log(rng_double(rng));
 	return lrint(value * theta);
 }
 
-size_t generate_random_domain(char domain[MAX_DOMAIN_LENGTH]) {
+size_t generate_random_domain(rng_type *rng, char domain[MAX_DOMAIN_LENGTH]) {
 	size_t domain_length;
 	do {
-		domain_length = rand_gamma_distributed(DOMAIN_LENGTH_GAMMA_THETA, DOMAIN_LENGTH_GAMMA_K);
+		domain_length = rand_gamma_distributed(rng, DOMAIN_LENGTH_GAMMA_THETA, DOMAIN_LENGTH_GAMMA_K);
 	} while (!(domain_length >= MIN_DOMAIN_LENGTH && domain_length <= MAX_DOMAIN_LENGTH));
 
 	unsigned int dots_count = 0;
 	for (size_t i=0; i<domain_length; ++i) {
-		size_t symbol_idx = rand() % (
+		size_t symbol_idx = rng_below(rng,
 			i != 0 && i != domain_length-1 ?
 			DOMAIN_SYMBOLS_NUMBER :
 			DOMAIN_SYMBOLS_NUMBER_NO_DOT
@@ -126,7 +212,7 @@ size_t generate_random_domain(char domain[MAX_DOMAIN_LENGTH]) {
 	if (dots_count == 0) {
 		size_t dot_idx;
 		do {
-			dot_idx = rand() % (domain_length-2) + 1;
+			dot_idx = rng_below(rng, domain_length-2) + 1;
 		} while (domain[dot_idx-1] == '.' || domain[dot_idx+1] == '.');
 		domain[dot_idx] = '.';
 	}
@@ -134,85 +220,231 @@ size_t generate_random_domain(char domain[MAX_DOMAIN_LENGTH]) {
 	return domain_length;
 }
 
-size_t generate_random_categs(char categs_str[MAX_CATEGS_STR_SIZE+1], size_t all_categs_number) {
-	static int categs[MAX_CATEGS_NUMBER];
-	for (categ_type i=0; i<all_categs_number; ++i) categs[i] = 0;
-	categ_type cur_categs_number = (rand() % MAX_CATEGS_OF_DOMAIN) + 1;
+static int categ_compare(const void *a, const void *b) {
+	categ_type x = *(const categ_type *)a, y = *(const categ_type *)b;
+	return (x > y) - (x < y);
+}
+
+size_t generate_random_categs(rng_type *rng, char categs_str[MAX_CATEGS_STR_SIZE+1], const params_type *params) {
+	categ_type cur_categs_number;
+	if (params->categs_distribution == CATEGS_DISTRIBUTION_GEOMETRIC) {
+		// each next category with probability 1/2
+		cur_categs_number = 1;
+		while (cur_categs_number < params->max_categs_of_domain && (rng_next(rng) & 1)) ++cur_categs_number;
+	} else {
+		cur_categs_number = rng_below(rng, params->max_categs_of_domain) + 1;
+	}
+	if (cur_categs_number > params->categs_number) cur_categs_number = params->categs_number;
+
+	categ_type categs[MAX_CATEGS_OF_DOMAIN];
 	for (categ_type i=0; i<cur_categs_number; ++i) {
-		categ_type idx;
+		int repeated;
 		do {
-			idx = rand() % all_categs_number;
-		} while (categs[idx]);
-		categs[idx] = 1;
+			categs[i] = rng_below(rng, params->categs_number) + 1;
+			repeated = 0;
+			for (categ_type j=0; j<i; ++j) repeated |= (categs[j] == categs[i]);
+		} while (repeated);
 	}
+	qsort(categs, cur_categs_number, sizeof(categs[0]), categ_compare);
+
+	if (params->categs_blob) return category_blob_encode(categs, cur_categs_number, (uint8_t *)categs_str);
 	char *str = categs_str;
-	categ_type i, j;
-	for (i=0, j=0; i<all_categs_number; ++i) {
-		if (categs[i]) {
-			str += sprintf(str, "%u", i+1);
-			++j;
-			if (j < cur_categs_number) str += sprintf(str, ",");
-		}
+	for (categ_type i=0; i<cur_categs_number; ++i) {
+		str += sprintf(str, i == 0 ? "%u" : ",%u", categs[i]);
 	}
 	return str - categs_str;
 }
 
-int fill_sites(sqlite3 *db, categ_type categs_number, domains_number_type domains_number) {
-	assert(domains_number > 0 && domains_number < DOMAINS_NUMBER_TYPE_MAX);
-	assert(categs_number > 0 && categs_number <= MAX_CATEGS_NUMBER);
+void generate_chunk(const params_type *params, unsigned long long chunk, chunk_slot_type *slot) {
+	domains_number_type first = chunk * CHUNK_ROWS;
+	domains_number_type last = first + CHUNK_ROWS;
+	if (last > params->domains_number) last = params->domains_number;
+	slot->used = 0;
+	slot->rows_number = 0;
+	for (domains_number_type row=first; row<last; ++row) {
+		size_t room = MAX_DOMAIN_LENGTH + MAX_CATEGS_STR_SIZE + 1;
+		if (slot->used + room > slot->buf_size) {
+			slot->buf_size *= 2;
+			slot->buf = realloc(slot->buf, slot->buf_size);
+			if (slot->buf == NULL) print_err_and_exit("realloc");
+		}
+		rng_type rng = rng_of_row(params->seed, row);
+		size_t domain_size = generate_random_domain(&rng, slot->buf + slot->used);
+		size_t categs_size = generate_random_categs(&rng, slot->buf + slot->used + domain_size, params);
+		slot->domain_sizes[slot->rows_number] = domain_size;
+		slot->categs_sizes[slot->rows_number] = categs_size;
+		slot->used += domain_size + categs_size;
+		++slot->rows_number;
+	}
+}
+
+void *generator_run(void *ptr) {
+	generator_type *generator = ptr;
+	pthread_mutex_lock(&generator->mutex);
+	while (generator->next_chunk < generator->chunks_number) {
+		unsigned long long chunk = generator->next_chunk;
+		chunk_slot_type *slot = &generator->slots[chunk % generator->slots_number];
+		if (slot->chunk != -1) {
+			// slot is still used by previous chunk
+			pthread_cond_wait(&generator->cond, &generator->mutex);
+			continue;
+		}
+		++generator->next_chunk;
+		slot->chunk = chunk;
+		pthread_mutex_unlock(&generator->mutex);
+		generate_chunk(generator->params, chunk, slot);
+		pthread_mutex_lock(&generator->mutex);
+		slot->ready = 1;
+		pthread_cond_broadcast(&generator->cond);
+	}
+	pthread_mutex_unlock(&generator->mutex);
+	return NULL;
+}
+
+int bind_categs(sqlite3_stmt *stmt, int param, const char *categs, size_t categs_size, const params_type *params) {
+	if (params->categs_blob) return sqlite3_bind_blob(stmt, param, categs, categs_size, SQLITE_STATIC);
+	return sqlite3_bind_text(stmt, param, categs, categs_size, SQLITE_STATIC);
+}
+
+int insert_chunk(sqlite3_stmt *stmt, const char *sql, const chunk_slot_type *slot, const params_type *params) {
 	int res;
-	static char domain[MAX_DOMAIN_LENGTH];
-	static char categs_list[MAX_CATEGS_STR_SIZE+1];
+	const char *cur = slot->buf;
+	for (size_t i=0; i<slot->rows_number; ++i) {
+		res = sqlite3_bind_text(stmt, 1, cur, slot->domain_sizes[i], SQLITE_STATIC);
+		if (res != SQLITE_OK) {print_sqlite3_sql_err("bind_text(1)", sql, res); return 1;}
+		cur += slot->domain_sizes[i];
+		res = bind_categs(stmt, 2, cur, slot->categs_sizes[i], params);
+		if (res != SQLITE_OK) {print_sqlite3_sql_err("bind_categs(2)", sql, res); return 1;}
+		cur += slot->categs_sizes[i];
+		res = sqlite3_step(stmt);
+		if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); return 1;}
+		res = sqlite3_reset(stmt);
+		if (res != SQLITE_OK) {print_sqlite3_sql_err("reset", sql, res); return 1;}
+	}
+	return 0;
+}
+
+// generated rows in chunk order into staging table
+int fill_staging(sqlite3 *db, const params_type *params) {
+	int res;
+	int fill_res = 1;
+	generator_type generator;
+	generator.params = params;
+	generator.chunks_number = (params->domains_number + CHUNK_ROWS - 1) / CHUNK_ROWS;
+	generator.slots_number = params->threads_number * 2;
+	generator.next_chunk = 0;
+	generator.slots = calloc(generator.slots_number, sizeof(chunk_slot_type));
+	if (generator.slots == NULL) print_err_and_exit("calloc");
+	for (size_t i=0; i<generator.slots_number; ++i) {
+		generator.slots[i].buf_size = CHUNK_BUF_SIZE_INIT;
+		generator.slots[i].buf = malloc(CHUNK_BUF_SIZE_INIT);
+		if (generator.slots[i].buf == NULL) print_err_and_exit("malloc");
+		generator.slots[i].chunk = -1;
+	}
+	pthread_mutex_init(&generator.mutex, NULL);
+	pthread_cond_init(&generator.cond, NULL);
 
 	sqlite3_stmt *stmt;
-	const char *sql = "INSERT INTO sites(domain, categories) VALUES (?, ?)";
+	const char *sql = "INSERT INTO staging(domain, categories) VALUES (?, ?)";
 	res = sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
-	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); return 1;}
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); goto err_free;}
 
-	if (sqlite3_do(db, "BEGIN TRANSACTION")) return 1;
-	for (domains_number_type counter=0; counter<domains_number; ++counter) {
-		int step_res;
-		do {
-			size_t domain_length = generate_random_domain(domain);
-			size_t categs_list_length = generate_random_categs(categs_list, categs_number);
-
-			res = sqlite3_bind_text(stmt, 1, domain, domain_length*sizeof(domain[0]), NULL);
-			if (res != SQLITE_OK) {print_sqlite3_sql_err("bind_bind_text(1)", sql, res); return 1;}
-			res = sqlite3_bind_text(stmt, 2, categs_list, categs_list_length*sizeof(categs_list[0]), NULL);
-			if (res != SQLITE_OK) {print_sqlite3_sql_err("bind_bind_text(2)", sql, res); return 1;}
-			step_res = sqlite3_step(stmt);
-			if (!(
-				step_res == SQLITE_DONE ||
-				(
-					step_res == SQLITE_CONSTRAINT &&
-					sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_PRIMARYKEY
-				)
-			)) {
-				return 1;
-			}
-			res = sqlite3_reset(stmt);
-			if (!(res == SQLITE_OK || (step_res == SQLITE_CONSTRAINT && res == SQLITE_CONSTRAINT))) {
-				print_sqlite3_sql_err("reset", sql, res);
-				return 1;
-			}
-		} while(step_res == SQLITE_CONSTRAINT);
+	pthread_t *threads = calloc(params->threads_number, sizeof(pthread_t));
+	if (threads == NULL) print_err_and_exit("calloc");
+	for (unsigned int i=0; i<params->threads_number; ++i) {
+		if (pthread_create(&threads[i], NULL, generator_run, &generator) != 0) print_err_and_exit("pthread_create");
 	}
-	if (sqlite3_do(db, "COMMIT")) return 1;
+
+	int insert_res = 0;
+	for (unsigned long long chunk=0; chunk<generator.chunks_number; ++chunk) {
+		chunk_slot_type *slot = &generator.slots[chunk % generator.slots_number];
+		pthread_mutex_lock(&generator.mutex);
+		while (!(slot->chunk == (long long)chunk && slot->ready)) pthread_cond_wait(&generator.cond, &generator.mutex);
+		pthread_mutex_unlock(&generator.mutex);
+		// after error the rest of chunks are consumed without inserting so that generators finish
+		if (insert_res == 0) insert_res = insert_chunk(stmt, sql, slot, params);
+		pthread_mutex_lock(&generator.mutex);
+		slot->chunk = -1;
+		slot->ready = 0;
+		pthread_cond_broadcast(&generator.cond);
+		pthread_mutex_unlock(&generator.mutex);
+	}
+	for (unsigned int i=0; i<params->threads_number; ++i) pthread_join(threads[i], NULL);
+	free(threads);
 
+	res = sqlite3_finalize(stmt);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); goto err_free;}
+	fill_res = insert_res;
+
+err_free:
+	pthread_cond_destroy(&generator.cond);
+	pthread_mutex_destroy(&generator.mutex);
+	for (size_t i=0; i<generator.slots_number; ++i) free(generator.slots[i].buf);
+	free(generator.slots);
+	return fill_res;
+}
+
+// Random domains rarely repeat: repeated rows are dropped and replaced
+// by rows numbered after domains_number until sites has domains_number rows.
+int top_up_sites(sqlite3 *db, const params_type *params, domains_number_type sites_number) {
+	int res;
+	sqlite3_stmt *stmt;
+	const char *sql = "INSERT OR IGNORE INTO sites(domain, categories) VALUES (?, ?)";
+	res = sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
+	if (res != SQLITE_OK) {print_sqlite3_sql_err("prepare_v2", sql, res); return 1;}
+	static char domain[MAX_DOMAIN_LENGTH];
+	static char categs_list[MAX_CATEGS_STR_SIZE+1];
+	for (domains_number_type row=params->domains_number; sites_number<params->domains_number; ++row) {
+		rng_type rng = rng_of_row(params->seed, row);
+		size_t domain_length = generate_random_domain(&rng, domain);
+		size_t categs_list_length = generate_random_categs(&rng, categs_list, params);
+		res = sqlite3_bind_text(stmt, 1, domain, domain_length, SQLITE_STATIC);
+		if (res != SQLITE_OK) {print_sqlite3_sql_err("bind_text(1)", sql, res); return 1;}
+		res = bind_categs(stmt, 2, categs_list, categs_list_length, params);
+		if (res != SQLITE_OK) {print_sqlite3_sql_err("bind_categs(2)", sql, res); return 1;}
+		res = sqlite3_step(stmt);
+		if (res != SQLITE_DONE) {print_sqlite3_sql_err("step", sql, res); return 1;}
+		sites_number += sqlite3_changes(db);
+		res = sqlite3_reset(stmt);
+		if (res != SQLITE_OK) {print_sqlite3_sql_err("reset", sql, res); return 1;}
+	}
 	res = sqlite3_finalize(stmt);
 	if (res != SQLITE_OK) {print_sqlite3_sql_err("finalize", sql, res); return 1;}
+	return 0;
+}
 
+int fill_sites(sqlite3 *db, const params_type *params) {
+	assert(params->domains_number > 0 && params->domains_number < UNLISTED_ROWS_BASE);
+	assert(params->categs_number > 0 && params->categs_number <= MAX_CATEGS_NUMBER);
+
+	if (sqlite3_do(db, "BEGIN TRANSACTION")) return 1;
+	if (sqlite3_do(db, "CREATE TEMP TABLE staging (domain TEXT NOT NULL, categories TEXT NOT NULL)")) return 1;
+	if (fill_staging(db, params)) return 1;
+	if (sqlite3_do(
+		db,
+		"INSERT OR IGNORE INTO sites(domain, categories) "
+		"SELECT domain, categories FROM staging ORDER BY domain"
+	)) return 1;
+	domains_number_type sites_number = sqlite3_changes64(db);
+	if (sqlite3_do(db, "DROP TABLE staging")) return 1;
+	if (top_up_sites(db, params, sites_number)) return 1;
+	if (sqlite3_do(db, "COMMIT")) return 1;
 	return 0;
 }
 
-int fill_db(sqlite3 *db, categ_type categs_number, domains_number_type domains_number) {
-	if (create_tables(db)) return 1;
-	if (fill_rules(db, categs_number)) return 1;
-	if (fill_sites(db, categs_number, domains_number)) return 1;
+int fill_db(sqlite3 *db, const params_type *params) {
+	// db is written from scratch: crash leaves garbage anyway
+	if (sqlite3_do(db, "PRAGMA journal_mode = OFF")) return 1;
+	if (sqlite3_do(db, "PRAGMA synchronous = OFF")) return 1;
+	if (sqlite3_do(db, "PRAGMA locking_mode = EXCLUSIVE")) return 1;
+	if (sqlite3_do(db, "PRAGMA cache_size = -262144")) return 1;
+	if (create_tables(db, params)) return 1;
+	if (fill_rules(db, params)) return 1;
+	if (fill_sites(db, params)) return 1;
 	return 0;
 }
 
-int make_test_db(const char *db_uri, categ_type categs_number, domains_number_type domains_number) {
+int make_test_db(const char *db_uri, const params_type *params) {
 	sqlite3 *db;
 	int res;
 
@@ -224,23 +456,167 @@ int make_test_db(const char *db_uri, categ_type categs_number, domains_number_ty
 	);
 	if (res != SQLITE_OK) {print_sqlite3_err("open_v2", res); return 1;}
 
-	int fill_db_res = fill_db(db, categs_number, domains_number);
+	int fill_db_res = fill_db(db, params);
 
 	res = sqlite3_close(db);
 	if (res != SQLITE_OK) {print_sqlite3_err("close", res); return 1;}
 	return fill_db_res;
 }
 
+// Zipf distribution over 1..n by rejection-inversion
+// (W. Hormann, G. Derflinger, "Rejection-inversion to generate variates
+// from monotone discrete distributions"), O(1) per sample for any n.
+typedef struct {
+	double exponent;
+	double n;
+	double h_integral_x1;
+	double h_integral_n;
+	double s;
+} zipf_type;
+
+static double zipf_helper1(double x) {
+	return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0/3 - 0.25 * x));
+}
+
+static double zipf_helper2(double x) {
+	return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0/3) * (1 + 0.25 * x));
+}
+
+static double zipf_h(const zipf_type *zipf, double x) {
+	return exp(-zipf->exponent * log(x));
+}
+
+static double zipf_h_integral(const zipf_type *zipf, double x) {
+	double log_x = log(x);
+	return zipf_helper2((1 - zipf->exponent) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inverse(const zipf_type *zipf, double x) {
+	double t = x * (1 - zipf->exponent);
+	if (t < -1) t = -1;
+	return exp(zipf_helper1(t) * x);
+}
+
+void zipf_init(zipf_type *zipf, domains_number_type n, double exponent) {
+	zipf->exponent = exponent;
+	zipf->n = n;
+	zipf->h_integral_x1 = zipf_h_integral(zipf, 1.5) - 1;
+	zipf->h_integral_n = zipf_h_integral(zipf, n + 0.5);
+	zipf->s = 2 - zipf_h_integral_inverse(zipf, zipf_h_integral(zipf, 2.5) - zipf_h(zipf, 2));
+}
+
+domains_number_type zipf_sample(const zipf_type *zipf, rng_type *rng) {
+	while (1) {
+		double u = zipf->h_integral_n + rng_double(rng) * (zipf->h_integral_x1 - zipf->h_integral_n);
+		double x = zipf_h_integral_inverse(zipf, u);
+		double k = floor(x + 0.5);
+		if (k < 1) k = 1;
+		else if (k > zipf->n) k = zipf->n;
+		if (k - x <= zipf->s || u >= zipf_h_integral(zipf, k + 0.5) - zipf_h(zipf, k)) {
+			return (domains_number_type)k;
+		}
+	}
+}
+
+// Request lines "<method> <uri>": popularity rank r is db row r-1,
+// whose domain is regenerated from its row stream.
+int write_trace(
+		const char *path, const params_type *params,
+		unsigned long long lines_number, double exponent, unsigned int unlisted_percent
+) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {perror(path); return 1;}
+	zipf_type zipf;
+	zipf_init(&zipf, params->domains_number, exponent);
+	rng_type rng = rng_of_row(params->seed ^ 0x5452414345ULL, 0);
+	static char domain[MAX_DOMAIN_LENGTH + 1];
+	for (unsigned long long i=0; i<lines_number; ++i) {
+		size_t domain_length;
+		if (rng_below(&rng, 100) < unlisted_percent) {
+			rng_type row_rng = rng_of_row(params->seed, UNLISTED_ROWS_BASE + i);
+			domain_length = generate_random_domain(&row_rng, domain);
+			// reserved TLD: never in db
+			if (domain_length > MAX_DOMAIN_LENGTH - 8) domain_length = MAX_DOMAIN_LENGTH - 8;
+			if (domain[domain_length-1] == '.') --domain_length;
+			memcpy(domain + domain_length, ".invalid", 8);
+			domain_length += 8;
+		} else {
+			rng_type row_rng = rng_of_row(params->seed, zipf_sample(&zipf, &rng) - 1);
+			domain_length = generate_random_domain(&row_rng, domain);
+		}
+		domain[domain_length] = '\0';
+		if (rng_below(&rng, 100) < CONNECT_PERCENT) fprintf(f, "CONNECT %s:443\n", domain);
+		else fprintf(f, "GET http://%s/\n", domain);
+	}
+	if (fclose(f) != 0) {perror(path); return 1;}
+	return 0;
+}
+
+static void print_usage_and_exit(void) {
+	print_err_and_exit(
+		"wrong arguments\n"
+		"usage: make_test_db [options] <db_uri> [seed]\n"
+		"  -d <domains>             number of domains (default 1048576)\n"
+		"  -c <categories>          number of categories (default 128, max 4096)\n"
+		"  -k <max>                 max categories of domain (default 32, max 32)\n"
+		"  -D uniform|geometric     number of categories of domain (default uniform)\n"
+		"  -B                       store categories as varint blob instead of text\n"
+		"  -t <threads>             generator threads (default number of CPUs)\n"
+		"  -T <trace_path>          also write request trace\n"
+		"  -n <lines>               trace lines (default 1000000)\n"
+		"  -z <exponent>            Zipf exponent of domain popularity in trace (default 1)\n"
+		"  -u <percent>             trace lines with domains not in db (default 10)"
+	);
+}
+
 int main (int argc, char *argv[]) {
-	if (!(argc >= 2 && argc <= 3)) print_err_and_exit("wrong amount of arguments");
+	params_type params;
+	params.domains_number = 1048576;
+	params.categs_number = 128;
+	params.max_categs_of_domain = MAX_CATEGS_OF_DOMAIN;
+	params.categs_distribution = CATEGS_DISTRIBUTION_UNIFORM;
+	params.categs_blob = 0;
+	long threads_number = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *trace_path = NULL;
+	unsigned long long trace_lines = 1000000;
+	double zipf_exponent = 1;
+	unsigned long unlisted_percent = 10;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:c:k:D:Bt:T:n:z:u:")) != -1) {
+		switch (opt) {
+		case 'd': params.domains_number = strtoull(optarg, NULL, 10); break;
+		case 'c': params.categs_number = strtoul(optarg, NULL, 10); break;
+		case 'k': params.max_categs_of_domain = strtoul(optarg, NULL, 10); break;
+		case 'D':
+			if (strcmp(optarg, "uniform") == 0) params.categs_distribution = CATEGS_DISTRIBUTION_UNIFORM;
+			else if (strcmp(optarg, "geometric") == 0) params.categs_distribution = CATEGS_DISTRIBUTION_GEOMETRIC;
+			else print_usage_and_exit();
+			break;
+		case 'B': params.categs_blob = 1; break;
+		case 't': threads_number = strtol(optarg, NULL, 10); break;
+		case 'T': trace_path = optarg; break;
+		case 'n': trace_lines = strtoull(optarg, NULL, 10); break;
+		case 'z': zipf_exponent = strtod(optarg, NULL); break;
+		case 'u': unlisted_percent = strtoul(optarg, NULL, 10); break;
+		default: print_usage_and_exit();
+		}
+	}
+	if (!(argc - optind >= 1 && argc - optind <= 2)) print_usage_and_exit();
+	if (params.domains_number == 0 || params.domains_number >= UNLISTED_ROWS_BASE) print_usage_and_exit();
+	if (params.categs_number == 0 || params.categs_number > MAX_CATEGS_NUMBER) print_usage_and_exit();
+	if (params.max_categs_of_domain == 0 || params.max_categs_of_domain > MAX_CATEGS_OF_DOMAIN) print_usage_and_exit();
+	if (threads_number < 1 || !(zipf_exponent > 0) || unlisted_percent > 100) print_usage_and_exit();
+	params.threads_number = threads_number;
+
 	unsigned int seed;
-	if (argc == 2) {
+	if (argc - optind == 1) {
 		seed = time(NULL);
 	} else {
-		seed = atoi(argv[2]);
+		seed = atoi(argv[optind + 1]);
 	}
 	printf("seed = %u\n", seed);
-	srand(seed);
-	int res = make_test_db(argv[1], 128, 1048576);
+	params.seed = seed;
+	int res = make_test_db(argv[optind], &params);
+	if (!res && trace_path != NULL) res = write_trace(trace_path, &params, trace_lines, zipf_exponent, unlisted_percent);
 	return (!res ? EXIT_SUCCESS : EXIT_FAILURE);
 }
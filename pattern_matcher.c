@@ -0,0 +1,583 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pattern_matcher.h"
+
+// Trie of all pieces is built first, then its states are renumbered in BFS order
+// and written into one block with failure links: a state is left for its failure
+// state (the longest suffix of it in trie) until an edge with the next byte is found,
+// root has an edge for every byte. BFS order puts failure state before its state,
+// so attach checks that failure chains end by checking fail < state.
+//
+// Patterns of one piece also set STATE_MATCH of the state where piece ends and of
+// states whose failure chain goes through it, so when any pattern counts their scan
+// is one flag test per byte. Pieces of all patterns are outputs of states, outputs
+// are walked for tags of patterns found or, for patterns of several pieces, scratch
+// keeps how many pieces were found in order and where the last found one ended.
+
+#define MAGIC 0x32544150              // "PAT2"
+#define BYTES_NUMBER 256
+// edge is (target << 8) | byte
+#define EDGE_BYTE_BITS 8
+#define STATES_NUMBER_MAX (1u << (32 - EDGE_BYTE_BITS))
+
+#define STATE_MATCH 1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t states_number;       // without sentinel state
+	uint32_t edges_number;
+	uint32_t outputs_number;
+	uint32_t pieces_number;
+	uint32_t patterns_number;
+	uint32_t split_patterns_number; // of them of several pieces
+	uint32_t reserved;
+} header_type;
+
+typedef struct {
+	uint32_t edges_begin;         // edges of state end where those of next state begin
+	uint32_t outputs_begin;       // so do outputs
+	uint32_t fail;
+	uint32_t output_link;         // nearest state with outputs on failure chain, 0 -- none
+	uint32_t flags;
+} state_type;
+
+typedef struct {
+	uint32_t pattern;
+	uint16_t index;               // of piece in its pattern
+	uint16_t size;
+} piece_type;
+
+// Block layout: header, root edges by byte, states with sentinel, edges sorted
+// by byte within state, outputs (piece numbers), pieces, pieces number and tag of patterns.
+struct pattern_matcher_struct_ {
+	const header_type *header;
+	const uint32_t *root_next;
+	const state_type *states;
+	const uint32_t *edges;
+	const uint32_t *outputs;
+	const piece_type *pieces;
+	const uint32_t *pieces_numbers;
+	const uint32_t *tags;
+	const void *data;
+	size_t size;
+	bool owns_memory;
+};
+
+typedef struct {
+	uint32_t scan;                // progress is valid if it equals scratch scan
+	uint32_t next_piece;
+	size_t end;                   // of last piece found
+} progress_type;
+
+// progress is kept by pattern number, patterns of one piece need none
+struct pattern_matcher_scratch_struct_ {
+	progress_type *progress;
+	size_t patterns_number;
+	uint32_t scan;
+};
+
+static unsigned char ascii_tolower(unsigned char c) {
+	return (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+}
+
+static uint64_t block_size(const header_type *header) {
+	return (
+		sizeof(header_type) +
+		BYTES_NUMBER * sizeof(uint32_t) +
+		((uint64_t)header->states_number + 1) * sizeof(state_type) +
+		(uint64_t)header->edges_number * sizeof(uint32_t) +
+		(uint64_t)header->outputs_number * sizeof(uint32_t) +
+		(uint64_t)header->pieces_number * sizeof(piece_type) +
+		(uint64_t)header->patterns_number * 2 * sizeof(uint32_t)
+	);
+}
+
+static void matcher_set_arrays(pattern_matcher_struct *matcher, const void *data, size_t size) {
+	const char *cur = data;
+	matcher->header = data;
+	cur += sizeof(header_type);
+	matcher->root_next = (const uint32_t *)cur;
+	cur += BYTES_NUMBER * sizeof(uint32_t);
+	matcher->states = (const state_type *)cur;
+	cur += (matcher->header->states_number + 1) * sizeof(state_type);
+	matcher->edges = (const uint32_t *)cur;
+	cur += matcher->header->edges_number * sizeof(uint32_t);
+	matcher->outputs = (const uint32_t *)cur;
+	cur += matcher->header->outputs_number * sizeof(uint32_t);
+	matcher->pieces = (const piece_type *)cur;
+	cur += matcher->header->pieces_number * sizeof(piece_type);
+	matcher->pieces_numbers = (const uint32_t *)cur;
+	cur += matcher->header->patterns_number * sizeof(uint32_t);
+	matcher->tags = (const uint32_t *)cur;
+	matcher->data = data;
+	matcher->size = size;
+}
+
+// Trie under construction: children are sibling lists except those of root.
+typedef struct {
+	uint32_t *first_child;
+	uint32_t *next_sibling;
+	unsigned char *bytes;
+	uint32_t *flags;
+	uint32_t *first_output;       // piece number + 1, 0 -- none
+	size_t nodes_number;
+	size_t nodes_capacity;
+	uint32_t root_children[BYTES_NUMBER]; // 0 -- none
+	piece_type *pieces;
+	uint32_t *next_output;        // of piece: next piece of the same node + 1
+	size_t pieces_number;
+	size_t pieces_capacity;
+	uint32_t *pieces_numbers;
+	uint32_t *tags;
+	size_t patterns_number;
+	size_t patterns_capacity;
+	size_t split_patterns_number;
+	size_t outputs_number;
+	size_t edges_number;          // root edges are kept in root_next only
+} trie_type;
+
+static void trie_free(trie_type *trie) {
+	free(trie->first_child);
+	free(trie->next_sibling);
+	free(trie->bytes);
+	free(trie->flags);
+	free(trie->first_output);
+	free(trie->pieces);
+	free(trie->next_output);
+	free(trie->pieces_numbers);
+	free(trie->tags);
+}
+
+static int grow(void **array, size_t element_size, size_t capacity) {
+	void *new_array = realloc(*array, capacity * element_size);
+	if (new_array == NULL) return 1;
+	*array = new_array;
+	return 0;
+}
+
+static uint32_t trie_child(const trie_type *trie, uint32_t node, unsigned char byte) {
+	if (node == 0) return trie->root_children[byte];
+	for (uint32_t child = trie->first_child[node]; child != 0; child = trie->next_sibling[child]) {
+		if (trie->bytes[child] == byte) return child;
+	}
+	return 0;
+}
+
+static int trie_node_add(trie_type *trie, uint32_t *node_out) {
+	if (trie->nodes_number == trie->nodes_capacity) {
+		size_t capacity = (trie->nodes_capacity != 0 ? trie->nodes_capacity * 2 : 1024);
+		if (
+			grow((void **)&trie->first_child, sizeof(uint32_t), capacity) ||
+			grow((void **)&trie->next_sibling, sizeof(uint32_t), capacity) ||
+			grow((void **)&trie->bytes, sizeof(unsigned char), capacity) ||
+			grow((void **)&trie->flags, sizeof(uint32_t), capacity) ||
+			grow((void **)&trie->first_output, sizeof(uint32_t), capacity)
+		) return 1;
+		trie->nodes_capacity = capacity;
+	}
+	uint32_t node = trie->nodes_number++;
+	trie->first_child[node] = 0;
+	trie->next_sibling[node] = 0;
+	trie->bytes[node] = 0;
+	trie->flags[node] = 0;
+	trie->first_output[node] = 0;
+	*node_out = node;
+	return 0;
+}
+
+// returns node where piece ends, 0 on error
+static uint32_t trie_insert(trie_type *trie, const char *piece, size_t piece_size) {
+	uint32_t node = 0;
+	for (size_t i=0; i<piece_size; ++i) {
+		unsigned char byte = ascii_tolower(piece[i]);
+		uint32_t child = trie_child(trie, node, byte);
+		if (child == 0) {
+			if (trie->nodes_number == STATES_NUMBER_MAX) return 0;
+			if (trie_node_add(trie, &child)) return 0;
+			trie->bytes[child] = byte;
+			if (node == 0) {
+				trie->root_children[byte] = child;
+			} else {
+				trie->next_sibling[child] = trie->first_child[node];
+				trie->first_child[node] = child;
+				++trie->edges_number;
+			}
+		}
+		node = child;
+	}
+	return node;
+}
+
+static int trie_output_add(trie_type *trie, uint32_t node, uint32_t pattern, size_t index, size_t size) {
+	if (trie->pieces_number == trie->pieces_capacity) {
+		size_t capacity = (trie->pieces_capacity != 0 ? trie->pieces_capacity * 2 : 64);
+		if (
+			grow((void **)&trie->pieces, sizeof(piece_type), capacity) ||
+			grow((void **)&trie->next_output, sizeof(uint32_t), capacity)
+		) return 1;
+		trie->pieces_capacity = capacity;
+	}
+	piece_type *piece = &trie->pieces[trie->pieces_number];
+	piece->pattern = pattern;
+	piece->index = index;
+	piece->size = size;
+	trie->next_output[trie->pieces_number] = trie->first_output[node];
+	trie->first_output[node] = ++trie->pieces_number;
+	++trie->outputs_number;
+	return 0;
+}
+
+// returns 1 on error, *added_out is 0 if pattern has no pieces
+static int trie_pattern_add(trie_type *trie, const char *pattern, size_t pattern_size, uint32_t tag, bool *added_out) {
+	size_t pieces_number = 0;
+	const char *piece = NULL;
+	size_t piece_size = 0;
+	for (const char *cur=pattern, *end=pattern+pattern_size; cur<end; ) {
+		const char *star = memchr(cur, '*', end - cur);
+		const char *cur_end = (star != NULL ? star : end);
+		if (cur_end != cur) {
+			if (pieces_number++ == 0) {piece = cur; piece_size = cur_end - cur;}
+		}
+		cur = cur_end + 1;
+	}
+	*added_out = (pieces_number > 0);
+	if (pieces_number == 0) return 0;
+
+	if (trie->patterns_number == trie->patterns_capacity) {
+		size_t capacity = (trie->patterns_capacity != 0 ? trie->patterns_capacity * 2 : 64);
+		if (
+			grow((void **)&trie->pieces_numbers, sizeof(uint32_t), capacity) ||
+			grow((void **)&trie->tags, sizeof(uint32_t), capacity)
+		) return 1;
+		trie->patterns_capacity = capacity;
+	}
+	uint32_t pattern_number = trie->patterns_number++;
+	trie->pieces_numbers[pattern_number] = pieces_number;
+	trie->tags[pattern_number] = tag;
+	if (pieces_number == 1) {
+		uint32_t node = trie_insert(trie, piece, piece_size);
+		if (node == 0) return 1;
+		trie->flags[node] |= STATE_MATCH;
+		return trie_output_add(trie, node, pattern_number, 0, piece_size);
+	}
+
+	++trie->split_patterns_number;
+	size_t index = 0;
+	for (const char *cur=pattern, *end=pattern+pattern_size; cur<end; ) {
+		const char *star = memchr(cur, '*', end - cur);
+		const char *cur_end = (star != NULL ? star : end);
+		if (cur_end != cur) {
+			uint32_t node = trie_insert(trie, cur, cur_end - cur);
+			if (node == 0) return 1;
+			if (trie_output_add(trie, node, pattern_number, index++, cur_end - cur)) return 1;
+		}
+		cur = cur_end + 1;
+	}
+	return 0;
+}
+
+static int node_compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// children of node sorted by byte, each is (byte << 32) | node
+static size_t trie_sorted_children(const trie_type *trie, uint32_t node, uint64_t *children_out) {
+	size_t children_number = 0;
+	if (node == 0) {
+		for (size_t byte=0; byte<BYTES_NUMBER; ++byte) {
+			uint32_t child = trie->root_children[byte];
+			if (child != 0) children_out[children_number++] = (uint64_t)byte << 32 | child;
+		}
+		return children_number;
+	}
+	for (uint32_t child = trie->first_child[node]; child != 0; child = trie->next_sibling[child]) {
+		children_out[children_number++] = (uint64_t)trie->bytes[child] << 32 | child;
+	}
+	qsort(children_out, children_number, sizeof(children_out[0]), node_compare);
+	return children_number;
+}
+
+// Writes trie in BFS order with failure links into a new block.
+static void *trie_compile(trie_type *trie, size_t *size_out) {
+	size_t nodes_number = trie->nodes_number;
+	uint32_t *order = malloc(nodes_number * sizeof(uint32_t));     // BFS position -> node
+	uint32_t *numbers = malloc(nodes_number * sizeof(uint32_t));   // node -> BFS position
+	uint32_t *fail = malloc(nodes_number * sizeof(uint32_t));      // by node
+	uint32_t *output_link = malloc(nodes_number * sizeof(uint32_t)); // by node
+	uint64_t *children = malloc(BYTES_NUMBER * sizeof(uint64_t));
+	void *data = NULL;
+	if (order == NULL || numbers == NULL || fail == NULL || output_link == NULL || children == NULL) goto err_free;
+
+	// BFS with children of each node sorted by byte
+	size_t order_size = 0;
+	order[order_size++] = 0;
+	fail[0] = 0;
+	output_link[0] = 0;
+	for (size_t i=0; i<order_size; ++i) {
+		uint32_t node = order[i];
+		numbers[node] = i;
+		size_t children_number = trie_sorted_children(trie, node, children);
+		for (size_t j=0; j<children_number; ++j) {
+			uint32_t child = (uint32_t)children[j];
+			unsigned char byte = trie->bytes[child];
+			order[order_size++] = child;
+			uint32_t child_fail = 0;
+			if (node != 0) {
+				for (uint32_t f = fail[node]; ; f = fail[f]) {
+					child_fail = trie_child(trie, f, byte);
+					if (child_fail != 0 || f == 0) break;
+				}
+			}
+			fail[child] = child_fail;
+			trie->flags[child] |= trie->flags[child_fail];
+			output_link[child] = (trie->first_output[child_fail] != 0 ? child_fail : output_link[child_fail]);
+		}
+	}
+
+	header_type header;
+	memset(&header, 0, sizeof(header));
+	header.magic = MAGIC;
+	header.states_number = nodes_number;
+	header.edges_number = trie->edges_number;
+	header.outputs_number = trie->outputs_number;
+	header.pieces_number = trie->pieces_number;
+	header.patterns_number = trie->patterns_number;
+	header.split_patterns_number = trie->split_patterns_number;
+	size_t size = block_size(&header);
+	data = calloc(1, size);
+	if (data == NULL) goto err_free;
+	memcpy(data, &header, sizeof(header));
+	pattern_matcher_struct matcher;
+	matcher_set_arrays(&matcher, data, size);
+	uint32_t *root_next = (uint32_t *)matcher.root_next;
+	state_type *states = (state_type *)matcher.states;
+	uint32_t *edges = (uint32_t *)matcher.edges;
+	uint32_t *outputs = (uint32_t *)matcher.outputs;
+
+	for (size_t byte=0; byte<BYTES_NUMBER; ++byte) {
+		root_next[byte] = (trie->root_children[byte] != 0 ? numbers[trie->root_children[byte]] : 0);
+	}
+	size_t edges_number = 0, outputs_number = 0;
+	for (size_t i=0; i<nodes_number; ++i) {
+		uint32_t node = order[i];
+		state_type *state = &states[i];
+		state->edges_begin = edges_number;
+		state->outputs_begin = outputs_number;
+		state->fail = numbers[fail[node]];
+		state->output_link = numbers[output_link[node]];
+		state->flags = trie->flags[node];
+		if (node != 0) {
+			size_t children_number = trie_sorted_children(trie, node, children);
+			for (size_t j=0; j<children_number; ++j) {
+				uint32_t child = (uint32_t)children[j];
+				edges[edges_number++] = numbers[child] << EDGE_BYTE_BITS | trie->bytes[child];
+			}
+		}
+		for (uint32_t output = trie->first_output[node]; output != 0; output = trie->next_output[output - 1]) {
+			outputs[outputs_number++] = output - 1;
+		}
+	}
+	states[nodes_number].edges_begin = edges_number;
+	states[nodes_number].outputs_begin = outputs_number;
+	if (trie->pieces_number > 0) {
+		memcpy((void *)matcher.pieces, trie->pieces, trie->pieces_number * sizeof(piece_type));
+		memcpy((void *)matcher.pieces_numbers, trie->pieces_numbers, trie->patterns_number * sizeof(uint32_t));
+		memcpy((void *)matcher.tags, trie->tags, trie->patterns_number * sizeof(uint32_t));
+	}
+	*size_out = size;
+
+err_free:
+	free(children);
+	free(output_link);
+	free(fail);
+	free(numbers);
+	free(order);
+	return data;
+}
+
+pattern_matcher_struct *pattern_matcher_construct(
+		const char *const *patterns, const size_t *pattern_sizes, const uint32_t *tags, size_t patterns_number
+) {
+	trie_type trie;
+	memset(&trie, 0, sizeof(trie));
+	uint32_t root;
+	if (trie_node_add(&trie, &root)) goto err_trie_free;
+
+	for (size_t i=0; i<patterns_number; ++i) {
+		if (pattern_sizes[i] > PATTERN_MATCHER_PATTERN_SIZE_MAX) continue;
+		bool added;
+		if (trie_pattern_add(&trie, patterns[i], pattern_sizes[i], (tags != NULL ? tags[i] : 0), &added)) goto err_trie_free;
+	}
+	size_t size;
+	void *data = trie_compile(&trie, &size);
+	if (data == NULL) goto err_trie_free;
+	trie_free(&trie);
+
+	pattern_matcher_struct *matcher = malloc(sizeof(pattern_matcher_struct));
+	if (matcher == NULL) {free(data); return NULL;}
+	matcher_set_arrays(matcher, data, size);
+	matcher->owns_memory = true;
+	return matcher;
+
+err_trie_free:
+	trie_free(&trie);
+	return NULL;
+}
+
+static bool block_is_valid(const pattern_matcher_struct *matcher) {
+	const header_type *header = matcher->header;
+	if (header->states_number == 0 || header->states_number > STATES_NUMBER_MAX) return false;
+	for (size_t byte=0; byte<BYTES_NUMBER; ++byte) {
+		if (matcher->root_next[byte] >= header->states_number) return false;
+	}
+	const state_type *states = matcher->states;
+	if (states[0].fail != 0 || states[0].output_link != 0) return false;
+	if (states[0].edges_begin != 0 || states[0].outputs_begin != 0) return false;
+	for (size_t i=0; i<header->states_number; ++i) {
+		const state_type *state = &states[i];
+		if (state[1].edges_begin < state->edges_begin || state[1].edges_begin > header->edges_number) return false;
+		if (state[1].outputs_begin < state->outputs_begin || state[1].outputs_begin > header->outputs_number) return false;
+		if (i > 0 && (state->fail >= i || state->output_link >= i)) return false;
+		for (size_t e=state->edges_begin; e<state[1].edges_begin; ++e) {
+			if ((matcher->edges[e] >> EDGE_BYTE_BITS) >= header->states_number) return false;
+			if (e > state->edges_begin && (uint8_t)matcher->edges[e-1] >= (uint8_t)matcher->edges[e]) return false;
+		}
+	}
+	if (states[header->states_number].edges_begin != header->edges_number) return false;
+	if (states[header->states_number].outputs_begin != header->outputs_number) return false;
+	for (size_t i=0; i<header->outputs_number; ++i) {
+		if (matcher->outputs[i] >= header->pieces_number) return false;
+	}
+	// patterns of several pieces are counted, matching without scratch relies on it
+	size_t split_patterns_number = 0;
+	for (size_t i=0; i<header->patterns_number; ++i) {
+		if (matcher->pieces_numbers[i] == 0) return false;
+		if (matcher->pieces_numbers[i] > 1) ++split_patterns_number;
+	}
+	if (split_patterns_number != header->split_patterns_number) return false;
+	for (size_t i=0; i<header->pieces_number; ++i) {
+		const piece_type *piece = &matcher->pieces[i];
+		if (piece->pattern >= header->patterns_number) return false;
+		if (piece->index >= matcher->pieces_numbers[piece->pattern]) return false;
+	}
+	return true;
+}
+
+pattern_matcher_struct *pattern_matcher_attach(const void *data, size_t size) {
+	if ((uintptr_t)data % sizeof(uint32_t) != 0 || size < sizeof(header_type)) return NULL;
+	const header_type *header = data;
+	if (header->magic != MAGIC || block_size(header) != size) return NULL;
+	pattern_matcher_struct *matcher = malloc(sizeof(pattern_matcher_struct));
+	if (matcher == NULL) return NULL;
+	matcher_set_arrays(matcher, data, size);
+	matcher->owns_memory = false;
+	if (!block_is_valid(matcher)) {
+		free(matcher);
+		return NULL;
+	}
+	return matcher;
+}
+
+void pattern_matcher_destruct(pattern_matcher_struct *matcher) {
+	if (matcher->owns_memory) free((void *)matcher->data);
+	free(matcher);
+}
+
+void pattern_matcher_get_raw(const pattern_matcher_struct *matcher, const void **data_out, size_t *size_out) {
+	*data_out = matcher->data;
+	*size_out = matcher->size;
+}
+
+size_t pattern_matcher_patterns_number(const pattern_matcher_struct *matcher) {
+	return matcher->header->patterns_number;
+}
+
+bool pattern_matcher_needs_scratch(const pattern_matcher_struct *matcher) {
+	return (matcher->header->split_patterns_number > 0);
+}
+
+pattern_matcher_scratch_struct *pattern_matcher_scratch_construct(const pattern_matcher_struct *matcher) {
+	pattern_matcher_scratch_struct *scratch = malloc(sizeof(pattern_matcher_scratch_struct));
+	if (scratch == NULL) return NULL;
+	scratch->patterns_number = matcher->header->patterns_number;
+	scratch->progress = calloc(scratch->patterns_number + 1, sizeof(progress_type));
+	if (scratch->progress == NULL) {
+		free(scratch);
+		return NULL;
+	}
+	scratch->scan = 0;
+	return scratch;
+}
+
+void pattern_matcher_scratch_destruct(pattern_matcher_scratch_struct *scratch) {
+	free(scratch->progress);
+	free(scratch);
+}
+
+static uint32_t next_state(const pattern_matcher_struct *matcher, uint32_t state, unsigned char byte) {
+	while (state != 0) {
+		const state_type *s = &matcher->states[state];
+		for (uint32_t e=s->edges_begin; e<s[1].edges_begin; ++e) {
+			unsigned char edge_byte = (unsigned char)matcher->edges[e];
+			if (edge_byte == byte) return matcher->edges[e] >> EDGE_BYTE_BITS;
+			if (edge_byte > byte) break;
+		}
+		state = s->fail;
+	}
+	return matcher->root_next[byte];
+}
+
+// Pieces of a pattern are taken greedily: each one at its first occurrence
+// that starts after the previous one ended. Returns true if pattern is complete.
+static bool progress_advance(
+		const pattern_matcher_struct *matcher, pattern_matcher_scratch_struct *scratch,
+		const piece_type *piece, size_t end
+) {
+	progress_type *progress = &scratch->progress[piece->pattern];
+	if (progress->scan != scratch->scan) {
+		progress->scan = scratch->scan;
+		progress->next_piece = 0;
+		progress->end = 0;
+	}
+	if (piece->index != progress->next_piece || end - piece->size < progress->end) return false;
+	progress->end = end;
+	return (++progress->next_piece == matcher->pieces_numbers[piece->pattern]);
+}
+
+bool pattern_matcher_matches(
+		const pattern_matcher_struct *matcher, pattern_matcher_scratch_struct *scratch,
+		const char *text, size_t text_size,
+		pattern_matcher_accept_type accept, const void *accept_arg
+) {
+	assert(scratch != NULL || !pattern_matcher_needs_scratch(matcher));
+	if (scratch != NULL && ++scratch->scan == 0) {
+		memset(scratch->progress, 0, scratch->patterns_number * sizeof(progress_type));
+		scratch->scan = 1;
+	}
+	uint32_t state = 0;
+	for (size_t i=0; i<text_size; ++i) {
+		state = next_state(matcher, state, ascii_tolower(text[i]));
+		const state_type *s = &matcher->states[state];
+		bool single_found = (s->flags & STATE_MATCH) != 0;
+		if (single_found && accept == NULL) return true;
+		if (scratch == NULL && !single_found) continue;
+		uint32_t output_state = (s[1].outputs_begin != s->outputs_begin ? state : s->output_link);
+		while (output_state != 0) {
+			const state_type *o = &matcher->states[output_state];
+			for (uint32_t j=o->outputs_begin; j<o[1].outputs_begin; ++j) {
+				const piece_type *piece = &matcher->pieces[matcher->outputs[j]];
+				// without scratch all patterns are of one piece
+				bool complete = (
+					matcher->pieces_numbers[piece->pattern] == 1 ||
+					progress_advance(matcher, scratch, piece, i + 1)
+				);
+				if (complete && (accept == NULL || accept(matcher->tags[piece->pattern], accept_arg))) return true;
+			}
+			output_state = o->output_link;
+		}
+	}
+	return false;
+}
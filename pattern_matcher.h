@@ -0,0 +1,58 @@
+#ifndef PATTERN_MATCHER_H
+#define PATTERN_MATCHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Aho-Corasick automaton matching many patterns in one pass over text.
+// Pattern is a list of pieces separated by '*': it matches if its pieces occur
+// in text in this order without overlapping, e.g. "/download/*.exe";
+// pattern without '*' matches anywhere in text. Matching ignores ASCII case.
+// Each pattern has a tag, so that caller may tell which of the patterns found count.
+
+#define PATTERN_MATCHER_PATTERN_SIZE_MAX 0xFFFF
+
+struct pattern_matcher_struct_;
+typedef struct pattern_matcher_struct_ pattern_matcher_struct;
+
+// Per-thread progress of patterns of several pieces, not needed if there are none.
+struct pattern_matcher_scratch_struct_;
+typedef struct pattern_matcher_scratch_struct_ pattern_matcher_scratch_struct;
+
+// NULL on error; patterns without non-empty pieces and patterns longer than
+// PATTERN_MATCHER_PATTERN_SIZE_MAX are skipped, see pattern_matcher_patterns_number();
+// tags -- tag of each pattern, NULL -- all are 0
+pattern_matcher_struct *pattern_matcher_construct(
+	const char *const *patterns, const size_t *pattern_sizes, const uint32_t *tags, size_t patterns_number
+);
+// Automaton is one position-independent block of memory: saved one may be attached,
+// read-only matcher over memory owned by caller, NULL if memory is malformed
+pattern_matcher_struct *pattern_matcher_attach(const void *data, size_t size);
+void pattern_matcher_destruct(pattern_matcher_struct *matcher);
+void pattern_matcher_get_raw(const pattern_matcher_struct *matcher, const void **data_out, size_t *size_out);
+size_t pattern_matcher_patterns_number(const pattern_matcher_struct *matcher);
+
+// false if all patterns are of one piece
+bool pattern_matcher_needs_scratch(const pattern_matcher_struct *matcher);
+pattern_matcher_scratch_struct *pattern_matcher_scratch_construct(const pattern_matcher_struct *matcher);
+void pattern_matcher_scratch_destruct(pattern_matcher_scratch_struct *scratch);
+// returns true if the tag of pattern found is accepted
+typedef bool (*pattern_matcher_accept_type)(uint32_t tag, const void *arg);
+// scratch -- made for this matcher, NULL if it needs none;
+// accept -- called with tag of each pattern found until it returns true, NULL -- any pattern counts
+bool pattern_matcher_matches(
+	const pattern_matcher_struct *matcher, pattern_matcher_scratch_struct *scratch,
+	const char *text, size_t text_size,
+	pattern_matcher_accept_type accept, const void *accept_arg
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*PATTERN_MATCHER_H*/
@@ -3,7 +3,7 @@
 
 CREATE TABLE "sites" (
 	"domain" TEXT PRIMARY KEY NOT NULL,
-	"categories" TEXT NOT NULL
+	"categories" TEXT NOT NULL -- or BLOB NOT NULL for category blobs, see README
 );
 
 CREATE TABLE "rules" (
@@ -11,4 +11,31 @@ CREATE TABLE "rules" (
 	"allowed" INTEGER NOT NULL
 );
 
+-- optional, see README
+CREATE TABLE "patterns" (
+	"pattern" TEXT NOT NULL,
+	"category_id" INTEGER NOT NULL
+);
+
+-- optional, see README
+CREATE TABLE "group_rules" (
+	"group_id" INTEGER NOT NULL,
+	"category_id" INTEGER NOT NULL,
+	"allowed" INTEGER NOT NULL
+);
+
+-- optional, see README
+CREATE TABLE "group_networks" (
+	"network" TEXT NOT NULL,
+	"group_id" INTEGER NOT NULL
+);
+
+-- optional, see README
+CREATE TABLE "sites_delta" (
+	"seq" INTEGER PRIMARY KEY,
+	"op" TEXT NOT NULL,
+	"domain" TEXT NOT NULL,
+	"categories" TEXT -- NULL for 'delete', BLOB allowed as in sites
+);
+
 --COMMIT;
\ No newline at end of file
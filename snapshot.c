@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "cdebug.h"
+
+static const char snapshot_magic[8] = "ECAPFLT";
+#define BYTE_ORDER_MARK 0x01020304
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t file_size;
+	uint32_t sections_number;
+	uint32_t reserved;
+	uint64_t data_checksum;
+	uint64_t generation;
+	uint64_t header_checksum;
+} header_type;
+
+typedef struct {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t size;
+} section_entry_type;
+
+struct snapshot_struct_ {
+	const unsigned char *data;
+	size_t size;
+};
+
+static void print_errno_err(const char *func, const char *path) {
+	cdebug_printf(CDEBUG_IL_CRITICAL, "%s '%s': %s", func, path, strerror(errno));
+}
+
+static void print_snapshot_err(const char *msg, const char *path) {
+	cdebug_printf(CDEBUG_IL_CRITICAL, "snapshot '%s': %s", path, msg);
+}
+
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+#define CHECKSUM_PRIME 0x100000001b3ULL
+
+static uint64_t checksum_update(uint64_t h, const void *data, size_t size) {
+	const unsigned char *cur = data;
+	while (size >= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, cur, sizeof(word));
+		h = (h ^ word) * CHECKSUM_PRIME;
+		h ^= h >> 29;
+		cur += sizeof(word);
+		size -= sizeof(word);
+	}
+	while (size > 0) {
+		h = (h ^ *cur) * CHECKSUM_PRIME;
+		++cur;
+		--size;
+	}
+	return h;
+}
+
+static uint64_t header_checksum(const header_type *header, const section_entry_type *entries) {
+	header_type header_copy = *header;
+	header_copy.header_checksum = 0;
+	uint64_t h = checksum_update(CHECKSUM_INIT, &header_copy, sizeof(header_copy));
+	return checksum_update(h, entries, header->sections_number * sizeof(entries[0]));
+}
+
+static size_t align_up(size_t offset) {
+	return (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+	const char *cur = data;
+	while (size > 0) {
+		ssize_t written = write(fd, cur, size);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		cur += written;
+		size -= written;
+	}
+	return 0;
+}
+
+int snapshot_write(const char *path, const snapshot_section_data_struct *sections, size_t sections_number) {
+	section_entry_type *entries = calloc(sections_number, sizeof(entries[0]));
+	if (entries == NULL) {print_snapshot_err("calloc", path); return 1;}
+
+	header_type header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = BYTE_ORDER_MARK;
+	header.sections_number = sections_number;
+	header.data_checksum = CHECKSUM_INIT;
+	uint64_t previous_generation;
+	header.generation = (snapshot_read_generation(path, &previous_generation) == 0 ? previous_generation + 1 : 1);
+	size_t offset = align_up(sizeof(header) + sections_number * sizeof(entries[0]));
+	for (size_t i=0; i<sections_number; ++i) {
+		entries[i].type = sections[i].type;
+		entries[i].offset = offset;
+		entries[i].size = sections[i].size;
+		header.data_checksum = checksum_update(header.data_checksum, sections[i].data, sections[i].size);
+		offset = align_up(offset + sections[i].size);
+	}
+	header.file_size = offset;
+	header.header_checksum = header_checksum(&header, entries);
+
+	size_t path_size = strlen(path);
+	char *tmp_path = malloc(path_size + sizeof(".tmp"));
+	if (tmp_path == NULL) {print_snapshot_err("malloc", path); goto err_entries_free;}
+	memcpy(tmp_path, path, path_size);
+	memcpy(tmp_path + path_size, ".tmp", sizeof(".tmp"));
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {print_errno_err("open", tmp_path); goto err_tmp_path_free;}
+	static const char padding[SNAPSHOT_ALIGN];
+	size_t written = sizeof(header) + sections_number * sizeof(entries[0]);
+	if (write_all(fd, &header, sizeof(header))) goto err_write;
+	if (write_all(fd, entries, sections_number * sizeof(entries[0]))) goto err_write;
+	for (size_t i=0; i<sections_number; ++i) {
+		if (write_all(fd, padding, entries[i].offset - written)) goto err_write;
+		if (write_all(fd, sections[i].data, sections[i].size)) goto err_write;
+		written = entries[i].offset + entries[i].size;
+	}
+	if (write_all(fd, padding, header.file_size - written)) goto err_write;
+	if (fsync(fd) != 0) goto err_write;
+	if (close(fd) != 0) {print_errno_err("close", tmp_path); goto err_unlink;}
+	if (rename(tmp_path, path) != 0) {print_errno_err("rename", tmp_path); goto err_unlink;}
+
+	free(tmp_path);
+	free(entries);
+	return 0;
+
+err_write:
+	print_errno_err("write", tmp_path);
+	close(fd);
+err_unlink:
+	unlink(tmp_path);
+err_tmp_path_free:
+	free(tmp_path);
+err_entries_free:
+	free(entries);
+	return 1;
+}
+
+static const section_entry_type *section_entries(const snapshot_struct *snapshot) {
+	return (const section_entry_type *)(snapshot->data + sizeof(header_type));
+}
+
+snapshot_struct *snapshot_map(const char *path) {
+	snapshot_struct *snapshot = malloc(sizeof(snapshot_struct));
+	if (snapshot == NULL) {print_snapshot_err("malloc", path); goto err_return;}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {print_errno_err("open", path); goto err_snapshot_free;}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {print_errno_err("fstat", path); goto err_close;}
+	if ((size_t)st.st_size < sizeof(header_type)) {print_snapshot_err("file is too small", path); goto err_close;}
+	snapshot->size = st.st_size;
+	void *data = mmap(NULL, snapshot->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {print_errno_err("mmap", path); goto err_close;}
+	snapshot->data = data;
+	close(fd);
+	// lookups touch pages at random, so do not read ahead
+	madvise(data, snapshot->size, MADV_RANDOM);
+
+	const header_type *header = (const header_type *)snapshot->data;
+	if (memcmp(header->magic, snapshot_magic, sizeof(header->magic)) != 0) {
+		print_snapshot_err("wrong magic", path);
+		goto err_unmap;
+	}
+	if (header->byte_order != BYTE_ORDER_MARK) {print_snapshot_err("wrong byte order", path); goto err_unmap;}
+	if (header->version != SNAPSHOT_VERSION) {
+		cdebug_printf(
+			CDEBUG_IL_CRITICAL,
+			"snapshot '%s': unsupported version %u (expected %u)",
+			path, header->version, SNAPSHOT_VERSION
+		);
+		goto err_unmap;
+	}
+	if (header->file_size != snapshot->size) {print_snapshot_err("wrong file size", path); goto err_unmap;}
+	if (header->sections_number > (snapshot->size - sizeof(header_type)) / sizeof(section_entry_type)) {
+		print_snapshot_err("wrong sections number", path);
+		goto err_unmap;
+	}
+	const section_entry_type *entries = section_entries(snapshot);
+	if (header->header_checksum != header_checksum(header, entries)) {
+		print_snapshot_err("header checksum mismatch", path);
+		goto err_unmap;
+	}
+	for (size_t i=0; i<header->sections_number; ++i) {
+		if (
+			entries[i].offset % SNAPSHOT_ALIGN != 0 ||
+			entries[i].offset > snapshot->size ||
+			entries[i].size > snapshot->size - entries[i].offset
+		) {
+			print_snapshot_err("section is out of file", path);
+			goto err_unmap;
+		}
+	}
+	return snapshot;
+
+err_unmap:
+	munmap((void *)snapshot->data, snapshot->size);
+	goto err_snapshot_free;
+err_close:
+	close(fd);
+err_snapshot_free:
+	free(snapshot);
+err_return:
+	return NULL;
+}
+
+uint64_t snapshot_generation(const snapshot_struct *snapshot) {
+	return ((const header_type *)snapshot->data)->generation;
+}
+
+int snapshot_read_generation(const char *path, uint64_t *generation_out) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 1;
+	header_type header;
+	ssize_t res = pread(fd, &header, sizeof(header), 0);
+	close(fd);
+	if (
+		res != sizeof(header) ||
+		memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 ||
+		header.byte_order != BYTE_ORDER_MARK ||
+		header.version != SNAPSHOT_VERSION
+	) {
+		return 1;
+	}
+	*generation_out = header.generation;
+	return 0;
+}
+
+void snapshot_unmap(snapshot_struct *snapshot) {
+	munmap((void *)snapshot->data, snapshot->size);
+	free(snapshot);
+}
+
+const void *snapshot_section(const snapshot_struct *snapshot, uint32_t type, size_t *size_out) {
+	const header_type *header = (const header_type *)snapshot->data;
+	const section_entry_type *entries = section_entries(snapshot);
+	for (size_t i=0; i<header->sections_number; ++i) {
+		if (entries[i].type == type) {
+			*size_out = entries[i].size;
+			return snapshot->data + entries[i].offset;
+		}
+	}
+	return NULL;
+}
+
+int snapshot_verify(const snapshot_struct *snapshot) {
+	const header_type *header = (const header_type *)snapshot->data;
+	const section_entry_type *entries = section_entries(snapshot);
+	uint64_t h = CHECKSUM_INIT;
+	for (size_t i=0; i<header->sections_number; ++i) {
+		h = checksum_update(h, snapshot->data + entries[i].offset, entries[i].size);
+	}
+	return (h == header->data_checksum ? 0 : 1);
+}
@@ -0,0 +1,76 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Snapshot file: header, section table and sections aligned to SNAPSHOT_ALIGN.
+// Sections are referenced by offset from file start, so the file is mapped as is.
+// Header checksum covers header and section table and is checked on map,
+// data checksum covers all sections and is checked by snapshot_verify() only
+// so that mapping does not touch data pages.
+// Generation grows each time snapshot is written over the previous one,
+// so that processes mapping the file see that it was replaced.
+
+#define SNAPSHOT_VERSION 7
+#define SNAPSHOT_ALIGN 64
+
+typedef enum {
+	SNAPSHOT_SECTION_CATEGORY_IDS = 1,
+	// deny mask of each group, FILTER_GROUP_DEFAULT first
+	SNAPSHOT_SECTION_DENY_MASK = 2,
+	SNAPSHOT_SECTION_CATEGORY_SETS = 3,
+	SNAPSHOT_SECTION_SITES_SLOTS = 4,
+	SNAPSHOT_SECTION_SITES_KEYS = 5,
+	SNAPSHOT_SECTION_SITES_COUNT = 6,
+	// snapshot_source_struct of db file snapshot was built from
+	SNAPSHOT_SECTION_SOURCE = 7,
+	// pattern_matcher block tagged by category bits, only if db has patterns of categories denied in some group
+	SNAPSHOT_SECTION_PATTERNS = 8,
+	// group ids of groups after FILTER_GROUP_DEFAULT, sorted
+	SNAPSHOT_SECTION_GROUP_IDS = 9,
+	// group_network_struct array, longest networks first
+	SNAPSHOT_SECTION_GROUP_NETWORKS = 10,
+	// int64_t seq of the last 'sites_delta' row merged into sites, only if db has such rows
+	SNAPSHOT_SECTION_DELTA_SEQ = 11
+} snapshot_section_type_enum;
+
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_sec;
+	uint64_t mtime_nsec;
+} snapshot_source_struct;
+
+typedef struct {
+	uint32_t type;
+	const void *data;
+	size_t size;
+} snapshot_section_data_struct;
+
+struct snapshot_struct_;
+typedef struct snapshot_struct_ snapshot_struct;
+
+// writes into temporary file and renames it to path,
+// generation is the one of file replaced + 1, 1 if there is none
+int snapshot_write(const char *path, const snapshot_section_data_struct *sections, size_t sections_number);
+snapshot_struct *snapshot_map(const char *path);
+uint64_t snapshot_generation(const snapshot_struct *snapshot);
+// reads header only, returns 0 if file is a snapshot of current version
+int snapshot_read_generation(const char *path, uint64_t *generation_out);
+void snapshot_unmap(snapshot_struct *snapshot);
+// NULL if there is no such section
+const void *snapshot_section(const snapshot_struct *snapshot, uint32_t type, size_t *size_out);
+// checks data checksum reading whole file, returns 0 if it matches
+int snapshot_verify(const snapshot_struct *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*SNAPSHOT_H*/
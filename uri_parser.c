@@ -1,56 +1,175 @@
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "uri_parser.h"
 
-// authority_end -- after last char
-static size_t authority_scanned_extract_domain(
-		const char *authority, const char *authority_end,
-		const char *last_at, const char *last_colon,
-		const char **domain_out
-	) {
-	const char *domain = authority;
-	const char *domain_end = authority_end;
-	if (domain == domain_end) return 0;
-	// cut userinfo
-	if (last_at != NULL) domain = last_at + 1;
-	if (domain == domain_end) return 0;
-	// cut port
-	if (last_colon != NULL) domain_end = last_colon;
-	if (domain == domain_end) return 0;
-	*domain_out = domain;
-	return domain_end - domain;
-}
+// Authority is scanned for delimiters 16 bytes at a time (scalar loop for the tail
+// and for builds without SSE2), then host bytes are copied into output
+// being lowercased and percent-decoded on the way.
 
-size_t authority_extract_domain(const char *authority, const char **domain_out) {
-	const char *cur = authority;
+// Returns authority end: first '/', '?' or '#' if path_ends, else end.
+static const char *authority_scan(const char *cur, const char *end, int path_ends, const char **last_at_out) {
 	const char *last_at = NULL;
-	const char *last_colon = NULL;
-	while (*cur != '\0') {
+#ifdef __SSE2__
+	const __m128i slash = _mm_set1_epi8('/');
+	const __m128i question = _mm_set1_epi8('?');
+	const __m128i hash = _mm_set1_epi8('#');
+	const __m128i at = _mm_set1_epi8('@');
+	while (end - cur >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)cur);
+		unsigned int end_mask = 0;
+		if (path_ends) {
+			end_mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, slash), _mm_cmpeq_epi8(chunk, question)),
+				_mm_cmpeq_epi8(chunk, hash)
+			));
+		}
+		unsigned int at_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, at));
+		if (end_mask != 0) {
+			unsigned int end_pos = __builtin_ctz(end_mask);
+			at_mask &= (1u << end_pos) - 1;
+			if (at_mask != 0) last_at = cur + 31 - __builtin_clz(at_mask);
+			*last_at_out = last_at;
+			return cur + end_pos;
+		}
+		if (at_mask != 0) last_at = cur + 31 - __builtin_clz(at_mask);
+		cur += 16;
+	}
+#endif
+	for (; cur < end; ++cur) {
+		if (path_ends && (*cur == '/' || *cur == '?' || *cur == '#')) break;
 		if (*cur == '@') last_at = cur;
-		if (*cur == ':') last_colon = cur;
-		++cur;
 	}
-	return authority_scanned_extract_domain(authority, cur, last_at, last_colon, domain_out);
+	*last_at_out = last_at;
+	return cur;
 }
 
-size_t uri_extract_domain(const char *uri, const char **domain_out) {
-	const char *cur = uri;
+static int hex_digit_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
 
-	// scheme://
-	while (*cur != '\0' && *cur != ':') ++cur;
-	if (*cur == '\0') return 0;
-	++cur;
-	if (*cur != '/') return 0;
-	++cur;
-	if (*cur != '/') return 0;
-	++cur;
-
-	// authority
-	const char *authority = cur;
-	const char *last_at = NULL;
-	const char *last_colon = NULL;
-	while (*cur != '\0' && *cur != '/' && *cur != '?' && *cur != '#') {
-		if (*cur == '@') last_at = cur;
-		if (*cur == ':') last_colon = cur;
-		++cur;
+static char ascii_tolower(char c) {
+	return (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+}
+
+static size_t host_normalize(const char *cur, const char *end, char *domain_out) {
+	char *out = domain_out;
+	char *out_end = domain_out + URI_DOMAIN_SIZE_MAX;
+	while (cur < end) {
+#ifdef __SSE2__
+		if (end - cur >= 16 && out_end - out >= 16) {
+			__m128i chunk = _mm_loadu_si128((const __m128i *)cur);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('%'))) == 0) {
+				// signed compare: bytes >= 0x80 are negative and stay as is
+				__m128i upper = _mm_and_si128(
+					_mm_cmpgt_epi8(chunk, _mm_set1_epi8('A' - 1)),
+					_mm_cmplt_epi8(chunk, _mm_set1_epi8('Z' + 1))
+				);
+				chunk = _mm_add_epi8(chunk, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+				_mm_storeu_si128((__m128i *)out, chunk);
+				cur += 16;
+				out += 16;
+				continue;
+			}
+		}
+#endif
+		if (out == out_end) return 0;
+		char c = *cur;
+		if (c == '%') {
+			if (end - cur < 3) return 0;
+			int hi = hex_digit_value(cur[1]);
+			int lo = hex_digit_value(cur[2]);
+			if (hi < 0 || lo < 0 || (hi == 0 && lo == 0)) return 0;
+			c = (char)(hi * 16 + lo);
+			cur += 3;
+		} else {
+			++cur;
+		}
+		*out++ = ascii_tolower(c);
+	}
+	size_t domain_size = out - domain_out;
+	// fully qualified form: example.com. is example.com
+	if (domain_size > 0 && domain_out[domain_size-1] == '.') --domain_size;
+	return domain_size;
+}
+
+// authority_end_out -- NULL or where authority ends
+static size_t authority_range_extract_domain(
+		const char *authority, const char *end, int path_ends,
+		char *domain_out, const char **authority_end_out
+) {
+	const char *last_at;
+	const char *authority_end = authority_scan(authority, end, path_ends, &last_at);
+	if (authority_end_out != NULL) *authority_end_out = authority_end;
+	// cut userinfo
+	const char *host = (last_at != NULL ? last_at + 1 : authority);
+	const char *host_end = authority_end;
+	if (host < host_end && *host == '[') {
+		// IPv6 literal: [addr] or [addr]:port
+		const char *bracket = memchr(host, ']', host_end - host);
+		if (bracket == NULL) return 0;
+		if (bracket + 1 != host_end && bracket[1] != ':') return 0;
+		host += 1;
+		host_end = bracket;
+	} else {
+		// cut port
+		for (const char *cur = host_end; cur > host; --cur) {
+			if (cur[-1] == ':') {host_end = cur - 1; break;}
+		}
 	}
-	return authority_scanned_extract_domain(authority, cur, last_at, last_colon, domain_out);
+	if (host == host_end) return 0;
+	return host_normalize(host, host_end, domain_out);
+}
+
+size_t authority_extract_domain(const char *authority, char *domain_out) {
+	return authority_extract_domain_n(authority, strlen(authority), domain_out);
+}
+
+size_t uri_extract_domain(const char *uri, char *domain_out) {
+	return uri_extract_domain_n(uri, strlen(uri), domain_out);
+}
+
+size_t authority_extract_domain_n(const char *authority, size_t authority_size, char *domain_out) {
+	return authority_range_extract_domain(authority, authority + authority_size, 0, domain_out, NULL);
+}
+
+size_t uri_extract_domain_n(const char *uri, size_t uri_size, char *domain_out) {
+	size_t path_offset;
+	return uri_extract_domain_path_n(uri, uri_size, domain_out, &path_offset);
+}
+
+// Returns what follows "scheme://" at uri start, NULL if there is none:
+// ':' of a path or query, e.g. "/go?u=http://host/", is not a scheme end.
+static const char *scheme_skip(const char *uri, const char *end) {
+	const char *cur = uri;
+	if (cur == end || !((*cur >= 'a' && *cur <= 'z') || (*cur >= 'A' && *cur <= 'Z'))) return NULL;
+	for (++cur; cur < end; ++cur) {
+		char c = *cur;
+		if (!(
+			(c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '+' || c == '-' || c == '.'
+		)) break;
+	}
+	if (end - cur < 3 || cur[0] != ':' || cur[1] != '/' || cur[2] != '/') return NULL;
+	return cur + 3;
+}
+
+int uri_has_scheme_n(const char *uri, size_t uri_size) {
+	return (scheme_skip(uri, uri + uri_size) != NULL);
+}
+
+size_t uri_extract_domain_path_n(const char *uri, size_t uri_size, char *domain_out, size_t *path_offset_out) {
+	const char *end = uri + uri_size;
+
+	const char *cur = scheme_skip(uri, end);
+	if (cur == NULL) return 0;
+
+	const char *authority_end;
+	size_t domain_size = authority_range_extract_domain(cur, end, 1, domain_out, &authority_end);
+	*path_offset_out = authority_end - uri;
+	return domain_size;
 }
@@ -3,7 +3,20 @@
 
 #include <stddef.h>
 
-size_t authority_extract_domain(const char *authority, const char **domain_out);
-size_t uri_extract_domain(const char *uri, const char **domain_out);
+// Extracted domain is normalized: percent-decoded, lowercased, without trailing dot,
+// IPv6 literal is without brackets. Domain longer than URI_DOMAIN_SIZE_MAX is not extracted.
+#define URI_DOMAIN_SIZE_MAX 255
+
+// domain_out -- buffer of URI_DOMAIN_SIZE_MAX bytes, not null-terminated;
+// return domain size, 0 if uri has no valid domain
+size_t authority_extract_domain(const char *authority, char *domain_out);
+size_t uri_extract_domain(const char *uri, char *domain_out);
+// uri of uri_size bytes, need not be null-terminated
+size_t authority_extract_domain_n(const char *authority, size_t authority_size, char *domain_out);
+size_t uri_extract_domain_n(const char *uri, size_t uri_size, char *domain_out);
+// also sets *path_offset_out to offset of what follows authority: path, query, fragment
+size_t uri_extract_domain_path_n(const char *uri, size_t uri_size, char *domain_out, size_t *path_offset_out);
+// 1 if uri starts with "scheme://", scheme being a letter followed by letters, digits, '+', '-' or '.'
+int uri_has_scheme_n(const char *uri, size_t uri_size);
 
 #endif/*URI_PARSER_H*/
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+#include "verdict_cache.h"
+#include "hash_index.h"
+
+// Entries hold keys inline and take one cache line each.
+// Open-addressing table maps key hash to entry, CLOCK hand walks entries:
+// hit sets referenced bit, hand clears it and evicts the first entry
+// that was not referenced since the previous pass.
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+	uint64_t hash;
+	uint8_t key_size;
+	verdict_cache_value_type value;
+	uint8_t referenced;
+	char key[VERDICT_CACHE_KEY_SIZE_MAX];
+} entry_type;
+
+struct verdict_cache_struct_ {
+	entry_type *entries;
+	size_t size;
+	size_t used;
+	size_t hand;
+	uint32_t *table;              // entry number + 1, 0 -- empty slot
+	size_t mask;                  // table capacity - 1, capacity is power of 2
+	// written by owner thread only, read by any thread
+	verdict_cache_stats_struct stats;
+};
+
+static void counter_increment(uint64_t *counter) {
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t key_hash(const char *key, size_t key_size) {
+	hash_index_hash_type h = HASH_INDEX_HASH_INIT;
+	for (size_t i=key_size; i>0; --i) h = hash_index_hash_step(h, key[i-1]);
+	return hash_index_hash_finish(h);
+}
+
+verdict_cache_struct *verdict_cache_construct(size_t size) {
+	if (size == 0 || size > UINT32_MAX / 2) return NULL;
+	verdict_cache_struct *cache = malloc(sizeof(verdict_cache_struct));
+	if (cache == NULL) return NULL;
+	cache->entries = aligned_alloc(CACHE_LINE_SIZE, size * sizeof(entry_type));
+	if (cache->entries == NULL) goto err_cache_free;
+	size_t capacity = 16;
+	while (capacity < size * 2) capacity *= 2;
+	cache->table = calloc(capacity, sizeof(cache->table[0]));
+	if (cache->table == NULL) goto err_entries_free;
+	cache->size = size;
+	cache->used = 0;
+	cache->hand = 0;
+	cache->mask = capacity - 1;
+	memset(&cache->stats, 0, sizeof(cache->stats));
+	return cache;
+
+err_entries_free:
+	free(cache->entries);
+err_cache_free:
+	free(cache);
+	return NULL;
+}
+
+void verdict_cache_destruct(verdict_cache_struct *cache) {
+	free(cache->table);
+	free(cache->entries);
+	free(cache);
+}
+
+bool verdict_cache_get(
+		verdict_cache_struct *cache,
+		const char *key, size_t key_size,
+		verdict_cache_value_type *value_out
+) {
+	if (key_size == 0 || key_size > VERDICT_CACHE_KEY_SIZE_MAX) {
+		counter_increment(&cache->stats.misses);
+		return false;
+	}
+	uint64_t hash = key_hash(key, key_size);
+	for (size_t i=hash&cache->mask; cache->table[i]!=0; i=(i+1)&cache->mask) {
+		entry_type *entry = &cache->entries[cache->table[i] - 1];
+		if (entry->hash == hash && entry->key_size == key_size && memcmp(entry->key, key, key_size) == 0) {
+			entry->referenced = 1;
+			*value_out = entry->value;
+			counter_increment(&cache->stats.hits);
+			return true;
+		}
+	}
+	counter_increment(&cache->stats.misses);
+	return false;
+}
+
+// removes table slot of entry, shifting back the following slots of its probe run
+static void table_remove(verdict_cache_struct *cache, size_t entry_number) {
+	const entry_type *entry = &cache->entries[entry_number];
+	size_t i = entry->hash & cache->mask;
+	while (cache->table[i] != entry_number + 1) i = (i + 1) & cache->mask;
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & cache->mask;
+		if (cache->table[j] == 0) break;
+		size_t home = cache->entries[cache->table[j] - 1].hash & cache->mask;
+		// slot j may move to i only if its home is not in (i, j] cyclically
+		bool home_between = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+		if (home_between) continue;
+		cache->table[i] = cache->table[j];
+		i = j;
+	}
+	cache->table[i] = 0;
+}
+
+void verdict_cache_put(
+		verdict_cache_struct *cache,
+		const char *key, size_t key_size,
+		verdict_cache_value_type value
+) {
+	if (key_size == 0 || key_size > VERDICT_CACHE_KEY_SIZE_MAX) return;
+	size_t entry_number;
+	if (cache->used < cache->size) {
+		entry_number = cache->used++;
+	} else {
+		while (cache->entries[cache->hand].referenced) {
+			cache->entries[cache->hand].referenced = 0;
+			cache->hand = (cache->hand + 1 == cache->size ? 0 : cache->hand + 1);
+		}
+		entry_number = cache->hand;
+		cache->hand = (cache->hand + 1 == cache->size ? 0 : cache->hand + 1);
+		table_remove(cache, entry_number);
+		counter_increment(&cache->stats.evictions);
+	}
+
+	entry_type *entry = &cache->entries[entry_number];
+	entry->hash = key_hash(key, key_size);
+	entry->key_size = key_size;
+	entry->value = value;
+	entry->referenced = 0;
+	memcpy(entry->key, key, key_size);
+	size_t i = entry->hash & cache->mask;
+	while (cache->table[i] != 0) i = (i + 1) & cache->mask;
+	cache->table[i] = entry_number + 1;
+}
+
+void verdict_cache_get_stats(const verdict_cache_struct *cache, verdict_cache_stats_struct *stats_out) {
+	stats_out->hits = __atomic_load_n(&cache->stats.hits, __ATOMIC_RELAXED);
+	stats_out->misses = __atomic_load_n(&cache->stats.misses, __ATOMIC_RELAXED);
+	stats_out->evictions = __atomic_load_n(&cache->stats.evictions, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,51 @@
+#ifndef VERDICT_CACHE_H
+#define VERDICT_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fixed-size cache of small values keyed by short strings, evicted by CLOCK.
+// Not synchronized: each thread uses its own cache.
+
+// longer keys are not cached
+#define VERDICT_CACHE_KEY_SIZE_MAX 53
+
+typedef uint8_t verdict_cache_value_type;
+
+struct verdict_cache_struct_;
+typedef struct verdict_cache_struct_ verdict_cache_struct;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} verdict_cache_stats_struct;
+
+// size -- max number of entries, must be > 0
+verdict_cache_struct *verdict_cache_construct(size_t size);
+void verdict_cache_destruct(verdict_cache_struct *cache);
+// counts hit or miss
+bool verdict_cache_get(
+	verdict_cache_struct *cache,
+	const char *key, size_t key_size,
+	verdict_cache_value_type *value_out
+);
+// key must not be in cache already
+void verdict_cache_put(
+	verdict_cache_struct *cache,
+	const char *key, size_t key_size,
+	verdict_cache_value_type value
+);
+// may be called from any thread while owner thread uses cache
+void verdict_cache_get_stats(const verdict_cache_struct *cache, verdict_cache_stats_struct *stats_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*VERDICT_CACHE_H*/